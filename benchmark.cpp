@@ -0,0 +1,458 @@
+// Measures a mounted fuse-clipboard with the mock clipboard, so no display server is needed
+// For every payload size and change interval, mounts a fresh filesystem, then runs getattr, readdir and read from several
+// threads at once and reports throughput and latency percentiles
+// Only needs /dev/fuse and the fuse-clipboard binary, which is given with --binary or found next to this one
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <iterator> // std::size
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+struct BenchmarkOptions
+{
+    std::string binary;
+    // Empty makes a temporary directory
+    std::string mountPoint;
+    std::vector<size_t> sizes = {size_t(4) << 10, size_t(64) << 10, size_t(1) << 20, size_t(16) << 20, size_t(256) << 20,
+                                 size_t(1) << 30};
+    std::vector<size_t> threadCounts = {1, 4, 16};
+    // Milliseconds between changes of the mock clipboard. 0 never changes it
+    std::vector<size_t> changeIntervals = {0, 100};
+    size_t formatsCount = 4;
+    std::chrono::milliseconds duration{2000};
+    // Given to fuse-clipboard as they are, like --lowlevel
+    std::vector<std::string> mountArguments;
+};
+
+// Result of running one operation from several threads for a while
+struct Measurement
+{
+    uint64_t operations = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+    // Latency of every operation, in nanoseconds
+    std::vector<int64_t> latencies;
+};
+
+// Returns true and sets bytes if the operation succeeded
+using Operation = std::function<bool(size_t threadIndex, uint64_t iteration, uint64_t& bytes)>;
+
+const char* const USAGE =
+    "Usage: fuse-clipboard-bench [options] [-- fuse-clipboard options]\n"
+    "  --binary=PATH        fuse-clipboard binary. Default: next to this one\n"
+    "  --mount=DIR          Empty directory to mount at. Default: a new temporary directory\n"
+    "  --sizes=LIST         Payload sizes, with K, M or G suffixes. Default: 4K,64K,1M,16M,256M,1G\n"
+    "  --threads=LIST       Numbers of threads. Default: 1,4,16\n"
+    "  --intervals=LIST     Milliseconds between clipboard changes, 0 for none. Default: 0,100\n"
+    "  --formats=N          Formats of the mock clipboard. Default: 4\n"
+    "  --duration=MS        How long each operation runs for each thread count. Default: 2000\n";
+
+std::optional<size_t> parseSize(std::string_view text)
+{
+    size_t shift = 0;
+    if (!text.empty())
+    {
+        switch (text.back())
+        {
+        case 'K':
+        case 'k':
+            shift = 10;
+            break;
+        case 'M':
+        case 'm':
+            shift = 20;
+            break;
+        case 'G':
+        case 'g':
+            shift = 30;
+            break;
+        }
+    }
+    if (shift != 0)
+    {
+        text.remove_suffix(1);
+    }
+    if (text.empty() || text.find_first_not_of("0123456789") != std::string_view::npos)
+    {
+        return {};
+    }
+    return std::stoull(std::string(text)) << shift;
+}
+
+std::optional<std::vector<size_t>> parseSizeList(std::string_view list)
+{
+    std::vector<size_t> sizes;
+    while (!list.empty())
+    {
+        const size_t commaIndex = list.find(',');
+        const std::optional<size_t> size = parseSize(list.substr(0, commaIndex));
+        if (!size)
+        {
+            return {};
+        }
+        sizes.push_back(*size);
+        list = commaIndex == std::string_view::npos ? std::string_view() : list.substr(commaIndex + 1);
+    }
+    return sizes;
+}
+
+// Directory of the running executable, with a trailing slash
+std::string executableDirectory()
+{
+    std::string path(4096, '\0');
+    const ssize_t length = readlink("/proc/self/exe", path.data(), path.size());
+    if (length <= 0)
+    {
+        return std::string();
+    }
+    path.resize(length);
+    return path.substr(0, path.rfind('/') + 1);
+}
+
+std::optional<BenchmarkOptions> parseOptions(int argc, char* argv[])
+{
+    BenchmarkOptions options;
+    options.binary = executableDirectory() + "fuse-clipboard";
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string_view argument(argv[i]);
+        const size_t equalsIndex = argument.find('=');
+        const std::string_view name = argument.substr(0, equalsIndex);
+        const std::string_view value = equalsIndex == std::string_view::npos ? std::string_view() : argument.substr(equalsIndex + 1);
+        std::optional<std::vector<size_t>> list;
+        if (name == "--")
+        {
+            options.mountArguments.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else if (name == "--binary" && !value.empty())
+        {
+            options.binary = value;
+        }
+        else if (name == "--mount" && !value.empty())
+        {
+            options.mountPoint = value;
+        }
+        else if (name == "--sizes" && (list = parseSizeList(value)) && !list->empty())
+        {
+            options.sizes = std::move(*list);
+        }
+        else if (name == "--threads" && (list = parseSizeList(value)) && !list->empty() &&
+                 std::find(list->begin(), list->end(), 0) == list->end())
+        {
+            options.threadCounts = std::move(*list);
+        }
+        else if (name == "--intervals" && (list = parseSizeList(value)) && !list->empty())
+        {
+            options.changeIntervals = std::move(*list);
+        }
+        else if (name == "--formats" && (list = parseSizeList(value)) && list->size() == 1 && list->front() > 0)
+        {
+            options.formatsCount = list->front();
+        }
+        else if (name == "--duration" && (list = parseSizeList(value)) && list->size() == 1 && list->front() > 0)
+        {
+            options.duration = std::chrono::milliseconds(list->front());
+        }
+        else
+        {
+            return {};
+        }
+    }
+    return options;
+}
+
+// Runs fuse-clipboard at mountPoint until unmount() is called. It always stays in the foreground
+class MountedFileSystem
+{
+  public:
+    MountedFileSystem(const BenchmarkOptions& options, size_t size, size_t changeInterval) : m_mountPoint(options.mountPoint)
+    {
+        std::vector<std::string> arguments = {
+            options.binary,
+            "--mock",
+            "--mock-formats=" + std::to_string(options.formatsCount),
+            "--mock-size=" + std::to_string(size),
+            "--mock-interval=" + std::to_string(changeInterval),
+        };
+        arguments.insert(arguments.end(), options.mountArguments.begin(), options.mountArguments.end());
+        arguments.push_back(m_mountPoint);
+        std::vector<char*> argv;
+        for (std::string& argument : arguments)
+        {
+            argv.push_back(argument.data());
+        }
+        argv.push_back(nullptr);
+
+        struct stat parent = {};
+        stat(m_mountPoint.c_str(), &parent);
+        m_pid = fork();
+        if (m_pid == 0)
+        {
+            execv(argv[0], argv.data());
+            std::perror(argv[0]);
+            _exit(127);
+        }
+        // Mounted once the clipboard directory is on another device than the empty mount point was
+        const Clock::time_point deadline = Clock::now() + std::chrono::seconds(10);
+        while (m_pid > 0 && Clock::now() < deadline)
+        {
+            struct stat clipboard = {};
+            if (stat((m_mountPoint + "/clipboard").c_str(), &clipboard) == 0 && clipboard.st_dev != parent.st_dev)
+            {
+                m_isMounted = true;
+                return;
+            }
+            if (waitpid(m_pid, nullptr, WNOHANG) == m_pid)
+            {
+                m_pid = -1;
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    ~MountedFileSystem()
+    {
+        unmount();
+    }
+
+    bool isMounted() const
+    {
+        return m_isMounted;
+    }
+
+    // fuse-clipboard unmounts itself when it is terminated
+    void unmount()
+    {
+        if (m_pid <= 0)
+        {
+            return;
+        }
+        kill(m_pid, SIGTERM);
+        waitpid(m_pid, nullptr, 0);
+        m_pid = -1;
+        m_isMounted = false;
+    }
+
+  private:
+    const std::string m_mountPoint;
+    pid_t m_pid = -1;
+    bool m_isMounted = false;
+};
+
+Measurement measure(size_t threadCount, std::chrono::milliseconds duration, const Operation& operation)
+{
+    std::vector<Measurement> threadMeasurements(threadCount);
+    std::vector<std::thread> threads;
+    std::atomic<bool> stop = false;
+    const Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        threads.emplace_back([&operation, &stop, &measurement = threadMeasurements[i], i]()
+            {
+                // Every thread finishes at least one operation, so slow reads of large payloads are still measured
+                for (uint64_t iteration = 0; iteration == 0 || !stop.load(std::memory_order_relaxed); ++iteration)
+                {
+                    uint64_t bytes = 0;
+                    const Clock::time_point operationStart = Clock::now();
+                    const bool succeeded = operation(i, iteration, bytes);
+                    measurement.latencies.push_back((Clock::now() - operationStart).count());
+                    ++measurement.operations;
+                    measurement.errors += !succeeded;
+                    measurement.bytes += bytes;
+                }
+            });
+    }
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    Measurement total;
+    total.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    for (Measurement& measurement : threadMeasurements)
+    {
+        total.operations += measurement.operations;
+        total.errors += measurement.errors;
+        total.bytes += measurement.bytes;
+        total.latencies.insert(total.latencies.end(), measurement.latencies.begin(), measurement.latencies.end());
+    }
+    return total;
+}
+
+// Latency at percentile in microseconds. Sorts latencies
+double percentile(std::vector<int64_t>& latencies, double percentile)
+{
+    if (latencies.empty())
+    {
+        return 0;
+    }
+    const size_t index = std::min(latencies.size() - 1, static_cast<size_t>(percentile / 100 * latencies.size()));
+    std::nth_element(latencies.begin(), latencies.begin() + index, latencies.end());
+    return latencies[index] / 1000.0;
+}
+
+std::string formatSize(size_t size)
+{
+    const char* const suffixes[] = {"B", "KiB", "MiB", "GiB"};
+    size_t suffixIndex = 0;
+    while (suffixIndex + 1 < std::size(suffixes) && size >= 1024 && size % 1024 == 0)
+    {
+        size /= 1024;
+        ++suffixIndex;
+    }
+    return std::to_string(size) + ' ' + suffixes[suffixIndex];
+}
+
+void printHeader()
+{
+    std::printf("%-10s %10s %8s %-8s %12s %10s %12s %12s %8s\n", "size", "interval", "threads", "op", "ops/s", "MiB/s", "p50 us",
+                "p99 us", "errors");
+    std::fflush(stdout);
+}
+
+void printMeasurement(size_t size, size_t changeInterval, size_t threadCount, const char* operationName, Measurement& measurement)
+{
+    const std::string interval = changeInterval ? std::to_string(changeInterval) + " ms" : "never";
+    std::printf("%-10s %10s %8zu %-8s %12.0f %10.1f %12.1f %12.1f %8llu\n", formatSize(size).c_str(), interval.c_str(), threadCount,
+                operationName, measurement.operations / measurement.seconds, measurement.bytes / measurement.seconds / (1 << 20),
+                percentile(measurement.latencies, 50), percentile(measurement.latencies, 99),
+                static_cast<unsigned long long>(measurement.errors));
+    std::fflush(stdout);
+}
+
+// Reads the whole file in chunks, like cat
+bool readFile(const std::string& path, std::vector<char>& buffer, uint64_t& bytes)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    ssize_t count;
+    while ((count = read(fd, buffer.data(), buffer.size())) > 0)
+    {
+        bytes += count;
+    }
+    close(fd);
+    return count == 0;
+}
+
+bool readDirectory(const std::string& path)
+{
+    DIR* directory = opendir(path.c_str());
+    if (!directory)
+    {
+        return false;
+    }
+    while (readdir(directory))
+    {
+    }
+    closedir(directory);
+    return true;
+}
+
+void runWorkloads(const BenchmarkOptions& options, size_t size, size_t changeInterval)
+{
+    MountedFileSystem fileSystem(options, size, changeInterval);
+    if (!fileSystem.isMounted())
+    {
+        std::fprintf(stderr, "Couldn't mount %s at %s\n", options.binary.c_str(), options.mountPoint.c_str());
+        return;
+    }
+    const std::string directoryPath = options.mountPoint + "/clipboard/application";
+    std::vector<std::string> filePaths;
+    for (size_t i = 0; i < options.formatsCount; ++i)
+    {
+        filePaths.push_back(directoryPath + "/file.x-mock-" + std::to_string(i));
+    }
+    const size_t maxThreadCount = *std::max_element(options.threadCounts.begin(), options.threadCounts.end());
+    std::vector<std::vector<char>> buffers(maxThreadCount, std::vector<char>(128 * 1024));
+
+    for (const size_t threadCount : options.threadCounts)
+    {
+        // Threads start at different formats, so they don't all wait on the same one
+        Measurement getattrMeasurement = measure(threadCount, options.duration, [&filePaths](size_t threadIndex, uint64_t iteration, uint64_t&)
+            {
+                struct stat stbuf;
+                return stat(filePaths[(threadIndex + iteration) % filePaths.size()].c_str(), &stbuf) == 0;
+            });
+        printMeasurement(size, changeInterval, threadCount, "getattr", getattrMeasurement);
+
+        Measurement readdirMeasurement = measure(threadCount, options.duration, [&directoryPath](size_t, uint64_t, uint64_t&)
+            {
+                return readDirectory(directoryPath);
+            });
+        printMeasurement(size, changeInterval, threadCount, "readdir", readdirMeasurement);
+
+        Measurement readMeasurement = measure(threadCount, options.duration, [&filePaths, &buffers](size_t threadIndex, uint64_t iteration, uint64_t& bytes)
+            {
+                return readFile(filePaths[(threadIndex + iteration) % filePaths.size()], buffers[threadIndex], bytes);
+            });
+        printMeasurement(size, changeInterval, threadCount, "read", readMeasurement);
+    }
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    std::optional<BenchmarkOptions> options = parseOptions(argc, argv);
+    if (!options)
+    {
+        std::cerr << USAGE;
+        return EXIT_FAILURE;
+    }
+    bool removeMountPoint = false;
+    if (options->mountPoint.empty())
+    {
+        char mountPoint[] = "/tmp/fuse-clipboard-bench-XXXXXX";
+        if (!mkdtemp(mountPoint))
+        {
+            std::perror("mkdtemp");
+            return EXIT_FAILURE;
+        }
+        options->mountPoint = mountPoint;
+        removeMountPoint = true;
+    }
+
+    printHeader();
+    for (const size_t changeInterval : options->changeIntervals)
+    {
+        for (const size_t size : options->sizes)
+        {
+            runWorkloads(*options, size, changeInterval);
+        }
+    }
+
+    if (removeMountPoint)
+    {
+        rmdir(options->mountPoint.c_str());
+    }
+    return EXIT_SUCCESS;
+}
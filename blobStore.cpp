@@ -0,0 +1,77 @@
+#include "blobStore.hpp"
+
+#include "dataHash.hpp"
+#include "memfdMimeDataSnapshot.hpp"
+#include "stats.hpp"
+
+#include <algorithm> // std::max
+#include <utility>   // std::move
+#include <vector>
+
+BlobStore::BlobStore(size_t spillThreshold) : m_spillThreshold(spillThreshold)
+{
+}
+
+std::shared_ptr<const MimeDataSnapshot> BlobStore::intern(std::shared_ptr<const MimeDataSnapshot> data)
+{
+    // Hashing and comparing are done without the lock, so interning a large payload doesn't block other threads
+    const uint64_t hash = hashData(data->data());
+
+    std::vector<std::shared_ptr<const MimeDataSnapshot>> candidates;
+    {
+        std::lock_guard lock(m_mutex);
+        auto [it, itEnd] = m_blobs.equal_range(hash);
+        for (; it != itEnd; ++it)
+        {
+            if (std::shared_ptr<const MimeDataSnapshot> candidate = it->second.lock())
+            {
+                candidates.push_back(std::move(candidate));
+            }
+        }
+    }
+    for (std::shared_ptr<const MimeDataSnapshot>& candidate : candidates)
+    {
+        if (candidate->data() == data->data())
+        {
+            Stats::add(Stats::Counter::BlobStoreHits);
+            return std::move(candidate);
+        }
+    }
+
+    Stats::add(Stats::Counter::BlobStoreMisses);
+    data->setContentHash(hash);
+    // Only payloads that are actually stored are spilled. If it fails, the payload just stays on the heap
+    if (m_spillThreshold != 0 && data->data().size() >= m_spillThreshold)
+    {
+        if (std::shared_ptr<const MimeDataSnapshot> spilledData = MemfdMimeDataSnapshot::create(data->data()))
+        {
+            spilledData->setContentHash(hash);
+            data = std::move(spilledData);
+        }
+    }
+
+    // Another thread may store the same bytes at the same time. Then they are just not shared, which is harmless
+    std::lock_guard lock(m_mutex);
+    m_blobs.emplace(hash, data);
+    if (m_blobs.size() >= m_sweepThreshold)
+    {
+        sweepExpired();
+    }
+    return data;
+}
+
+void BlobStore::sweepExpired()
+{
+    for (auto it = m_blobs.begin(); it != m_blobs.end();)
+    {
+        if (it->second.expired())
+        {
+            it = m_blobs.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    m_sweepThreshold = std::max<size_t>(64, m_blobs.size() * 2);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "clipboardSnapshot.hpp"
+#include "stats.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Stores each distinct payload once, keyed by its hash
+// Formats with the same bytes, like image/x-icon and image/x-ico, and the same format in several snapshots share one buffer
+// Only holds weak references, so a payload is freed as soon as no snapshot uses it
+class BlobStore
+{
+public:
+    // Payloads of at least spillThreshold bytes are moved into a memfd when they are stored. 0 never moves them
+    explicit BlobStore(size_t spillThreshold = 0);
+
+    // Returns a stored payload with the same bytes as data if there is one, otherwise stores data and returns it
+    // Either way the returned payload knows its contentHash(), so it is never hashed again
+    // Can be called from any thread
+    std::shared_ptr<const MimeDataSnapshot> intern(std::shared_ptr<const MimeDataSnapshot> data);
+
+private:
+    const size_t m_spillThreshold;
+    Stats::TimedMutex m_mutex;
+    std::unordered_multimap<uint64_t, std::weak_ptr<const MimeDataSnapshot>> m_blobs;
+    // Expired references are removed when the store grows past this, so it stays proportional to the live payloads
+    size_t m_sweepThreshold = 64;
+
+    // Must hold m_mutex
+    void sweepExpired();
+};
@@ -0,0 +1,177 @@
+#include "changeEventLog.hpp"
+
+#include <algorithm>
+#include <utility> // std::move
+
+ChangeEventLog::ChangeEventLog(size_t capacity) : m_capacity(std::max<size_t>(capacity, 1))
+{
+}
+
+void ChangeEventLog::push(std::string event)
+{
+    std::vector<std::pair<Waiter, std::optional<std::string>>> replies;
+    std::unordered_map<const Reader*, std::function<void()>> pollNotifies;
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_stopped)
+        {
+            return;
+        }
+        m_events.push_back(std::move(event));
+        ++m_endSequence;
+        if (m_events.size() > m_capacity)
+        {
+            m_events.pop_front();
+        }
+        for (PendingRead& pendingRead : m_pendingReads)
+        {
+            replies.emplace_back(std::move(pendingRead.waiter), readLocked(*pendingRead.reader, pendingRead.size));
+        }
+        m_pendingReads.clear();
+        pollNotifies.swap(m_pollNotifies);
+    }
+    m_condition.notify_all();
+    // Called without the lock, so they can read and poll again
+    for (auto& [waiter, data] : replies)
+    {
+        waiter(std::move(data));
+    }
+    for (auto& [reader, notify] : pollNotifies)
+    {
+        notify();
+    }
+}
+
+ChangeEventLog::Reader ChangeEventLog::makeReader() const
+{
+    std::lock_guard lock(m_mutex);
+    return {m_endSequence, {}};
+}
+
+bool ChangeEventLog::isStopped() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_stopped;
+}
+
+std::optional<std::string> ChangeEventLog::read(Reader& reader, size_t size)
+{
+    std::lock_guard lock(m_mutex);
+    return readLocked(reader, size);
+}
+
+std::optional<std::string> ChangeEventLog::waitRead(Reader& reader, size_t size, std::chrono::milliseconds timeout)
+{
+    std::unique_lock lock(m_mutex);
+    m_condition.wait_for(lock, timeout, [this, &reader]() { return m_stopped || canReadLocked(reader); });
+    return readLocked(reader, size);
+}
+
+void ChangeEventLog::readLater(Reader& reader, size_t size, const void* key, const std::function<bool()>& isCancelled, Waiter waiter)
+{
+    std::optional<std::string> data;
+    {
+        std::lock_guard lock(m_mutex);
+        data = readLocked(reader, size);
+        if (!data && !m_stopped && !isCancelled())
+        {
+            m_pendingReads.push_back({key, &reader, size, std::move(waiter)});
+            return;
+        }
+    }
+    waiter(std::move(data));
+}
+
+void ChangeEventLog::cancel(const void* key)
+{
+    Waiter waiter;
+    {
+        std::lock_guard lock(m_mutex);
+        auto it = std::find_if(m_pendingReads.begin(), m_pendingReads.end(),
+                               [key](const PendingRead& pendingRead) { return pendingRead.key == key; });
+        if (it == m_pendingReads.end())
+        {
+            return;
+        }
+        waiter = std::move(it->waiter);
+        m_pendingReads.erase(it);
+    }
+    waiter(std::nullopt);
+}
+
+bool ChangeEventLog::pollReady(const Reader& reader, std::function<void()> notify)
+{
+    // Dropped after the lock is released, since dropping it can call into the kernel
+    std::function<void()> replacedNotify;
+    std::lock_guard lock(m_mutex);
+    if (m_stopped || canReadLocked(reader))
+    {
+        return true;
+    }
+    if (notify)
+    {
+        replacedNotify = std::exchange(m_pollNotifies[&reader], std::move(notify));
+    }
+    return false;
+}
+
+void ChangeEventLog::forgetReader(const Reader& reader)
+{
+    std::function<void()> notify;
+    std::lock_guard lock(m_mutex);
+    auto it = m_pollNotifies.find(&reader);
+    if (it != m_pollNotifies.end())
+    {
+        notify = std::move(it->second);
+        m_pollNotifies.erase(it);
+    }
+}
+
+void ChangeEventLog::stop()
+{
+    std::vector<PendingRead> pendingReads;
+    std::unordered_map<const Reader*, std::function<void()>> pollNotifies;
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopped = true;
+        pendingReads.swap(m_pendingReads);
+        pollNotifies.swap(m_pollNotifies);
+    }
+    m_condition.notify_all();
+    for (PendingRead& pendingRead : pendingReads)
+    {
+        pendingRead.waiter(std::nullopt);
+    }
+}
+
+bool ChangeEventLog::canReadLocked(const Reader& reader) const
+{
+    return !reader.rest.empty() || reader.sequence < m_endSequence;
+}
+
+std::optional<std::string> ChangeEventLog::readLocked(Reader& reader, size_t size)
+{
+    if (size == 0)
+    {
+        return std::string();
+    }
+    if (!canReadLocked(reader))
+    {
+        return {};
+    }
+    if (reader.rest.empty())
+    {
+        // Events the reader didn't read in time are gone
+        const uint64_t firstSequence = m_endSequence - m_events.size();
+        reader.sequence = std::max(reader.sequence, firstSequence);
+        reader.rest = m_events[reader.sequence - firstSequence];
+        ++reader.sequence;
+    }
+    if (reader.rest.size() <= size)
+    {
+        return std::exchange(reader.rest, std::string());
+    }
+    std::string data = reader.rest.substr(0, size);
+    reader.rest.erase(0, size);
+    return data;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Recent changes of the clipboard, read by the readers of /.events
+// Each reader has its own sequence number, the number of the next event it reads. Only the last events are kept, so a reader
+// that falls behind skips to the oldest kept event
+// A read gives at most one event. Like a pipe, what doesn't fit is given by the next reads, so a reader can read byte by byte
+// Readers don't need a thread each to wait. Waiting reads and pollers are called back by the thread that pushes the next event
+// Can be used from any thread
+class ChangeEventLog
+{
+public:
+    // Called with what was read, or with nothing if the wait was cancelled or the log was stopped
+    using Waiter = std::function<void(std::optional<std::string> data)>;
+
+    // Where a reader is in the log. Only used with the lock of the log
+    struct Reader
+    {
+        // Sequence of the next event to read
+        uint64_t sequence;
+        // Rest of an event that didn't fit in the last read
+        std::string rest;
+    };
+
+    explicit ChangeEventLog(size_t capacity = 64);
+
+    // Adds event, then hands it to the waiting readers and notifies the pollers
+    void push(std::string event);
+    // Reader that only reads the changes after now
+    Reader makeReader() const;
+    bool isStopped() const;
+
+    // Reads up to size bytes of the next event of reader. Nothing if there is none yet
+    std::optional<std::string> read(Reader& reader, size_t size);
+    // Same, but waits up to timeout for the next event. Nothing if there still is none, or the log was stopped
+    std::optional<std::string> waitRead(Reader& reader, size_t size, std::chrono::milliseconds timeout);
+    // Calls waiter with what was read, right away if there is an event, or from push() when there is
+    // reader must stay valid until waiter is called. key identifies the wait for cancel()
+    // isCancelled is checked with the lock that cancel() takes, so a cancel that comes while the wait starts isn't missed
+    void readLater(Reader& reader, size_t size, const void* key, const std::function<bool()>& isCancelled, Waiter waiter);
+    // Calls the waiter of key with nothing, if it is still waiting
+    void cancel(const void* key);
+
+    // True if reader can read without waiting, either an event or the end of the log
+    // Otherwise, notify is called once on the next push. It replaces what was registered before for reader, and is dropped
+    // without being called if the reader is forgotten
+    bool pollReady(const Reader& reader, std::function<void()> notify);
+    void forgetReader(const Reader& reader);
+
+    // Cancels all waits, and makes the reads that come later return nothing right away
+    void stop();
+
+private:
+    struct PendingRead
+    {
+        const void* key;
+        Reader* reader;
+        size_t size;
+        Waiter waiter;
+    };
+
+    const size_t m_capacity;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<std::string> m_events;
+    // Sequence of the event after the last one in m_events
+    uint64_t m_endSequence = 0;
+    std::vector<PendingRead> m_pendingReads;
+    std::unordered_map<const Reader*, std::function<void()>> m_pollNotifies;
+    bool m_stopped = false;
+
+    // Must hold m_mutex
+    bool canReadLocked(const Reader& reader) const;
+    std::optional<std::string> readLocked(Reader& reader, size_t size);
+};
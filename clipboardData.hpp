@@ -1,8 +1,66 @@
 #pragma once
 
+#include "clipboardHistory.hpp"
+#include "clipboardSnapshot.hpp"
+#include "mimeDataStream.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
-#include <optional>
+
+// Options for all clipboard data implementations
+struct ClipboardDataOptions
+{
+    // Fetch data of each format only when it is first needed, instead of every format on every clipboard change
+    bool lazy = false;
+    // Number of snapshots of the clipboard kept in history, including the current one. 0 disables history
+    size_t historyCount = 10;
+    // Total size of the data kept in history. The current snapshot is always kept, even if it is larger
+    size_t historyBytes = 256 * 1024 * 1024;
+    // Stream data of formats that weren't fetched yet to readers as the owner sends it, instead of fetching all of it first
+    // Implies lazy. Only supported by backends whose canStream() is true
+    bool stream = false;
+    // Payloads of at least this many bytes are kept in a memfd instead of on the heap, so the kernel can swap them out. 0 disables it
+    size_t spillThreshold = 1024 * 1024;
+    // Also offer formats converted from the ones the owner offers, like image/png from any image and UTF-8 text from other charsets
+    // Each is converted on a worker thread the first time it is read
+    bool convert = false;
+    // Quality from 0 to 100 of image/webp made by conversion, if Qt has the WebP plugin
+    int webpQuality = 80;
+    // Hot formats, transferred as soon as the clipboard changes, so they are ready when they are first read. Implies lazy
+    // Full mime types like "text/plain", or like "image/*" for all formats of a main mime type, transferred in this order
+    std::vector<std::string> prefetchFormats;
+    // No more hot formats are transferred for a clipboard change once this many bytes were
+    size_t prefetchBytes = 64 * 1024 * 1024;
+    // Total size of the fetched and converted data of the current snapshots. The data least recently read is dropped past it,
+    // and fetched or converted again when it is read again. 0 means no limit
+    size_t maxCachedBytes = 0;
+    // Data of a single format larger than this is given to its reader but not kept. 0 means no limit
+    size_t maxFormatBytes = 0;
+    // Payloads of at least this many bytes are compressed once their snapshot was replaced and is only in history,
+    // if that saves enough memory. 0 disables it
+    size_t compressThreshold = 256 * 1024;
+
+    // True if formats are fetched when they are first needed, instead of all of them on every clipboard change
+    // A memory budget needs it, since only data that can be fetched again can be dropped
+    bool fetchesLazily() const
+    {
+        return lazy || stream || !prefetchFormats.empty() || maxCachedBytes || maxFormatBytes;
+    }
+
+    // Worker pools of the converter and the prefetcher, which split WorkerPool::defaultThreadsCount() between them
+    size_t workerPoolsCount() const
+    {
+        return (convert ? 1 : 0) + (prefetchFormats.empty() ? 0 : 1);
+    }
+};
 
 class ClipboardData
 {
@@ -13,29 +71,115 @@ public:
         Selection, // X11 selection clipboard that contains mouse selection. Pasted via middle click
     };
 
+    // Called after a new snapshot is published, with the snapshot it replaced
+    // Called from the thread that watches the clipboard, so it must return quickly
+    using ChangeCallback = std::function<void(Mode mode, const std::shared_ptr<const ClipboardSnapshot>& oldSnapshot,
+                                              const std::shared_ptr<const ClipboardSnapshot>& newSnapshot)>;
+
     virtual void run() = 0;
     virtual void quit() = 0;
 
-    // Lock object so data won't change while using it.
-    // Must call before using any function below (any function not init(), run(), and quit())
-    virtual std::lock_guard<std::mutex> getLock(Mode mode = Mode::Clipboard) = 0;
+    // Can be called from any thread. Once it returns, the previous callback is no longer running and won't be called again
+    virtual void setChangeCallback(ChangeCallback callback) = 0;
 
-    virtual bool hasData(Mode mode = Mode::Clipboard) = 0;
+    // Current contents of the clipboard. No lock needed: the snapshot is immutable and is replaced, not modified, when the clipboard changes
+    // Use the same snapshot for all calls that must agree with each other
+    virtual std::shared_ptr<const ClipboardSnapshot> snapshot(Mode mode = Mode::Clipboard) = 0;
 
-    virtual const std::vector<std::string> mainMimeTypes(Mode mode = Mode::Clipboard) = 0;
-    virtual size_t mainMimeTypesCount(Mode mode = Mode::Clipboard) = 0;
+    // Most recent snapshots of the clipboard, most recent first, so the current snapshot is first. Never null
+    virtual std::shared_ptr<const ClipboardHistory::SnapshotList> history(Mode mode = Mode::Clipboard) = 0;
 
-    virtual const std::vector<std::string> mimeSubTypes(const std::string& mimeMainType, Mode mode = Mode::Clipboard) = 0;
-    virtual size_t mimeSubTypesCount(const std::string& mimeMainType, Mode mode = Mode::Clipboard) = 0;
+    // Full mime type and data of each format to publish
+    using MimeDataList = std::vector<std::pair<std::string, std::shared_ptr<const MimeDataSnapshot>>>;
 
-    virtual bool hasMainMimeType(const std::string& mimeMainType, Mode mode = Mode::Clipboard) = 0;
+    // Replaces the contents of the clipboard with formats, all published together
+    // Can be called from any thread. Returns once the clipboard has been set
+    virtual void setMimeData(const MimeDataList& formats, Mode mode = Mode::Clipboard) = 0;
 
-    virtual bool hasMimeSubType(const std::string& mimeSubType, Mode mode = Mode::Clipboard) = 0;
+    // True if openStream() can be used
+    virtual bool canStream() const
+    {
+        return false;
+    }
 
-    virtual bool hasFullMimeType(const std::string& fullMimeType, Mode mode = Mode::Clipboard) = 0;
+    // Starts receiving data of fullMimeType, which can be read while it is still being received
+    // Null pointer if streaming is not supported, or if the clipboard changed since snapshot was made
+    virtual std::shared_ptr<MimeDataStream> openStream(const ClipboardSnapshot& /*snapshot*/, const std::string& /*fullMimeType*/,
+                                                       Mode /*mode*/ = Mode::Clipboard)
+    {
+        return nullptr;
+    }
 
-    virtual std::optional<size_t> dataSize(const std::string& fullMimeType, Mode mode = Mode::Clipboard) = 0;
-    virtual std::optional<const std::vector<uint8_t>> mimeData(const std::string& fullMimeType, Mode mode = Mode::Clipboard) = 0;
+    // Data of fullMimeType in the current clipboard, fetching it if needed. Null pointer indicates no data
+    // If the clipboard changes before the data could be fetched, tries again with the new clipboard once it is published
+    // Null pointer if it isn't published within PUBLISH_TIMEOUT, or the clipboard stopped
+    std::shared_ptr<const MimeDataSnapshot> mimeData(const std::string& fullMimeType, Mode mode = Mode::Clipboard)
+    {
+        std::shared_ptr<const ClipboardSnapshot> currentSnapshot = snapshot(mode);
+        while (currentSnapshot && currentSnapshot->hasFullMimeType(fullMimeType))
+        {
+            if (std::shared_ptr<const MimeDataSnapshot> data = currentSnapshot->mimeData(fullMimeType))
+            {
+                return data;
+            }
+            // The generation is changed before the new snapshot is built, so the old one can't fetch while the change is handled
+            currentSnapshot = waitForNewSnapshot(*currentSnapshot, mode);
+        }
+        return nullptr;
+    }
 
     virtual ~ClipboardData() = default;
+
+protected:
+    // Longest time mimeData() waits for the snapshot of a change that is being handled
+    static constexpr std::chrono::milliseconds PUBLISH_TIMEOUT{5000};
+
+    // Must be called by implementations after publishing a snapshot, so mimeData() stops waiting for it
+    void notifyPublished()
+    {
+        {
+            std::lock_guard lock(m_publishMutex);
+            ++m_publishCount;
+        }
+        m_publishCondition.notify_all();
+    }
+
+    // Must be called by implementations once they can't fetch data anymore, like when the thread that fetches it exited
+    void notifyStopped()
+    {
+        {
+            std::lock_guard lock(m_publishMutex);
+            m_stopped = true;
+        }
+        m_publishCondition.notify_all();
+    }
+
+private:
+    std::mutex m_publishMutex;
+    std::condition_variable m_publishCondition;
+    // Counts publishes, so one that happens between loading the snapshot and waiting isn't missed
+    uint64_t m_publishCount = 0;
+    bool m_stopped = false;
+
+    // Snapshot published after oldSnapshot. Null pointer on timeout or once stopped
+    std::shared_ptr<const ClipboardSnapshot> waitForNewSnapshot(const ClipboardSnapshot& oldSnapshot, Mode mode)
+    {
+        std::unique_lock lock(m_publishMutex);
+        const auto deadline = std::chrono::steady_clock::now() + PUBLISH_TIMEOUT;
+        while (!m_stopped)
+        {
+            // Checked with the lock held, so a publish after this check notifies the wait below
+            std::shared_ptr<const ClipboardSnapshot> currentSnapshot = snapshot(mode);
+            if (currentSnapshot.get() != &oldSnapshot)
+            {
+                return currentSnapshot;
+            }
+            const uint64_t publishCount = m_publishCount;
+            if (!m_publishCondition.wait_until(lock, deadline, [this, publishCount]() { return m_stopped || m_publishCount != publishCount; }))
+            {
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
 };
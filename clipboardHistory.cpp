@@ -0,0 +1,173 @@
+#include "clipboardHistory.hpp"
+
+#include <algorithm>
+#include <functional> // std::hash
+#include <utility>    // std::move
+
+namespace
+{
+// Combines hashes the same way as boost::hash_combine
+size_t combineHash(size_t seed, size_t hash)
+{
+    return seed ^ (hash + 0x9e3779b97f4a7c15 + (seed << 6) + (seed >> 2));
+}
+
+// Empty optional if some data has not been fetched, since the contents aren't fully known
+// Payloads keep the hash of their bytes from when they were interned, also once they are compressed, so nothing is hashed or
+// decompressed here. hasSameContents() rules out collisions
+// Converted formats are left out, since they follow from the formats they are converted from, and are rarely converted yet
+std::optional<size_t> contentHash(const ClipboardSnapshot& snapshot)
+{
+    size_t hash = 0;
+    for (const auto& [mainMimeType, directory] : snapshot.mimeDirectories())
+    {
+        for (const auto& [fileName, entry] : directory)
+        {
+            if (entry->isConverted())
+            {
+                continue;
+            }
+            const std::shared_ptr<const MimeDataSnapshot> data = snapshot.fetchedMimeData(*entry);
+            if (!data)
+            {
+                return {};
+            }
+            hash = combineHash(hash, std::hash<std::string>()(entry->fullMimeType()));
+            hash = combineHash(hash, data->contentHash());
+        }
+    }
+    return hash;
+}
+
+// Equal payloads are usually stored once by BlobStore, so they are compared by address first
+// Payloads compressed in the background are no longer the one BlobStore shares, so then their bytes are compared
+bool hasSameBytes(const MimeDataSnapshot& a, const MimeDataSnapshot& b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    if (a.hasContiguousData() && b.hasContiguousData())
+    {
+        return a.data() == b.data();
+    }
+    std::string aChunk(64 * 1024, '\0');
+    std::string bChunk(aChunk.size(), '\0');
+    for (size_t offset = 0; offset < a.size(); offset += aChunk.size())
+    {
+        const size_t aCount = a.read(aChunk.data(), aChunk.size(), offset);
+        const size_t bCount = b.read(bChunk.data(), bChunk.size(), offset);
+        if (aCount != bCount || aChunk.compare(0, aCount, bChunk, 0, bCount) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Only called when hashes are equal, to rule out collisions
+bool hasSameContents(const ClipboardSnapshot& a, const ClipboardSnapshot& b)
+{
+    const auto& aDirectories = a.mimeDirectories();
+    const auto& bDirectories = b.mimeDirectories();
+    if (aDirectories.size() != bDirectories.size())
+    {
+        return false;
+    }
+    for (auto aIt = aDirectories.cbegin(), bIt = bDirectories.cbegin(); aIt != aDirectories.cend(); ++aIt, ++bIt)
+    {
+        if (aIt->first != bIt->first || aIt->second.size() != bIt->second.size())
+        {
+            return false;
+        }
+        for (auto aFileIt = aIt->second.cbegin(), bFileIt = bIt->second.cbegin(); aFileIt != aIt->second.cend(); ++aFileIt, ++bFileIt)
+        {
+            if (aFileIt->first != bFileIt->first || aFileIt->second->isConverted() != bFileIt->second->isConverted())
+            {
+                return false;
+            }
+            if (aFileIt->second->isConverted())
+            {
+                continue;
+            }
+            const std::shared_ptr<const MimeDataSnapshot> aData = a.fetchedMimeData(*aFileIt->second);
+            const std::shared_ptr<const MimeDataSnapshot> bData = b.fetchedMimeData(*bFileIt->second);
+            if (!aData || !bData || (aData != bData && !hasSameBytes(*aData, *bData)))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+} // namespace
+
+ClipboardHistory::ClipboardHistory(size_t maxCount, size_t maxBytes)
+    : m_maxCount(maxCount), m_maxBytes(maxBytes), m_snapshots(std::make_shared<const SnapshotList>())
+{
+}
+
+void ClipboardHistory::push(std::shared_ptr<const ClipboardSnapshot> snapshot)
+{
+    if (m_maxCount == 0)
+    {
+        return;
+    }
+
+    // Previous most recent snapshot can't fetch any more data now that it was replaced, so its contents are final
+    // Its hash only needs to be recomputed if it was missing data when it was pushed. Sizes are all counted below
+    if (!m_items.empty() && !m_items.front().contentHash)
+    {
+        m_items.front() = makeItem(std::move(m_items.front().snapshot));
+    }
+
+    // Payloads of older snapshots may have been compressed since the last push, so their sizes are counted again
+    m_bytes = 0;
+    for (Item& historyItem : m_items)
+    {
+        historyItem.bytes = historyItem.snapshot->fetchedDataSize();
+        m_bytes += historyItem.bytes;
+    }
+
+    Item item = makeItem(std::move(snapshot));
+    if (item.contentHash)
+    {
+        auto duplicateIt = std::find_if(m_items.begin(), m_items.end(), [&item](const Item& other)
+            {
+                return other.contentHash == item.contentHash && hasSameContents(*other.snapshot, *item.snapshot);
+            });
+        if (duplicateIt != m_items.end())
+        {
+            m_bytes -= duplicateIt->bytes;
+            m_items.erase(duplicateIt);
+        }
+    }
+    m_bytes += item.bytes;
+    m_items.push_front(std::move(item));
+
+    while (m_items.size() > 1 && (m_items.size() > m_maxCount || m_bytes > m_maxBytes))
+    {
+        m_bytes -= m_items.back().bytes;
+        m_items.pop_back();
+    }
+
+    auto snapshots = std::make_shared<SnapshotList>();
+    snapshots->reserve(m_items.size());
+    for (const Item& historyItem : m_items)
+    {
+        snapshots->push_back(historyItem.snapshot);
+    }
+    m_snapshots.store(std::move(snapshots));
+}
+
+std::shared_ptr<const ClipboardHistory::SnapshotList> ClipboardHistory::snapshots() const
+{
+    return m_snapshots.load();
+}
+
+ClipboardHistory::Item ClipboardHistory::makeItem(std::shared_ptr<const ClipboardSnapshot> snapshot)
+{
+    const size_t bytes = snapshot->fetchedDataSize();
+    const std::optional<size_t> hash = contentHash(*snapshot);
+    return Item{std::move(snapshot), bytes, hash};
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "clipboardSnapshot.hpp"
+#include "publishedPtr.hpp"
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// Most recent snapshots of a clipboard, bounded by count and by the total size of their data
+// Snapshots are shared with the clipboard, so keeping them in history doesn't copy any data
+class ClipboardHistory
+{
+public:
+    // Most recent first
+    using SnapshotList = std::vector<std::shared_ptr<const ClipboardSnapshot>>;
+
+    // maxCount of 0 disables history
+    ClipboardHistory(size_t maxCount, size_t maxBytes);
+
+    // Adds snapshot as the most recent one. Only called from the thread that changes the clipboard
+    // An older snapshot with the same contents is removed instead of being kept twice
+    // Oldest snapshots are evicted until the limits are met. The most recent snapshot is always kept
+    void push(std::shared_ptr<const ClipboardSnapshot> snapshot);
+
+    // Can be called from any thread. List is immutable, and is replaced on every push()
+    std::shared_ptr<const SnapshotList> snapshots() const;
+
+private:
+    struct Item
+    {
+        std::shared_ptr<const ClipboardSnapshot> snapshot;
+        size_t bytes;
+        // Only set if all data of the snapshot has been fetched
+        std::optional<size_t> contentHash;
+    };
+
+    const size_t m_maxCount;
+    const size_t m_maxBytes;
+
+    // Only used by the thread calling push()
+    std::deque<Item> m_items;
+    size_t m_bytes = 0;
+
+    // Only replaced by push()
+    PublishedPtr<const SnapshotList> m_snapshots;
+
+    static Item makeItem(std::shared_ptr<const ClipboardSnapshot> snapshot);
+};
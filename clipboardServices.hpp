@@ -0,0 +1,29 @@
+#pragma once
+
+#include "blobStore.hpp"
+#include "clipboardData.hpp"
+#include "formatConverter.hpp"
+#include "historyCompressor.hpp"
+#include "memoryBudget.hpp"
+#include "prefetcher.hpp"
+
+// Parts of a clipboard backend that don't depend on which clipboard it reads
+// Shared by the backends of all displays served by the process, so the worker threads and the stored payloads don't grow with
+// the number of displays, and the same data copied on several displays is stored once
+// Must outlive the backends that use it
+struct ClipboardServices
+{
+    explicit ClipboardServices(const ClipboardDataOptions& options)
+        : memoryBudget(options.maxCachedBytes, options.maxFormatBytes), blobStore(options.spillThreshold), formatConverter(options),
+          prefetcher(options), historyCompressor(options)
+    {
+    }
+
+    // First, so it is destroyed last, after the prefetch jobs that can still hold snapshots
+    MemoryBudget memoryBudget;
+    BlobStore blobStore;
+    FormatConverter formatConverter;
+    // After formatConverter, since prefetching converts hot converted formats
+    Prefetcher prefetcher;
+    HistoryCompressor historyCompressor;
+};
@@ -0,0 +1,416 @@
+#include "clipboardSnapshot.hpp"
+
+#include "dataHash.hpp"
+#include "memoryBudget.hpp"
+#include "stats.hpp"
+
+#include <algorithm>
+#include <future>
+#include <tuple>
+#include <utility> // std::move
+
+namespace
+{
+bool fullMimeTypeHasSubType(const std::string& fullMimeType, const std::string& mimeSubType)
+{
+    // +2 to make sure there is room for a slash and at least one character before the slash
+    return fullMimeType.size() >= mimeSubType.size() + 2 &&
+           fullMimeType.compare(fullMimeType.size() - mimeSubType.size(), mimeSubType.size(), mimeSubType) == 0 &&
+           fullMimeType[fullMimeType.size() - 1 - mimeSubType.size()] == '/' && fullMimeType[fullMimeType.size() - 1 - mimeSubType.size() - 1] != '/';
+}
+} // namespace
+
+size_t MimeDataSnapshot::read(char* buf, size_t size, size_t offset) const
+{
+    const std::string_view bytes = data();
+    if (offset >= bytes.size())
+    {
+        return 0;
+    }
+    size = std::min(size, bytes.size() - offset);
+    std::copy_n(bytes.data() + offset, size, buf);
+    return size;
+}
+
+uint64_t MimeDataSnapshot::contentHash() const
+{
+    if (m_hasContentHash.load(std::memory_order_acquire))
+    {
+        return m_contentHash.load(std::memory_order_relaxed);
+    }
+    // Threads hashing at the same time store the same value
+    const uint64_t hash = hashData(data());
+    setContentHash(hash);
+    return hash;
+}
+
+void MimeDataSnapshot::setContentHash(uint64_t hash) const
+{
+    m_contentHash.store(hash, std::memory_order_relaxed);
+    m_hasContentHash.store(true, std::memory_order_release);
+}
+
+StringMimeDataSnapshot::StringMimeDataSnapshot(std::string data) : m_data(std::move(data))
+{
+}
+
+std::string_view StringMimeDataSnapshot::data() const
+{
+    return m_data;
+}
+
+const std::string& ClipboardSnapshot::MimeEntry::fullMimeType() const
+{
+    return m_fullMimeType;
+}
+
+bool ClipboardSnapshot::MimeEntry::isConverted() const
+{
+    return m_source != nullptr;
+}
+
+const ClipboardSnapshot::MimeEntry* ClipboardSnapshot::MimeEntry::source() const
+{
+    return m_source;
+}
+
+ClipboardSnapshot::ClipboardSnapshot(uint64_t generation, Fetcher fetcher, MemoryBudget* budget)
+    : m_generation(generation), m_changeTime(std::chrono::system_clock::now()), m_fetcher(std::move(fetcher)),
+      m_budget(budget && budget->isEnabled() ? budget : nullptr)
+{
+}
+
+ClipboardSnapshot::~ClipboardSnapshot()
+{
+    retire();
+}
+
+void ClipboardSnapshot::addMimeType(const std::string& fullMimeType, std::shared_ptr<const MimeDataSnapshot> data)
+{
+    auto slashIndex = fullMimeType.find('/');
+    // Subtype must be non-empty and can't contain another slash, since it becomes a file name
+    if (slashIndex == std::string::npos || slashIndex == 0 || slashIndex + 1 == fullMimeType.size() ||
+        fullMimeType.find('/', slashIndex + 1) != std::string::npos)
+    {
+        return;
+    }
+    auto [it, inserted] = m_fullMimeTypeToEntryMap.emplace(std::piecewise_construct, std::forward_as_tuple(fullMimeType), std::forward_as_tuple());
+    if (!inserted)
+    {
+        return;
+    }
+    MimeEntry& entry = it->second;
+    entry.m_fullMimeType = fullMimeType;
+    storeData(entry, std::move(data));
+
+    std::string fileName(BASE_FILE_NAME);
+    fileName += '.';
+    fileName.append(fullMimeType, slashIndex + 1);
+    MimeDirectory& directory = m_mimeDirectories[fullMimeType.substr(0, slashIndex)];
+    directory.emplace(std::move(fileName), &entry);
+}
+
+void ClipboardSnapshot::addConvertedMimeType(const std::string& fullMimeType, const std::string& sourceFullMimeType, Converter converter)
+{
+    auto sourceIt = m_fullMimeTypeToEntryMap.find(sourceFullMimeType);
+    if (sourceIt == m_fullMimeTypeToEntryMap.end() || hasFullMimeType(fullMimeType))
+    {
+        return;
+    }
+    addMimeType(fullMimeType, nullptr);
+    auto it = m_fullMimeTypeToEntryMap.find(fullMimeType);
+    if (it == m_fullMimeTypeToEntryMap.end())
+    {
+        return;
+    }
+    // Entries are node based, so the pointer to the source stays valid as more formats are added
+    it->second.m_source = &sourceIt->second;
+    it->second.m_converter = std::move(converter);
+}
+
+uint64_t ClipboardSnapshot::generation() const
+{
+    return m_generation;
+}
+
+std::chrono::system_clock::time_point ClipboardSnapshot::changeTime() const
+{
+    return m_changeTime;
+}
+
+bool ClipboardSnapshot::hasData() const
+{
+    return !m_fullMimeTypeToEntryMap.empty();
+}
+
+const ClipboardSnapshot::MimeDirectoryMap& ClipboardSnapshot::mimeDirectories() const
+{
+    return m_mimeDirectories;
+}
+
+size_t ClipboardSnapshot::mainMimeTypesCount() const
+{
+    return m_mimeDirectories.size();
+}
+
+const ClipboardSnapshot::MimeDirectory* ClipboardSnapshot::mimeDirectory(std::string_view mainMimeType) const
+{
+    auto it = m_mimeDirectories.find(mainMimeType);
+    if (it == m_mimeDirectories.cend())
+    {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+const ClipboardSnapshot::MimeEntry* ClipboardSnapshot::mimeFile(std::string_view mainMimeType, std::string_view fileName) const
+{
+    const MimeDirectory* directory = mimeDirectory(mainMimeType);
+    if (!directory)
+    {
+        return nullptr;
+    }
+    auto it = directory->find(fileName);
+    if (it == directory->cend())
+    {
+        return nullptr;
+    }
+    return it->second;
+}
+
+bool ClipboardSnapshot::hasMainMimeType(std::string_view mainMimeType) const
+{
+    return m_mimeDirectories.find(mainMimeType) != m_mimeDirectories.cend();
+}
+
+bool ClipboardSnapshot::hasMimeSubType(const std::string& mimeSubType) const
+{
+    return std::any_of(m_fullMimeTypeToEntryMap.cbegin(), m_fullMimeTypeToEntryMap.cend(), [&mimeSubType](const auto& keyValue)
+        {
+            return fullMimeTypeHasSubType(keyValue.first, mimeSubType);
+        });
+}
+
+bool ClipboardSnapshot::hasFullMimeType(const std::string& fullMimeType) const
+{
+    return m_fullMimeTypeToEntryMap.find(fullMimeType) != m_fullMimeTypeToEntryMap.cend();
+}
+
+std::optional<size_t> ClipboardSnapshot::dataSize(const std::string& fullMimeType) const
+{
+    auto it = m_fullMimeTypeToEntryMap.find(fullMimeType);
+    if (it == m_fullMimeTypeToEntryMap.cend())
+    {
+        return {};
+    }
+    return dataSize(it->second);
+}
+
+std::optional<size_t> ClipboardSnapshot::dataSize(const MimeEntry& entry) const
+{
+    const size_t size = entry.m_size.load(std::memory_order_relaxed);
+    if (size == MimeEntry::UNKNOWN_SIZE)
+    {
+        return {};
+    }
+    return size;
+}
+
+std::shared_ptr<const MimeDataSnapshot> ClipboardSnapshot::mimeData(const std::string& fullMimeType) const
+{
+    auto it = m_fullMimeTypeToEntryMap.find(fullMimeType);
+    if (it == m_fullMimeTypeToEntryMap.cend())
+    {
+        return nullptr;
+    }
+    return mimeData(it->second);
+}
+
+std::shared_ptr<const MimeDataSnapshot> ClipboardSnapshot::mimeData(const MimeEntry& entry) const
+{
+    // Relaxed, since it only orders evictions
+    if (m_budget)
+    {
+        entry.m_lastRead.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+    std::shared_ptr<const MimeDataSnapshot> data = std::atomic_load(&entry.m_data);
+    if (data || !canRefetch(entry))
+    {
+        Stats::add(data ? Stats::Counter::DataCacheHits : Stats::Counter::DataCacheMisses);
+        return data;
+    }
+    Stats::add(Stats::Counter::DataCacheMisses);
+    if (entry.isConverted())
+    {
+        std::promise<std::shared_ptr<const MimeDataSnapshot>> promise;
+        std::future<std::shared_ptr<const MimeDataSnapshot>> result = promise.get_future();
+        convert(entry, [&promise](std::shared_ptr<const MimeDataSnapshot> convertedData) { promise.set_value(std::move(convertedData)); });
+        return result.get();
+    }
+    // Other readers of the same format wait for the first fetch instead of fetching again
+    std::lock_guard lock(entry.m_fetchMutex);
+    data = std::atomic_load(&entry.m_data);
+    if (data || entry.m_fetchFailed)
+    {
+        return data;
+    }
+    {
+        const Stats::ScopedTimer timer(Stats::Timer::Fetch);
+        data = m_fetcher(entry.m_fullMimeType);
+    }
+    entry.m_fetchFailed = !data;
+    return storeData(entry, std::move(data));
+}
+
+void ClipboardSnapshot::mimeDataLater(const MimeEntry& entry, DataCallback done) const
+{
+    if (!entry.isConverted())
+    {
+        done(mimeData(entry));
+        return;
+    }
+    if (m_budget)
+    {
+        entry.m_lastRead.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    }
+    if (std::shared_ptr<const MimeDataSnapshot> data = std::atomic_load(&entry.m_data))
+    {
+        Stats::add(Stats::Counter::DataCacheHits);
+        done(std::move(data));
+        return;
+    }
+    Stats::add(Stats::Counter::DataCacheMisses);
+    convert(entry, std::move(done));
+}
+
+void ClipboardSnapshot::provideMimeData(const MimeEntry& entry, std::shared_ptr<const MimeDataSnapshot> data) const
+{
+    if (std::atomic_load(&entry.m_data))
+    {
+        return;
+    }
+    // If a reader is fetching the same format, waits for it and keeps its data
+    std::lock_guard lock(entry.m_fetchMutex);
+    if (!std::atomic_load(&entry.m_data))
+    {
+        storeData(entry, std::move(data));
+    }
+}
+
+std::shared_ptr<const MimeDataSnapshot> ClipboardSnapshot::fetchedMimeData(const MimeEntry& entry) const
+{
+    return std::atomic_load(&entry.m_data);
+}
+
+size_t ClipboardSnapshot::fetchedDataSize() const
+{
+    size_t size = 0;
+    for (const auto& [fullMimeType, entry] : m_fullMimeTypeToEntryMap)
+    {
+        if (const std::shared_ptr<const MimeDataSnapshot> data = std::atomic_load(&entry.m_data))
+        {
+            size += data->storedSize();
+        }
+    }
+    return size;
+}
+
+void ClipboardSnapshot::replaceData(const std::shared_ptr<const MimeDataSnapshot>& oldData,
+                                    const std::shared_ptr<const MimeDataSnapshot>& data) const
+{
+    for (const auto& [fullMimeType, entry] : m_fullMimeTypeToEntryMap)
+    {
+        // Formats whose data changed meanwhile, like by an eviction, are left alone
+        std::shared_ptr<const MimeDataSnapshot> expected = oldData;
+        std::atomic_compare_exchange_strong(&entry.m_data, &expected, data);
+    }
+}
+
+void ClipboardSnapshot::retire() const
+{
+    if (m_budget)
+    {
+        m_budget->retire(*this);
+    }
+}
+
+void ClipboardSnapshot::convert(const MimeEntry& entry, DataCallback done) const
+{
+    std::unique_lock lock(entry.m_fetchMutex);
+    std::shared_ptr<const MimeDataSnapshot> data = std::atomic_load(&entry.m_data);
+    if (data || entry.m_fetchFailed)
+    {
+        lock.unlock();
+        done(std::move(data));
+        return;
+    }
+    entry.m_conversionWaiters.push_back(std::move(done));
+    if (entry.m_conversionWaiters.size() > 1)
+    {
+        return;
+    }
+    lock.unlock();
+
+    // No data if the source can't be fetched anymore, the same as for a format that is fetched
+    std::shared_ptr<const MimeDataSnapshot> sourceData = mimeData(*entry.m_source);
+    if (!sourceData)
+    {
+        finishConversion(entry, nullptr);
+        return;
+    }
+    // Converters need all bytes at once. A temporary copy keeps the compressed source from holding them for good
+    if (!sourceData->hasContiguousData())
+    {
+        std::string bytes(sourceData->size(), '\0');
+        bytes.resize(sourceData->read(bytes.data(), bytes.size(), 0));
+        sourceData = std::make_shared<StringMimeDataSnapshot>(std::move(bytes));
+    }
+    entry.m_converter(sourceData, [this, &entry](std::shared_ptr<const MimeDataSnapshot> convertedData)
+                      { finishConversion(entry, std::move(convertedData)); });
+}
+
+void ClipboardSnapshot::finishConversion(const MimeEntry& entry, std::shared_ptr<const MimeDataSnapshot> data) const
+{
+    std::vector<DataCallback> waiters;
+    {
+        std::lock_guard lock(entry.m_fetchMutex);
+        entry.m_fetchFailed = !data;
+        data = storeData(entry, std::move(data));
+        waiters.swap(entry.m_conversionWaiters);
+    }
+    // A waiter can hold the last reference to the snapshot, so nothing of it is used past here
+    for (DataCallback& waiter : waiters)
+    {
+        waiter(data);
+    }
+}
+
+bool ClipboardSnapshot::canRefetch(const MimeEntry& entry) const
+{
+    return m_fetcher || entry.isConverted();
+}
+
+std::shared_ptr<const MimeDataSnapshot> ClipboardSnapshot::storeData(const MimeEntry& entry, std::shared_ptr<const MimeDataSnapshot> data) const
+{
+    if (!data)
+    {
+        return data;
+    }
+    const size_t size = data->size();
+    entry.m_size.store(size, std::memory_order_relaxed);
+    // Data that can't be made again is always kept
+    if (!m_budget || !canRefetch(entry))
+    {
+        std::atomic_store(&entry.m_data, data);
+        return data;
+    }
+    // Too large to keep. The reader still gets it, and the next reader fetches it again
+    if (!m_budget->fitsFormat(size))
+    {
+        return data;
+    }
+    entry.m_lastRead.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+    std::atomic_store(&entry.m_data, data);
+    m_budget->add(*this, entry, size);
+    return data;
+}
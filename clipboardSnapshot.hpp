@@ -0,0 +1,220 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Basename of every file in FUSE filesystem, without extension.
+constexpr std::string_view BASE_FILE_NAME("file");
+
+class MemoryBudget;
+
+// Immutable bytes of a single mime type
+// Keeps the bytes alive as long as it is referenced, even if the clipboard changes
+class MimeDataSnapshot
+{
+public:
+    virtual std::string_view data() const = 0;
+    // File that holds the same bytes from offset 0, so they can be spliced instead of copied. -1 if there is none
+    virtual int fd() const
+    {
+        return -1;
+    }
+    // False if data() has to decompress all of the data first. Then it should be read with read() instead
+    virtual bool hasContiguousData() const
+    {
+        return true;
+    }
+    // Size of the bytes, without making them contiguous
+    virtual size_t size() const
+    {
+        return data().size();
+    }
+    // Memory taken by the bytes, which is less than size() if they are compressed
+    virtual size_t storedSize() const
+    {
+        return size();
+    }
+    // Copies up to size bytes at offset into buf. Returns the number of bytes copied, 0 past the end
+    virtual size_t read(char* buf, size_t size, size_t offset) const;
+
+    // hashData() of the bytes. Hashed the first time unless it was already known, like from interning or from the uncompressed bytes
+    uint64_t contentHash() const;
+    // hash must be hashData() of the same bytes. Can be called from any thread
+    void setContentHash(uint64_t hash) const;
+
+    virtual ~MimeDataSnapshot() = default;
+
+private:
+    mutable std::atomic<uint64_t> m_contentHash = 0;
+    mutable std::atomic<bool> m_hasContentHash = false;
+};
+
+// Data that is owned as a std::string, like data written to the filesystem
+class StringMimeDataSnapshot : public MimeDataSnapshot
+{
+public:
+    explicit StringMimeDataSnapshot(std::string data);
+
+    std::string_view data() const;
+
+private:
+    const std::string m_data;
+};
+
+// Immutable contents of a clipboard at one point in time
+// Published as a std::shared_ptr<const ClipboardSnapshot> when the clipboard changes, so readers never need a lock
+// and a reader holding a snapshot keeps seeing the same contents after the clipboard changes
+class ClipboardSnapshot
+{
+public:
+    // Fetches data of a format that was added without data. Returns null if the data can no longer be fetched,
+    // because the clipboard changed since this snapshot was made
+    using Fetcher = std::function<std::shared_ptr<const MimeDataSnapshot>(const std::string& fullMimeType)>;
+    // Called with the data of a format once it is fetched or converted
+    using DataCallback = std::function<void(std::shared_ptr<const MimeDataSnapshot> data)>;
+    // Starts making the data of a converted format from the data of its source format, and calls done with it from another thread
+    // Must not give null
+    using Converter = std::function<void(const std::shared_ptr<const MimeDataSnapshot>& sourceData, DataCallback done)>;
+
+    // A single format of the snapshot
+    class MimeEntry
+    {
+    public:
+        const std::string& fullMimeType() const;
+        // True if the format isn't offered by the clipboard owner, but converted from another format of the snapshot
+        bool isConverted() const;
+        // Format this one is converted from. Null pointer if it isn't converted
+        const MimeEntry* source() const;
+
+    private:
+        friend class ClipboardSnapshot;
+        friend class MemoryBudget;
+
+        static constexpr size_t UNKNOWN_SIZE = SIZE_MAX;
+
+        std::string m_fullMimeType;
+        // Only set for converted formats
+        const MimeEntry* m_source = nullptr;
+        Converter m_converter;
+        // If added without data, written while m_fetchMutex is held. Set back to null if the memory budget evicts it
+        // Only accessed through std::atomic_load and std::atomic_store, so dataSize() can read it while it is fetched
+        mutable std::shared_ptr<const MimeDataSnapshot> m_data;
+        // Held while fetching, so other readers of the same format wait for the fetch instead of fetching again
+        mutable std::mutex m_fetchMutex;
+        // Set if the data couldn't be fetched, so it isn't tried again. Only used while m_fetchMutex is held
+        mutable bool m_fetchFailed = false;
+        // Readers waiting for the conversion in progress, if any. Only used while m_fetchMutex is held, which isn't held while converting
+        mutable std::vector<DataCallback> m_conversionWaiters;
+        // Size of the data once it is known. Still known after the data was evicted or wasn't kept
+        mutable std::atomic<size_t> m_size = UNKNOWN_SIZE;
+        // When the data was last read or stored, for the memory budget to evict what was least recently read
+        mutable std::atomic<std::chrono::steady_clock::rep> m_lastRead = 0;
+    };
+
+    // Files of a main mime type directory, keyed by file name, {BASE_FILE_NAME}.{mime subtype}
+    // File names are rendered once when the snapshot is built. std::less<> allows lookup by std::string_view without allocating
+    using MimeDirectory = std::map<std::string, const MimeEntry*, std::less<>>;
+    // Main mime type to its directory
+    using MimeDirectoryMap = std::map<std::string, MimeDirectory, std::less<>>;
+
+    // Fetched and converted data is kept within budget if it isn't null. budget must outlive the snapshot
+    ClipboardSnapshot(uint64_t generation, Fetcher fetcher = nullptr, MemoryBudget* budget = nullptr);
+    ~ClipboardSnapshot();
+
+    ClipboardSnapshot(const ClipboardSnapshot&) = delete;
+    ClipboardSnapshot& operator=(const ClipboardSnapshot&) = delete;
+
+    // Only used while building the snapshot, before it is published
+    // Null data means the data is fetched with the fetcher the first time it is needed
+    void addMimeType(const std::string& fullMimeType, std::shared_ptr<const MimeDataSnapshot> data);
+    // Adds a format whose data is made from the data of sourceFullMimeType by converter, the first time it is needed
+    // Ignored if the snapshot already has fullMimeType, or doesn't have sourceFullMimeType
+    void addConvertedMimeType(const std::string& fullMimeType, const std::string& sourceFullMimeType, Converter converter);
+
+    // Incremented on every clipboard change
+    uint64_t generation() const;
+    // When the clipboard changed to these contents, which is when the snapshot was made
+    std::chrono::system_clock::time_point changeTime() const;
+
+    bool hasData() const;
+
+    // Directory index, sorted by main mime type and then by file name
+    const MimeDirectoryMap& mimeDirectories() const;
+    size_t mainMimeTypesCount() const;
+
+    // Null pointer if there is no such main mime type
+    const MimeDirectory* mimeDirectory(std::string_view mainMimeType) const;
+    // Null pointer if there is no such file
+    const MimeEntry* mimeFile(std::string_view mainMimeType, std::string_view fileName) const;
+
+    bool hasMainMimeType(std::string_view mainMimeType) const;
+
+    bool hasMimeSubType(const std::string& mimeSubType) const;
+
+    bool hasFullMimeType(const std::string& fullMimeType) const;
+
+    // Optional has no data if no mimetype found, or if data has not been fetched yet
+    // Once the data was fetched, its size stays known even if the memory budget didn't keep the data
+    std::optional<size_t> dataSize(const std::string& fullMimeType) const;
+    std::optional<size_t> dataSize(const MimeEntry& entry) const;
+
+    // Fetches data first if it has not been fetched yet, which may wait for the clipboard owner, or for the conversion of a converted format
+    // Null pointer if no mimetype found, or if data could not be fetched because the clipboard changed
+    std::shared_ptr<const MimeDataSnapshot> mimeData(const std::string& fullMimeType) const;
+    std::shared_ptr<const MimeDataSnapshot> mimeData(const MimeEntry& entry) const;
+    // Same, but a converted format that isn't converted yet doesn't wait for the conversion: done is called from the worker thread
+    // that converted it. Otherwise done is called before this returns. Null is never given from a conversion worker, only by the
+    // reader that failed to fetch the source
+    // Fetching the source of a converted format, or a format that isn't converted, still waits for the clipboard owner
+    // The snapshot must be kept alive until done is called
+    void mimeDataLater(const MimeEntry& entry, DataCallback done) const;
+    // Sets the data of a format that wasn't fetched yet, as if the fetcher had fetched it. Ignored if it was fetched already
+    // Unlike building the snapshot, can be done after it is published
+    void provideMimeData(const MimeEntry& entry, std::shared_ptr<const MimeDataSnapshot> data) const;
+    // Never fetches. Null pointer if data has not been fetched yet
+    std::shared_ptr<const MimeDataSnapshot> fetchedMimeData(const MimeEntry& entry) const;
+
+    // Total memory taken by all data that has been fetched, which is less than its size once it was compressed
+    size_t fetchedDataSize() const;
+    // Stores data in place of oldData in every format that holds oldData. data must have the same bytes, like a compressed copy
+    void replaceData(const std::shared_ptr<const MimeDataSnapshot>& oldData, const std::shared_ptr<const MimeDataSnapshot>& data) const;
+
+    // Called once the snapshot was replaced by a newer one. Its data can't be fetched anymore, so the memory budget stops
+    // counting it and never evicts it
+    void retire() const;
+
+private:
+    friend class MemoryBudget;
+
+    const uint64_t m_generation;
+    const std::chrono::system_clock::time_point m_changeTime;
+    const Fetcher m_fetcher;
+    // Null if no budget limits the data
+    MemoryBudget* const m_budget;
+    // Set by retire(). Only used while the lock of m_budget is held
+    mutable bool m_retired = false;
+    // Node based, so pointers to entries in m_mimeDirectories stay valid
+    std::unordered_map<std::string, MimeEntry> m_fullMimeTypeToEntryMap;
+    MimeDirectoryMap m_mimeDirectories;
+
+    // Converts the data of a converted format unless it was already converted, and calls done with it
+    // Only the first reader starts the conversion. The others are called along with it when it is done
+    void convert(const MimeEntry& entry, DataCallback done) const;
+    // Stores the converted data, then calls every reader waiting for it
+    void finishConversion(const MimeEntry& entry, std::shared_ptr<const MimeDataSnapshot> data) const;
+    // True if the data of entry can be made again after the memory budget dropped it
+    bool canRefetch(const MimeEntry& entry) const;
+    // Keeps data as the data of entry, unless the memory budget doesn't have room for it. Returns data either way
+    std::shared_ptr<const MimeDataSnapshot> storeData(const MimeEntry& entry, std::shared_ptr<const MimeDataSnapshot> data) const;
+};
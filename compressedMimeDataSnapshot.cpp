@@ -0,0 +1,116 @@
+#include "compressedMimeDataSnapshot.hpp"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <utility> // std::move
+
+namespace
+{
+// Compressed data is only kept if it saves at least this fraction of the size, since reads have to decompress it
+constexpr size_t MIN_SAVED_FRACTION = 8;
+} // namespace
+
+std::shared_ptr<const MimeDataSnapshot> CompressedMimeDataSnapshot::create(std::string_view data)
+{
+    std::string blocks;
+    std::vector<size_t> blockEnds;
+    blockEnds.reserve((data.size() + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    std::string compressedBlock(compressBound(BLOCK_SIZE), '\0');
+    for (size_t offset = 0; offset < data.size(); offset += BLOCK_SIZE)
+    {
+        const size_t blockSize = std::min(BLOCK_SIZE, data.size() - offset);
+        uLongf compressedSize = compressedBlock.size();
+        // Fastest level, since the data is compressed in the background but decompressed while someone reads it
+        if (compress2(reinterpret_cast<Bytef*>(compressedBlock.data()), &compressedSize, reinterpret_cast<const Bytef*>(data.data() + offset),
+                      blockSize, Z_BEST_SPEED) != Z_OK)
+        {
+            return nullptr;
+        }
+        blocks.append(compressedBlock, 0, compressedSize);
+        blockEnds.push_back(blocks.size());
+        // Gives up as soon as it can't pay off, since most large payloads that don't compress are already compressed images
+        if (blocks.size() > data.size() - data.size() / MIN_SAVED_FRACTION)
+        {
+            return nullptr;
+        }
+    }
+    blocks.shrink_to_fit();
+    // Constructor is private, so std::make_shared can't be used
+    return std::shared_ptr<const MimeDataSnapshot>(new CompressedMimeDataSnapshot(data.size(), std::move(blocks), std::move(blockEnds)));
+}
+
+CompressedMimeDataSnapshot::CompressedMimeDataSnapshot(size_t size, std::string blocks, std::vector<size_t> blockEnds)
+    : m_size(size), m_blocks(std::move(blocks)), m_blockEnds(std::move(blockEnds))
+{
+}
+
+std::string_view CompressedMimeDataSnapshot::data() const
+{
+    std::call_once(m_decompressFlag, [this]()
+        {
+            m_data.resize(m_size);
+            m_data.resize(read(m_data.data(), m_size, 0));
+            m_decompressedSize.store(m_data.size(), std::memory_order_relaxed);
+        });
+    return m_data;
+}
+
+bool CompressedMimeDataSnapshot::hasContiguousData() const
+{
+    return false;
+}
+
+size_t CompressedMimeDataSnapshot::size() const
+{
+    return m_size;
+}
+
+size_t CompressedMimeDataSnapshot::storedSize() const
+{
+    return m_blocks.size() + m_decompressedSize.load(std::memory_order_relaxed);
+}
+
+size_t CompressedMimeDataSnapshot::read(char* buf, size_t size, size_t offset) const
+{
+    if (offset >= m_size)
+    {
+        return 0;
+    }
+    size = std::min(size, m_size - offset);
+    // Only allocated if a read starts or ends inside a block
+    std::string blockData;
+    size_t copied = 0;
+    while (copied < size)
+    {
+        const size_t block = (offset + copied) / BLOCK_SIZE;
+        const size_t blockOffset = (offset + copied) % BLOCK_SIZE;
+        const size_t blockSize = std::min(BLOCK_SIZE, m_size - block * BLOCK_SIZE);
+        const size_t count = std::min(blockSize - blockOffset, size - copied);
+        if (count == blockSize)
+        {
+            if (!decompressBlock(block, buf + copied))
+            {
+                break;
+            }
+        }
+        else
+        {
+            blockData.resize(BLOCK_SIZE);
+            if (!decompressBlock(block, blockData.data()))
+            {
+                break;
+            }
+            std::copy_n(blockData.data() + blockOffset, count, buf + copied);
+        }
+        copied += count;
+    }
+    return copied;
+}
+
+bool CompressedMimeDataSnapshot::decompressBlock(size_t block, char* buf) const
+{
+    const size_t begin = block == 0 ? 0 : m_blockEnds[block - 1];
+    uLongf size = std::min(BLOCK_SIZE, m_size - block * BLOCK_SIZE);
+    return uncompress(reinterpret_cast<Bytef*>(buf), &size, reinterpret_cast<const Bytef*>(m_blocks.data() + begin), m_blockEnds[block] - begin) == Z_OK;
+}
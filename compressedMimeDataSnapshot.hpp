@@ -0,0 +1,48 @@
+#pragma once
+
+#include "clipboardSnapshot.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Data kept compressed with deflate, in blocks that are compressed separately
+// read() only decompresses the blocks it touches, so reading at any offset costs about the same as reading from the start
+class CompressedMimeDataSnapshot : public MimeDataSnapshot
+{
+public:
+    // Uncompressed size of a block. Reads of whole aligned blocks are decompressed straight into the reader's buffer
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    // Compresses data. Null pointer if that wouldn't save enough memory to be worth decompressing it, like for PNG or JPEG
+    static std::shared_ptr<const MimeDataSnapshot> create(std::string_view data);
+
+    // Decompresses all of the data the first time it is called, and keeps it as long as this object
+    // Only for readers that need all bytes at once. Others should use read()
+    std::string_view data() const;
+    bool hasContiguousData() const;
+    size_t size() const;
+    size_t storedSize() const;
+    size_t read(char* buf, size_t size, size_t offset) const;
+
+private:
+    CompressedMimeDataSnapshot(size_t size, std::string blocks, std::vector<size_t> blockEnds);
+
+    const size_t m_size;
+    // Compressed blocks one after another
+    const std::string m_blocks;
+    // Offset in m_blocks of the end of each block
+    const std::vector<size_t> m_blockEnds;
+
+    mutable std::once_flag m_decompressFlag;
+    mutable std::string m_data;
+    // Size of m_data once it was decompressed, for storedSize() to read while data() may be running
+    mutable std::atomic<size_t> m_decompressedSize = 0;
+
+    // Decompresses block into buf, which must have room for all of it
+    bool decompressBlock(size_t block, char* buf) const;
+};
@@ -0,0 +1,108 @@
+#include "dataHash.hpp"
+
+#include <cstring> // std::memcpy
+
+namespace
+{
+constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+uint64_t rotateLeft(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// memcpy, since data may not be aligned. Assumes little endian, like the platforms Qt and fuse run on here
+uint64_t read64(const char* data)
+{
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint32_t read32(const char* data)
+{
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint64_t round(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * PRIME2;
+    accumulator = rotateLeft(accumulator, 31);
+    return accumulator * PRIME1;
+}
+
+uint64_t mergeRound(uint64_t accumulator, uint64_t value)
+{
+    accumulator ^= round(0, value);
+    return accumulator * PRIME1 + PRIME4;
+}
+} // namespace
+
+uint64_t hashData(std::string_view data, uint64_t seed)
+{
+    const char* position = data.data();
+    const char* const end = position + data.size();
+    uint64_t hash;
+
+    // Four independent lanes over 32 byte stripes, so the CPU can work on them in parallel
+    if (data.size() >= 32)
+    {
+        uint64_t lane1 = seed + PRIME1 + PRIME2;
+        uint64_t lane2 = seed + PRIME2;
+        uint64_t lane3 = seed;
+        uint64_t lane4 = seed - PRIME1;
+        const char* const lastStripe = end - 32;
+        do
+        {
+            lane1 = round(lane1, read64(position));
+            lane2 = round(lane2, read64(position + 8));
+            lane3 = round(lane3, read64(position + 16));
+            lane4 = round(lane4, read64(position + 24));
+            position += 32;
+        } while (position <= lastStripe);
+
+        hash = rotateLeft(lane1, 1) + rotateLeft(lane2, 7) + rotateLeft(lane3, 12) + rotateLeft(lane4, 18);
+        hash = mergeRound(hash, lane1);
+        hash = mergeRound(hash, lane2);
+        hash = mergeRound(hash, lane3);
+        hash = mergeRound(hash, lane4);
+    }
+    else
+    {
+        hash = seed + PRIME5;
+    }
+
+    hash += data.size();
+
+    // Remaining bytes that don't fill a stripe
+    for (; position + 8 <= end; position += 8)
+    {
+        hash ^= round(0, read64(position));
+        hash = rotateLeft(hash, 27) * PRIME1 + PRIME4;
+    }
+    if (position + 4 <= end)
+    {
+        hash ^= static_cast<uint64_t>(read32(position)) * PRIME1;
+        hash = rotateLeft(hash, 23) * PRIME2 + PRIME3;
+        position += 4;
+    }
+    for (; position < end; ++position)
+    {
+        hash ^= static_cast<uint64_t>(static_cast<unsigned char>(*position)) * PRIME5;
+        hash = rotateLeft(hash, 11) * PRIME1;
+    }
+
+    // Avalanche
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
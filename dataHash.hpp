@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+// Fast non-cryptographic 64-bit hash of data, the XXH64 algorithm of xxHash
+// Only used to find data that may be equal. Equal hashes must still be confirmed by comparing the data
+uint64_t hashData(std::string_view data, uint64_t seed = 0);
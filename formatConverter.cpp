@@ -0,0 +1,259 @@
+#include "formatConverter.hpp"
+
+#include "stats.hpp"
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QString>
+#include <QStringDecoder>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <optional>
+#include <set>
+#include <utility> // std::move
+
+namespace
+{
+const std::string TEXT_MIME_TYPE("text/plain");
+const std::string UTF8_TEXT_MIME_TYPE("text/plain;charset=utf-8");
+
+// Lossless formats are converted from first, so nothing is lost that doesn't have to be
+constexpr std::array<std::string_view, 3> PREFERRED_IMAGE_SOURCES = {"image/png", "image/bmp", "image/tiff"};
+
+std::string toLower(std::string_view text)
+{
+    std::string lower(text);
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+    return lower;
+}
+
+std::string_view trim(std::string_view text)
+{
+    const size_t begin = text.find_first_not_of(' ');
+    if (begin == std::string_view::npos)
+    {
+        return {};
+    }
+    return text.substr(begin, text.find_last_not_of(' ') - begin + 1);
+}
+
+// Lower case charset parameter of a text/plain full mime type, like "utf-16" for "text/plain;charset=UTF-16"
+// Empty if there is no charset parameter. Optional has no data if fullMimeType isn't text/plain
+std::optional<std::string> textCharset(std::string_view fullMimeType)
+{
+    if (fullMimeType.compare(0, TEXT_MIME_TYPE.size(), TEXT_MIME_TYPE) != 0)
+    {
+        return {};
+    }
+    std::string_view parameters = fullMimeType.substr(TEXT_MIME_TYPE.size());
+    if (!parameters.empty() && parameters[0] != ';')
+    {
+        return {};
+    }
+    while (!parameters.empty())
+    {
+        parameters.remove_prefix(1);
+        const size_t end = parameters.find(';');
+        const std::string_view parameter = trim(parameters.substr(0, end));
+        parameters = end == std::string_view::npos ? std::string_view() : parameters.substr(end);
+        const size_t equalsIndex = parameter.find('=');
+        if (equalsIndex == std::string_view::npos || toLower(trim(parameter.substr(0, equalsIndex))) != "charset")
+        {
+            continue;
+        }
+        std::string_view charset = trim(parameter.substr(equalsIndex + 1));
+        if (charset.size() >= 2 && charset.front() == '"' && charset.back() == '"')
+        {
+            charset = charset.substr(1, charset.size() - 2);
+        }
+        return toLower(charset);
+    }
+    return std::string();
+}
+
+bool isUtf8Charset(const std::string& charset)
+{
+    return charset == "utf-8" || charset == "utf8";
+}
+
+// Text in another charset, or text/plain without a charset, which is UTF-8 on X11
+// Nothing if the clipboard already has UTF-8 text with the charset given
+std::string findTextSource(const std::vector<std::string>& fullMimeTypes)
+{
+    std::string source;
+    for (const std::string& fullMimeType : fullMimeTypes)
+    {
+        const std::optional<std::string> charset = textCharset(fullMimeType);
+        if (!charset)
+        {
+            continue;
+        }
+        if (isUtf8Charset(*charset))
+        {
+            return {};
+        }
+        if (charset->empty())
+        {
+            if (source.empty())
+            {
+                source = fullMimeType;
+            }
+        }
+        else if ((source.empty() || source == TEXT_MIME_TYPE) && QStringDecoder(charset->c_str()).isValid())
+        {
+            source = fullMimeType;
+        }
+    }
+    return source;
+}
+
+// Decodes text in the charset of sourceFullMimeType, replacing bytes that aren't valid in it
+std::string convertText(const std::string& sourceFullMimeType, std::string_view data)
+{
+    std::string charset = textCharset(sourceFullMimeType).value_or(std::string());
+    if (charset.empty())
+    {
+        charset = "utf-8";
+    }
+    QStringDecoder decoder(charset.c_str());
+    const QString text = decoder.decode(QByteArray::fromRawData(data.data(), static_cast<qsizetype>(data.size())));
+    return text.toStdString();
+}
+
+// Image that Qt can read, other than one in the format it is converted to
+std::string findImageSource(const std::vector<std::string>& fullMimeTypes, const std::set<std::string, std::less<>>& readableMimeTypes,
+                            const std::string& targetFullMimeType)
+{
+    std::string source;
+    for (const std::string& fullMimeType : fullMimeTypes)
+    {
+        if (fullMimeType == targetFullMimeType || readableMimeTypes.find(fullMimeType) == readableMimeTypes.end())
+        {
+            continue;
+        }
+        if (std::find(PREFERRED_IMAGE_SOURCES.begin(), PREFERRED_IMAGE_SOURCES.end(), fullMimeType) != PREFERRED_IMAGE_SOURCES.end())
+        {
+            return fullMimeType;
+        }
+        if (source.empty())
+        {
+            source = fullMimeType;
+        }
+    }
+    return source;
+}
+
+// format is a Qt image format name, like "PNG". quality is from 0 to 100, or -1 for the format's default
+std::string convertImage(std::string_view data, const char* format, int quality)
+{
+    QImage image;
+    // Qt detects the format of the source from its bytes
+    if (!image.loadFromData(QByteArray::fromRawData(data.data(), static_cast<qsizetype>(data.size()))))
+    {
+        return {};
+    }
+    QByteArray encoded;
+    QBuffer buffer(&encoded);
+    buffer.open(QIODevice::WriteOnly);
+    if (!image.save(&buffer, format, quality))
+    {
+        return {};
+    }
+    return encoded.toStdString();
+}
+
+std::set<std::string, std::less<>> toMimeTypeSet(const QList<QByteArray>& mimeTypes)
+{
+    std::set<std::string, std::less<>> mimeTypeSet;
+    for (const QByteArray& mimeType : mimeTypes)
+    {
+        mimeTypeSet.emplace(mimeType.constData(), static_cast<size_t>(mimeType.size()));
+    }
+    return mimeTypeSet;
+}
+} // namespace
+
+FormatConverter::FormatConverter(const ClipboardDataOptions& options) : m_blobStore(options.spillThreshold)
+{
+    if (!options.convert)
+    {
+        return;
+    }
+
+    // Image plugins are only asked once, not on every clipboard change
+    const auto readableMimeTypes = toMimeTypeSet(QImageReader::supportedMimeTypes());
+    const auto writableMimeTypes = toMimeTypeSet(QImageWriter::supportedMimeTypes());
+    m_conversions.push_back(
+        {"image/png", [readableMimeTypes](const std::vector<std::string>& fullMimeTypes)
+            { return findImageSource(fullMimeTypes, readableMimeTypes, "image/png"); },
+         [](const std::string&, std::string_view data) { return convertImage(data, "PNG", -1); }});
+    // WebP is a plugin that may not be installed
+    if (writableMimeTypes.find("image/webp") != writableMimeTypes.end())
+    {
+        const int quality = std::clamp(options.webpQuality, 0, 100);
+        m_conversions.push_back(
+            {"image/webp", [readableMimeTypes](const std::vector<std::string>& fullMimeTypes)
+                { return findImageSource(fullMimeTypes, readableMimeTypes, "image/webp"); },
+             [quality](const std::string&, std::string_view data) { return convertImage(data, "WEBP", quality); }});
+    }
+    m_conversions.push_back({UTF8_TEXT_MIME_TYPE, findTextSource, convertText});
+
+    // Prefetch jobs wait for conversions, so the prefetcher has its own pool, and they split the threads
+    m_workerPool = std::make_unique<WorkerPool>(WorkerPool::defaultThreadsCount(options.workerPoolsCount()));
+}
+
+void FormatConverter::addConvertedFormats(ClipboardSnapshot& snapshot)
+{
+    if (m_conversions.empty())
+    {
+        return;
+    }
+    // Only formats of the owner are sources, so nothing is converted twice
+    std::vector<std::string> fullMimeTypes;
+    for (const auto& [mainMimeType, directory] : snapshot.mimeDirectories())
+    {
+        for (const auto& [fileName, entry] : directory)
+        {
+            fullMimeTypes.push_back(entry->fullMimeType());
+        }
+    }
+    for (const Conversion& conversion : m_conversions)
+    {
+        if (snapshot.hasFullMimeType(conversion.fullMimeType))
+        {
+            continue;
+        }
+        std::string source = conversion.findSource(fullMimeTypes);
+        if (source.empty())
+        {
+            continue;
+        }
+        snapshot.addConvertedMimeType(conversion.fullMimeType, source,
+                                      [this, &conversion, source](const std::shared_ptr<const MimeDataSnapshot>& sourceData,
+                                                                  ClipboardSnapshot::DataCallback done)
+                                      {
+                                          convert(conversion, source, sourceData, std::move(done));
+                                      });
+    }
+}
+
+void FormatConverter::convert(const Conversion& conversion, const std::string& sourceFullMimeType,
+                              const std::shared_ptr<const MimeDataSnapshot>& sourceData, ClipboardSnapshot::DataCallback done)
+{
+    // Nobody waits for the job, so it keeps its own copies. The conversions and m_blobStore are destroyed after the pool ran its jobs
+    m_workerPool->submit([this, &conversion, sourceFullMimeType, sourceData, done = std::move(done)]()
+        {
+            std::string data;
+            {
+                const Stats::ScopedTimer timer(Stats::Timer::Convert);
+                data = conversion.convert(sourceFullMimeType, sourceData->data());
+            }
+            // Data that can't be converted is empty rather than missing, since missing data means the clipboard changed
+            done(m_blobStore.intern(std::make_shared<StringMimeDataSnapshot>(std::move(data))));
+        });
+}
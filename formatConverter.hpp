@@ -0,0 +1,48 @@
+#pragma once
+
+#include "blobStore.hpp"
+#include "clipboardData.hpp"
+#include "clipboardSnapshot.hpp"
+#include "workerPool.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Adds formats the clipboard owner doesn't offer but that can be made from the ones it does, like image/png from any image
+// Nothing is converted when the clipboard changes. A format is converted the first time it is read, on a worker thread,
+// so the thread that watches the clipboard never encodes anything. The inode engine replies to the open from the worker, so its
+// filesystem threads don't wait either, but the path engine has no way to reply later, and its thread waits for the conversion
+// The result is kept in the snapshot, so it is cached per clipboard change and dropped along with the snapshot
+class FormatConverter
+{
+public:
+    // Adds no formats unless options.convert
+    explicit FormatConverter(const ClipboardDataOptions& options);
+    // Adds every converted format that snapshot doesn't have yet, but can make from one of its formats
+    // Only used while building the snapshot, before it is published. This object must outlive snapshot
+    void addConvertedFormats(ClipboardSnapshot& snapshot);
+
+private:
+    // A format that can be made from other formats
+    struct Conversion
+    {
+        std::string fullMimeType;
+        // Format to convert from, picked among the full mime types of a snapshot. Empty if none of them can be converted
+        std::function<std::string(const std::vector<std::string>& fullMimeTypes)> findSource;
+        // Called on a worker thread. Empty if data can't be converted
+        std::function<std::string(const std::string& sourceFullMimeType, std::string_view data)> convert;
+    };
+
+    std::vector<Conversion> m_conversions;
+    // Converted data is shared and spilled like the data it was converted from
+    BlobStore m_blobStore;
+    // Only created if there are conversions
+    std::unique_ptr<WorkerPool> m_workerPool;
+
+    // Converter of a converted format. Runs the conversion on a worker thread, which calls done with the data. Never null
+    void convert(const Conversion& conversion, const std::string& sourceFullMimeType, const std::shared_ptr<const MimeDataSnapshot>& sourceData,
+                 ClipboardSnapshot::DataCallback done);
+};
@@ -1,227 +1,1004 @@
 #include "fuse.hpp"
+#include "fuseCommon.hpp"
 
+#include <cstdlib> // std::malloc, std::free
 #include <cstring>
+#include <charconv>
 #include <array>
 #include <string_view>
-#include <mutex>
+#include <optional>
 #include <algorithm>
 #include <unordered_set>
 #include <unordered_map>
 #include <cassert>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 
 using namespace FuseImplementation;
 
-/* TODO:
- * Use file handles or other caching to avoid checking file path every time.
- * Create interface for clipboard data to eventually add...
- * GTK or raw X11 or other mechanism for clipboard access so QT is not required
-*/
-
-// Fuse private data is same as init data, for now
-using FusePrivateData = FuseInitData;
-
-// Should use std::string but it's not constexpr yet (as of C++17) and this is an unnecessary optimization I want to make
-constexpr std::string_view CLIPBOARD_BASE_PATH("/clipboard");
-// Basename of every file in FUSE filesystem, without extension.
-constexpr std::string_view BASE_FILE_NAME("file");
-
 // 0 flag for filler function. In most examples, 0 is passed for this flag. There isn't a enum for 0, so to pass a 0 in C++, need to cast 0 to the enum
 // This is undefined because there isn't an enum for 0, but it should be ok.
 constexpr fuse_fill_dir_flags FUSE_FILL_DIR_NO_FLAG = static_cast<fuse_fill_dir_flags>(0);
 
+// How often a read of /.events that waits for the next change checks if it was interrupted
+constexpr std::chrono::milliseconds EVENT_INTERRUPT_CHECK_INTERVAL(1000);
+
+FileHandle* getFileHandle(const fuse_file_info* fi)
+{
+    return reinterpret_cast<FileHandle*>(fi->fh);
+}
+
+// Tells the kernel to drop its cached entries, attributes and pages of paths whose data changed
+// Only called on the thread of the notifier of the filesystem, except for isCacheCurrent()
+class KernelCacheInvalidator
+{
+  public:
+    // rootPath is where the filesystem of clipboardData is, like "/:1" for a display. Empty for the root
+    KernelCacheInvalidator(fuse* fuse, ClipboardData* clipboardData, std::string rootPath)
+        : m_fuse(fuse), m_clipboardData(clipboardData), m_rootPath(std::move(rootPath)), m_lastHistory(clipboardData->history())
+    {
+        // Nothing is cached before the filesystem is initialized
+        for (size_t i = 0; i < CLIPBOARD_TREES.size(); ++i)
+        {
+            m_invalidatedGenerations[i] = clipboardData->snapshot(CLIPBOARD_TREES[i].mode)->generation();
+        }
+    }
+
+    void invalidateTree(ClipboardData::Mode mode, const std::shared_ptr<const ClipboardSnapshot>& oldSnapshot, uint64_t newGeneration)
+    {
+        const size_t treeIndex = clipboardTreeIndex(mode);
+        const std::string treePath = m_rootPath + std::string(CLIPBOARD_TREES[treeIndex].path);
+        if (oldSnapshot)
+        {
+            invalidateSnapshotPaths(treePath, *oldSnapshot);
+        }
+        fuse_invalidate_path(m_fuse, treePath.c_str());
+        if (mode == ClipboardData::Mode::Clipboard)
+        {
+            invalidateHistory();
+        }
+        m_invalidatedGenerations[treeIndex].store(newGeneration, std::memory_order_release);
+    }
+
+    void invalidateStaging(const StagingArea::Directories& directories)
+    {
+        const std::string stagingPath = m_rootPath + std::string(STAGING_BASE_PATH);
+        for (const auto& [mainMimeType, files] : directories)
+        {
+            const std::string directoryPath = stagingPath + '/' + mainMimeType;
+            for (const auto& [fileName, data] : files)
+            {
+                fuse_invalidate_path(m_fuse, (directoryPath + '/' + fileName).c_str());
+            }
+            fuse_invalidate_path(m_fuse, directoryPath.c_str());
+        }
+        fuse_invalidate_path(m_fuse, stagingPath.c_str());
+    }
+
+    // Can be called from any thread
+    // True if the kernel has no cached data of tree that is older than generation, so the page cache can be kept on open
+    bool isCacheCurrent(ClipboardData::Mode mode, uint64_t generation) const
+    {
+        return m_invalidatedGenerations[clipboardTreeIndex(mode)].load(std::memory_order_acquire) == generation;
+    }
+
+  private:
+    fuse* const m_fuse;
+    ClipboardData* const m_clipboardData;
+    const std::string m_rootPath;
+    // History as of the last invalidation
+    std::shared_ptr<const ClipboardHistory::SnapshotList> m_lastHistory;
+    std::array<std::atomic<uint64_t>, CLIPBOARD_TREES.size()> m_invalidatedGenerations;
+
+    // Every history directory whose snapshot was replaced by another one now refers to different data
+    void invalidateHistory()
+    {
+        std::shared_ptr<const ClipboardHistory::SnapshotList> history = m_clipboardData->history();
+        const std::string historyPath = m_rootPath + std::string(HISTORY_BASE_PATH);
+        for (const size_t i : replacedHistoryIndices(*m_lastHistory, *history))
+        {
+            const std::string rootPath = historyPath + '/' + std::to_string(i);
+            invalidateSnapshotPaths(rootPath, *(*m_lastHistory)[i]);
+            fuse_invalidate_path(m_fuse, rootPath.c_str());
+        }
+        fuse_invalidate_path(m_fuse, historyPath.c_str());
+        m_lastHistory = std::move(history);
+    }
+
+    // Invalidates all mime type directories and files of snapshot, found below rootPath
+    // Paths the kernel doesn't know about fail with -ENOENT, which is fine, since nothing is cached for them
+    void invalidateSnapshotPaths(std::string path, const ClipboardSnapshot& snapshot)
+    {
+        const size_t rootPathSize = path.size();
+        for (const auto& [mainMimeType, directory] : snapshot.mimeDirectories())
+        {
+            path.resize(rootPathSize);
+            path += '/';
+            path += mainMimeType;
+            const size_t directoryPathSize = path.size();
+            for (const auto& [fileName, entry] : directory)
+            {
+                path.resize(directoryPathSize);
+                path += '/';
+                path += fileName;
+                fuse_invalidate_path(m_fuse, path.c_str());
+            }
+            path.resize(directoryPathSize);
+            fuse_invalidate_path(m_fuse, path.c_str());
+        }
+    }
+};
+
+// Created in init() from the init data, destroyed in destroy()
+struct FusePrivateData : FileSystemData
+{
+    std::unique_ptr<KernelCacheInvalidator> cacheInvalidator;
+    // Filesystem of each display, when several displays are served. The root then only has their directories and the stats files,
+    // and clipboardData is null
+    std::vector<std::pair<std::string, std::unique_ptr<FusePrivateData>>> displays;
+};
+
+// Filesystem of the display that the running operation is in, set by Routed while the operation runs
+// Null when there is only one filesystem, at the root
+thread_local FusePrivateData* routedPrivateData = nullptr;
+
+FusePrivateData* getRootPrivateData()
+{
+    return reinterpret_cast<FusePrivateData*>(fuse_get_context()->private_data);
+}
 FusePrivateData* getPrivateData()
 {
-    auto* privateData = reinterpret_cast<FusePrivateData*>(fuse_get_context()->private_data);
-    return privateData;
+    return routedPrivateData ? routedPrivateData : getRootPrivateData();
 }
 ClipboardData* getClipboardData()
 {
     return getPrivateData()->clipboardData;
 }
 
-// Removes leading part of mime type, returns name of file as {BASE_FILE_NAME}.{mimetype}
-// If mimetype is "image/png" and BASE_FILE_NAME="file", file name returned is "file.png"
-std::string fullMimeTypeToFileName(const std::string& mimeType)
+// Operation that, when several displays are served, runs on the filesystem of the display its path is in
+// The first part of the path names the display, like ":1" in "/:1/clipboard/text", and function is given the rest of the path
+// The root itself and the stats files are given as they are. Other paths in the root don't exist
+template <typename Function, Function function>
+struct Routed;
+
+template <typename... Args, int (*function)(const char*, Args...)>
+struct Routed<int (*)(const char*, Args...), function>
+{
+    static int call(const char* path, Args... args)
+    {
+        const FusePrivateData* rootPrivateData = getRootPrivateData();
+        if (rootPrivateData->displays.empty() || strcmp(path, "/") == 0 || findStatsFile(path))
+        {
+            return function(path, args...);
+        }
+        // +1 to skip leading slash
+        const std::string_view relativePath(path + 1);
+        const size_t slashIndex = relativePath.find('/');
+        const std::string_view displayName = relativePath.substr(0, slashIndex);
+        const auto it = std::find_if(rootPrivateData->displays.begin(), rootPrivateData->displays.end(),
+                                     [displayName](const auto& display) { return display.first == displayName; });
+        if (it == rootPrivateData->displays.end())
+        {
+            return -ENOENT;
+        }
+        FusePrivateData* const previousPrivateData = std::exchange(routedPrivateData, it->second.get());
+        const int result = function(slashIndex == std::string_view::npos ? "/" : path + 1 + slashIndex, args...);
+        routedPrivateData = previousPrivateData;
+        return result;
+    }
+};
+
+// Routed operation that is timed for /.stats
+template <Stats::Timer timer, typename Function, Function function>
+using TimedRouted = Stats::Timed<timer, Function, Routed<Function, function>::call>;
+
+// Path inside a clipboard tree, split into its parts
+// For "/clipboard/image", mainMimeType is "image" and fileName is empty. For "/clipboard/image/file.png", fileName is "file.png"
+// Views point into the path given to splitMimePath()
+struct MimePath
 {
-    auto slashIndex = mimeType.find('/');
-    // Maybe reserve space to increase performance
-    std::string fileName = BASE_FILE_NAME.data() + ("." + mimeType.substr(slashIndex + 1));
-    return fileName;
+    std::string_view mainMimeType;
+    std::string_view fileName;
+};
+
+// Tree that path is the root of or is inside of. Null pointer if path is not in any tree
+const ClipboardTree* findClipboardTree(std::string_view path)
+{
+    for (const ClipboardTree& tree : CLIPBOARD_TREES)
+    {
+        if (path.compare(0, tree.path.size(), tree.path) == 0 && (path.size() == tree.path.size() || path[tree.path.size()] == '/'))
+        {
+            return &tree;
+        }
+    }
+    return nullptr;
 }
 
-// Given file path in form of "{mimetype prefix}/{name}.{mimetype}", returns full mimetype, {mimetype prefix}/{mimetype}
-// For example, if base file name is "basefile", then "image/basefile.png" returns "image/png"
-std::string filePathToFullMimeType(const std::string& filePath)
+// Optional has no data if path is not below treePath
+std::optional<MimePath> splitMimePath(std::string_view path, std::string_view treePath)
 {
-    auto baseFileNameIndex = filePath.find(BASE_FILE_NAME.data());
-    if (baseFileNameIndex == std::string::npos)
+    // +1 for slash after treePath
+    if (path.size() <= treePath.size() + 1 || path.compare(0, treePath.size(), treePath) != 0 || path[treePath.size()] != '/')
     {
-        return std::string();
+        return {};
     }
-    auto dotIndex = filePath.find('.', baseFileNameIndex + BASE_FILE_NAME.size());
-    if (dotIndex == std::string::npos)
+    path.remove_prefix(treePath.size() + 1);
+    auto slashIndex = path.find('/');
+    if (slashIndex == std::string_view::npos)
     {
-        return std::string();
+        return MimePath{path, std::string_view()};
+    }
+    return MimePath{path.substr(0, slashIndex), path.substr(slashIndex + 1)};
+}
+
+// Snapshot that a path is in, and the path of the snapshot's root directory
+struct SnapshotPath
+{
+    std::shared_ptr<const ClipboardSnapshot> snapshot;
+    ClipboardData::Mode mode;
+    // Like "/clipboard" or "/history/2". Points into the path given to resolveSnapshotPath()
+    std::string_view rootPath;
+    // False for history snapshots. Their paths refer to other snapshots once the clipboard changes
+    bool isCurrent;
+};
+
+// Optional has no data if path is not in any snapshot's directory
+std::optional<SnapshotPath> resolveSnapshotPath(ClipboardData* clipboardData, std::string_view path)
+{
+    if (const ClipboardTree* tree = findClipboardTree(path))
+    {
+        return SnapshotPath{clipboardData->snapshot(tree->mode), tree->mode, path.substr(0, tree->path.size()), true};
+    }
+
+    // +1 for slash after history path
+    if (path.size() <= HISTORY_BASE_PATH.size() + 1 || path.compare(0, HISTORY_BASE_PATH.size(), HISTORY_BASE_PATH) != 0 ||
+        path[HISTORY_BASE_PATH.size()] != '/')
+    {
+        return {};
+    }
+    std::string_view indexString = path.substr(HISTORY_BASE_PATH.size() + 1);
+    indexString = indexString.substr(0, indexString.find('/'));
+    size_t index;
+    const auto [indexEnd, error] = std::from_chars(indexString.data(), indexString.data() + indexString.size(), index);
+    // Leading zeros would make several names for the same directory
+    if (error != std::errc() || indexEnd != indexString.data() + indexString.size() || (indexString.size() > 1 && indexString[0] == '0'))
+    {
+        return {};
+    }
+    const std::shared_ptr<const ClipboardHistory::SnapshotList> history = clipboardData->history();
+    if (index >= history->size())
+    {
+        return {};
+    }
+    return SnapshotPath{(*history)[index], ClipboardData::Mode::Clipboard,
+                        path.substr(0, HISTORY_BASE_PATH.size() + 1 + indexString.size()), false};
+}
+
+// Optional has no data if path can't be written to
+// Files in history are never writable. Files in /clipboard and /selection replace the whole clipboard when written
+std::optional<WriteTarget> resolveWriteTarget(std::string_view path)
+{
+    if (path == STAGING_COMMIT_PATH)
+    {
+        return WriteTarget{WriteTarget::Kind::Commit, ClipboardData::Mode::Clipboard, {}, {}, {}};
+    }
+    if (const ClipboardTree* tree = findClipboardTree(path))
+    {
+        const auto mimePath = splitMimePath(path, tree->path);
+        if (!mimePath)
+        {
+            return {};
+        }
+        return makeWriteTarget(WriteTarget::Kind::Clipboard, tree->mode, mimePath->mainMimeType, mimePath->fileName);
+    }
+    const auto mimePath = splitMimePath(path, STAGING_BASE_PATH);
+    if (!mimePath)
+    {
+        return {};
+    }
+    return makeWriteTarget(WriteTarget::Kind::Staging, ClipboardData::Mode::Clipboard, mimePath->mainMimeType, mimePath->fileName);
+}
+
+// Serves clipboardData in privateData, whose filesystem is at rootPath, like "/:1". Empty for the root
+void startFileSystem(FusePrivateData* privateData, fuse* fuse, ClipboardData* clipboardData, const std::string& rootPath)
+{
+    privateData->clipboardData = clipboardData;
+    privateData->cacheInvalidator = std::make_unique<KernelCacheInvalidator>(fuse, clipboardData, rootPath);
+    KernelCacheInvalidator* cacheInvalidator = privateData->cacheInvalidator.get();
+    watchChanges(*privateData,
+                 [cacheInvalidator](ClipboardData::Mode mode, const std::shared_ptr<const ClipboardSnapshot>& oldSnapshot, uint64_t newGeneration)
+                 { cacheInvalidator->invalidateTree(mode, oldSnapshot, newGeneration); },
+                 [cacheInvalidator](const StagingArea::Directories& directories) { cacheInvalidator->invalidateStaging(directories); });
+}
+
+// Once this returns, the invalidator isn't used anymore, and reads of /.events don't wait anymore
+void stopFileSystem(FusePrivateData& privateData)
+{
+    for (auto& [displayName, displayPrivateData] : privateData.displays)
+    {
+        stopFileSystem(*displayPrivateData);
+    }
+    if (privateData.clipboardData)
+    {
+        stopWatchingChanges(privateData);
+    }
+    else
+    {
+        privateData.events.stop();
     }
-    // +1 to skip dot
-    std::string mimeType = filePath.substr(0, baseFileNameIndex) + filePath.substr(dotIndex + 1);
-    return mimeType;
 }
 
 void* init(fuse_conn_info* conn, fuse_config* config)
 {
-    // Since init data is same as private data, no need to change anything
-    return fuse_get_context()->private_data;
+    fuse_context* context = fuse_get_context();
+    auto* initData = reinterpret_cast<FuseInitData*>(context->private_data);
+    auto* privateData = new FusePrivateData();
+
+    // Contents only change when the clipboard changes, and changed paths are invalidated then
+    // Negative entries aren't cached, since new mime types aren't invalidated
+    config->entry_timeout = KERNEL_CACHE_TIMEOUT_SECONDS;
+    config->attr_timeout = KERNEL_CACHE_TIMEOUT_SECONDS;
+    config->negative_timeout = 0;
+
+    // Replies are spliced to the kernel, so data in a memfd is never copied to user space
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    // O_TRUNC is passed to open instead of truncating first, so opening to overwrite doesn't copy the old data
+    conn->want |= conn->capable & FUSE_CAP_ATOMIC_O_TRUNC;
+
+    if (initData->displays.empty())
+    {
+        startFileSystem(privateData, context->fuse, initData->clipboardData, std::string());
+        return privateData;
+    }
+    for (const auto& [displayName, clipboardData] : initData->displays)
+    {
+        auto displayPrivateData = std::make_unique<FusePrivateData>();
+        startFileSystem(displayPrivateData.get(), context->fuse, clipboardData, '/' + displayName);
+        privateData->displays.emplace_back(displayName, std::move(displayPrivateData));
+    }
+    return privateData;
+}
+
+void destroy(void* privateDataPointer)
+{
+    auto* privateData = reinterpret_cast<FusePrivateData*>(privateDataPointer);
+    stopFileSystem(*privateData);
+    delete privateData;
+}
+
+// Root of snapshot, like /clipboard or /history/2
+void snapshotRootAttributes(const ClipboardSnapshot& snapshot, struct stat* stbuf)
+{
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2 + snapshot.mainMimeTypesCount();
+    setChangeTime(*stbuf, snapshot);
+}
+
+// Main mime type directory of snapshot, like "image" or "text"
+void mimeDirectoryAttributes(const ClipboardSnapshot& snapshot, const ClipboardSnapshot::MimeDirectory& directory, struct stat* stbuf)
+{
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2 + directory.size();
+    setChangeTime(*stbuf, snapshot);
+}
+
+// File of snapshot whose data has size bytes
+void mimeFileAttributes(const ClipboardSnapshot& snapshot, bool isCurrent, size_t size, struct stat* stbuf)
+{
+    // History snapshots can't be written to
+    stbuf->st_mode = S_IFREG | (isCurrent ? 0644 : 0444);
+    stbuf->st_nlink = 1;
+    stbuf->st_size = size;
+    setChangeTime(*stbuf, snapshot);
 }
 
 int getAttr(const char* path, struct stat* stbuf, fuse_file_info* fi)
 {
+    // Open file, report size of the data pinned by the file handle, or of the data written so far
+    if (fi && getFileHandle(fi))
+    {
+        FileHandle* fileHandle = getFileHandle(fi);
+        stbuf->st_nlink = 1;
+        if (fileHandle->writeTarget)
+        {
+            std::lock_guard lock(fileHandle->writeMutex);
+            stbuf->st_mode = S_IFREG | (fileHandle->writeTarget->kind == WriteTarget::Kind::Commit ? 0200 : 0644);
+            stbuf->st_size = fileHandle->writeBuffer.size();
+            return 0;
+        }
+        if (fileHandle->eventReader)
+        {
+            stbuf->st_mode = S_IFREG | 0444;
+            stbuf->st_size = 0;
+            return 0;
+        }
+        stbuf->st_mode = S_IFREG | (resolveWriteTarget(path) ? 0644 : 0444);
+        // Size of a stream is unknown until all of it was received
+        stbuf->st_size = fileHandle->stream ? fileHandle->stream->size().value_or(0) : fileHandle->data->size();
+        return 0;
+    }
     if (strcmp(path, "/") == 0)
     {
         stbuf->st_mode = S_IFDIR | 0755;
-        // 1 subdir, /clipboard/
-        stbuf->st_nlink = 3;
+        // 1 subdir for each clipboard tree, like /clipboard/, /history/ and /staging/, or for each display
+        const size_t displaysCount = getPrivateData()->displays.size();
+        stbuf->st_nlink = 2 + (displaysCount ? displaysCount : CLIPBOARD_TREES.size() + 2);
         return 0;
     }
-    else if (strcmp(path, CLIPBOARD_BASE_PATH.data()) == 0)
+    if (findStatsFile(path) || path == EVENTS_PATH)
     {
-        ClipboardData* clipboardData = getClipboardData();
-        auto lock = clipboardData->getLock();
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2 + clipboardData->mainMimeTypesCount();
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = 0;
         return 0;
     }
-    // path starts with /clipboard
-    else if (strncmp(path, CLIPBOARD_BASE_PATH.data(), CLIPBOARD_BASE_PATH.size()) == 0)
+    ClipboardData* clipboardData = getClipboardData();
+    if (path == HISTORY_BASE_PATH)
     {
-        // Check if path is a mime dir
-
-        // skip leading /clipboard/
-        std::string pathWithoutClipboardType(path + CLIPBOARD_BASE_PATH.size() + 1);
-
-        ClipboardData* clipboardData = getClipboardData();
-        auto lock = clipboardData->getLock();
+        const std::shared_ptr<const ClipboardHistory::SnapshotList> history = clipboardData->history();
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2 + history->size();
+        // Changes with every snapshot added to history
+        if (!history->empty())
+        {
+            setChangeTime(*stbuf, *history->front());
+        }
+        return 0;
+    }
 
-        // Check for main mime type directory
-        // If pathWithoutClipboardType is a mimeprefix, like "image" or "text"
-        if (clipboardData->hasMainMimeType(pathWithoutClipboardType))
+    const StagingArea& stagingArea = getPrivateData()->stagingArea;
+    if (path == STAGING_BASE_PATH)
+    {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2 + stagingArea.directoriesCount();
+        return 0;
+    }
+    // Only written to, to commit
+    if (path == STAGING_COMMIT_PATH)
+    {
+        stbuf->st_mode = S_IFREG | 0200;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = 0;
+        return 0;
+    }
+    if (const auto stagingPath = splitMimePath(path, STAGING_BASE_PATH))
+    {
+        if (stagingPath->fileName.empty())
         {
+            const auto fileNames = stagingArea.fileNames(stagingPath->mainMimeType);
+            if (!fileNames)
+            {
+                return -ENOENT;
+            }
             stbuf->st_mode = S_IFDIR | 0755;
-            // pathWIthoutClipboard has been verified to be a main MIME type
-            stbuf->st_nlink = 2 + clipboardData->mimeSubTypesCount(pathWithoutClipboardType);
+            stbuf->st_nlink = 2 + fileNames->size();
             return 0;
         }
+        const std::shared_ptr<const MimeDataSnapshot> data = stagingArea.data(stagingPath->mainMimeType, stagingPath->fileName);
+        if (!data)
+        {
+            return -ENOENT;
+        }
+        stbuf->st_mode = S_IFREG | 0644;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = data->data().size();
+        return 0;
+    }
 
-        // Check if file, skipping "/clipboard/", matches a full mimetype we have data for
-        std::string possibleFullMimeType = filePathToFullMimeType(pathWithoutClipboardType);
-        std::optional<size_t> dataSize = clipboardData->dataSize(possibleFullMimeType);
-        if (dataSize)
+    const auto snapshotPath = resolveSnapshotPath(clipboardData, path);
+    if (!snapshotPath)
+    {
+        return -ENOENT;
+    }
+    const ClipboardSnapshot& snapshot = *snapshotPath->snapshot;
+    const auto mimePath = splitMimePath(path, snapshotPath->rootPath);
+    // Root of snapshot, like /clipboard
+    if (!mimePath)
+    {
+        snapshotRootAttributes(snapshot, stbuf);
+        return 0;
+    }
+
+    // Check for main mime type directory, like "image" or "text"
+    if (mimePath->fileName.empty())
+    {
+        const ClipboardSnapshot::MimeDirectory* directory = snapshot.mimeDirectory(mimePath->mainMimeType);
+        if (!directory)
         {
-            stbuf->st_mode = S_IFREG | 0444;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = *dataSize;
-            return 0;
+            return -ENOENT;
         }
+        mimeDirectoryAttributes(snapshot, *directory, stbuf);
+        return 0;
     }
 
-    return -ENOENT;
+    // Check if file matches a full mimetype we have data for
+    const ClipboardSnapshot::MimeEntry* entry = snapshot.mimeFile(mimePath->mainMimeType, mimePath->fileName);
+    if (!entry)
+    {
+        return -ENOENT;
+    }
+    // Attributes are never waited for, so listing a directory doesn't fetch streamed formats or convert converted ones
+    if (hasUnknownSize(clipboardData, snapshot, snapshotPath->isCurrent, *entry))
+    {
+        mimeFileAttributes(snapshot, snapshotPath->isCurrent, 0, stbuf);
+        return 0;
+    }
+    if (const std::optional<size_t> size = knownSize(snapshot, snapshotPath->isCurrent, *entry))
+    {
+        mimeFileAttributes(snapshot, snapshotPath->isCurrent, *size, stbuf);
+        return 0;
+    }
+    // Size may only be known after fetching the data
+    std::shared_ptr<const MimeDataSnapshot> data = entryData(clipboardData, snapshot, snapshotPath->mode, snapshotPath->isCurrent, *entry);
+    if (!data)
+    {
+        return -ENOENT;
+    }
+    mimeFileAttributes(snapshot, snapshotPath->isCurrent, data->size(), stbuf);
+    return 0;
+}
+
+// Adds name to a directory listing
+// With FUSE_READDIR_PLUS, the attributes in stbuf are given to the kernel too, so it doesn't call getAttr() for each entry
+// stbuf is null if the attributes aren't known without fetching data, and are left to getAttr()
+void fillEntry(void* buf, fuse_fill_dir_t filler, const char* name, const struct stat* stbuf, fuse_readdir_flags flags)
+{
+    if (stbuf && (flags & FUSE_READDIR_PLUS))
+    {
+        filler(buf, name, stbuf, 0, FUSE_FILL_DIR_PLUS);
+        return;
+    }
+    filler(buf, name, NULL, 0, FUSE_FILL_DIR_NO_FLAG);
 }
 
 int readDir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, fuse_file_info* fi,
             fuse_readdir_flags flags)
 {
-    //filler(buf, ".", NULL, 0, fuse_fill_dir_flags::FUSE_FILL_DIR_PLUS);
     filler(buf, ".", NULL, 0, FUSE_FILL_DIR_NO_FLAG);
     filler(buf, "..", NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+    if (strcmp(path, "/") == 0 && !getPrivateData()->displays.empty())
+    {
+        for (const auto& [displayName, displayPrivateData] : getPrivateData()->displays)
+        {
+            filler(buf, displayName.c_str(), NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+        }
+        // +1 to skip leading slash. Paths are string literals, so they are null terminated
+        for (const StatsFile& statsFile : STATS_FILES)
+        {
+            filler(buf, statsFile.path.data() + 1, NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+        }
+        return 0;
+    }
     if (strcmp(path, "/") == 0)
     {
-        filler(buf, "clipboard", NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+        // +1 to skip leading slash. Paths are string literals, so they are null terminated
+        for (const ClipboardTree& tree : CLIPBOARD_TREES)
+        {
+            filler(buf, tree.path.data() + 1, NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+        }
+        filler(buf, HISTORY_BASE_PATH.data() + 1, NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+        filler(buf, STAGING_BASE_PATH.data() + 1, NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+        for (const StatsFile& statsFile : STATS_FILES)
+        {
+            filler(buf, statsFile.path.data() + 1, NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+        }
+        filler(buf, EVENTS_PATH.data() + 1, NULL, 0, FUSE_FILL_DIR_NO_FLAG);
         return 0;
     }
-    else if (strcmp(path, "/clipboard") == 0)
+    const StagingArea& stagingArea = getPrivateData()->stagingArea;
+    if (path == STAGING_BASE_PATH)
     {
-        ClipboardData* clipboardData = getClipboardData();
-        auto lock = clipboardData->getLock();
-        const auto mainMimeTypes = clipboardData->mainMimeTypes();
-        for (const std::string& mainMimeType : mainMimeTypes)
+        // +1 to skip slash before file name
+        filler(buf, STAGING_COMMIT_PATH.data() + STAGING_BASE_PATH.size() + 1, NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+        for (const std::string& mainMimeType : stagingArea.directoryNames())
         {
             filler(buf, mainMimeType.c_str(), NULL, 0, FUSE_FILL_DIR_NO_FLAG);
         }
         return 0;
     }
-    // If path start swith clipboard base path
-    else if (strncmp(path, CLIPBOARD_BASE_PATH.data(), CLIPBOARD_BASE_PATH.size()) == 0)
+    if (const auto stagingPath = splitMimePath(path, STAGING_BASE_PATH))
+    {
+        const auto fileNames = stagingArea.fileNames(stagingPath->mainMimeType);
+        if (!stagingPath->fileName.empty() || !fileNames)
+        {
+            return -ENOENT;
+        }
+        for (const std::string& fileName : *fileNames)
+        {
+            filler(buf, fileName.c_str(), NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+        }
+        return 0;
+    }
+    ClipboardData* clipboardData = getClipboardData();
+    if (path == HISTORY_BASE_PATH)
+    {
+        const std::shared_ptr<const ClipboardHistory::SnapshotList> history = clipboardData->history();
+        for (size_t i = 0; i < history->size(); ++i)
+        {
+            struct stat stbuf = {};
+            snapshotRootAttributes(*(*history)[i], &stbuf);
+            fillEntry(buf, filler, std::to_string(i).c_str(), &stbuf, flags);
+        }
+        return 0;
+    }
+
+    const auto snapshotPath = resolveSnapshotPath(clipboardData, path);
+    if (!snapshotPath)
+    {
+        return -ENOENT;
+    }
+    const ClipboardSnapshot& snapshot = *snapshotPath->snapshot;
+    const auto mimePath = splitMimePath(path, snapshotPath->rootPath);
+    // Root of snapshot, list main mime type directories
+    // All attributes come from the one snapshot resolved above, so they are consistent even if the clipboard changes meanwhile
+    if (!mimePath)
+    {
+        for (const auto& [mainMimeType, directory] : snapshot.mimeDirectories())
+        {
+            struct stat stbuf = {};
+            mimeDirectoryAttributes(snapshot, directory, &stbuf);
+            fillEntry(buf, filler, mainMimeType.c_str(), &stbuf, flags);
+        }
+        return 0;
+    }
+    // If path is a main mime type directory, list a file for each of its subtypes
+    if (mimePath->fileName.empty())
     {
-        ClipboardData* clipboardData = getClipboardData();
-        auto lock = clipboardData->getLock();
-        // Skip leading /clipboard/
-        // +1 to skip last /
-        // If path ends with main mime type, add subtypes to directory listing
-        const auto subTypes = clipboardData->mimeSubTypes(path + CLIPBOARD_BASE_PATH.size() + 1);
-        if (subTypes.empty())
+        const ClipboardSnapshot::MimeDirectory* directory = snapshot.mimeDirectory(mimePath->mainMimeType);
+        if (!directory)
         {
             return -ENOENT;
         }
-        std::string filename(BASE_FILE_NAME.data());
-        filename += ".";
-        auto extensionIndex = filename.size();
-        for (const std::string& subType : subTypes)
+        // File names were rendered when the snapshot was built
+        for (const auto& [fileName, entry] : *directory)
         {
-            // Replace old extension with new extension
-            filename.replace(extensionIndex, std::string::npos, subType);
-            filler(buf, filename.c_str(), NULL, 0, FUSE_FILL_DIR_NO_FLAG);
+            // Data isn't fetched only to list its size, so listing a lazy clipboard stays cheap
+            const std::optional<size_t> size = knownSize(snapshot, snapshotPath->isCurrent, *entry);
+            struct stat stbuf = {};
+            if (size)
+            {
+                mimeFileAttributes(snapshot, snapshotPath->isCurrent, *size, &stbuf);
+            }
+            fillEntry(buf, filler, fileName.c_str(), size ? &stbuf : nullptr, flags);
         }
         return 0;
     }
     return -ENOENT;
 }
 
+// Opens or creates a file for writing. Written data is buffered in the file handle, and published when the file is flushed
+int openForWriting(const char* path, fuse_file_info* fi, bool create)
+{
+    auto target = resolveWriteTarget(path);
+    if (!target)
+    {
+        return -EACCES;
+    }
+    std::unique_ptr<FileHandle> fileHandle;
+    const int result = openWriteFileHandle(*getPrivateData(), std::move(*target), create, fi->flags & O_TRUNC, fileHandle);
+    if (result < 0)
+    {
+        return result;
+    }
+    fi->fh = reinterpret_cast<uint64_t>(fileHandle.release());
+    return 0;
+}
+
 int open(const char* path, fuse_file_info* fi)
 {
     if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+        return openForWriting(path, fi, false);
+    }
+    if (path == STAGING_COMMIT_PATH)
     {
         return -EACCES;
     }
-    if (strncmp(path, CLIPBOARD_BASE_PATH.data(), CLIPBOARD_BASE_PATH.size()) == 0)
+    // Reported as empty, so the kernel must not limit reads to the size
+    if (const StatsFile* statsFile = findStatsFile(path))
     {
-        ClipboardData* clipboardData = getClipboardData();
-        auto lock = clipboardData->getLock();
-        if (clipboardData->hasFullMimeType(filePathToFullMimeType(path + CLIPBOARD_BASE_PATH.size() + 1)))
+        fi->fh = makeStatsFileHandle(*statsFile);
+        fi->direct_io = 1;
+        return 0;
+    }
+    if (path == EVENTS_PATH)
+    {
+        fi->fh = makeEventsFileHandle(*getPrivateData());
+        fi->direct_io = 1;
+        fi->nonseekable = 1;
+        return 0;
+    }
+    if (const auto stagingPath = splitMimePath(path, STAGING_BASE_PATH))
+    {
+        std::shared_ptr<const MimeDataSnapshot> data =
+            getPrivateData()->stagingArea.data(stagingPath->mainMimeType, stagingPath->fileName);
+        if (!data)
         {
+            return -ENOENT;
+        }
+        fi->fh = makeReadFileHandle(std::move(data));
+        return 0;
+    }
+    ClipboardData* clipboardData = getClipboardData();
+    const auto snapshotPath = resolveSnapshotPath(clipboardData, path);
+    if (!snapshotPath)
+    {
+        return -ENOENT;
+    }
+    const auto mimePath = splitMimePath(path, snapshotPath->rootPath);
+    if (!mimePath)
+    {
+        return -ENOENT;
+    }
+    const ClipboardSnapshot& snapshot = *snapshotPath->snapshot;
+    const ClipboardSnapshot::MimeEntry* entry = snapshot.mimeFile(mimePath->mainMimeType, mimePath->fileName);
+    if (!entry)
+    {
+        return -ENOENT;
+    }
+    // Data that isn't fetched yet is read as the owner sends it, so the first bytes don't wait for the last ones
+    // The size is unknown, so the kernel must not cache or limit reads to the size
+    if (isStreamed(clipboardData, snapshot, snapshotPath->isCurrent, *entry))
+    {
+        if (std::shared_ptr<MimeDataStream> stream = clipboardData->openStream(snapshot, entry->fullMimeType(), snapshotPath->mode))
+        {
+            auto* fileHandle = new FileHandle();
+            fileHandle->stream = std::move(stream);
+            fi->fh = reinterpret_cast<uint64_t>(fileHandle);
+            fi->direct_io = 1;
+            fi->nonseekable = 1;
             return 0;
         }
     }
-    return -ENOENT;
+    // The kernel was told the size is 0, so it must not limit reads to it
+    if (hasUnknownSize(clipboardData, snapshot, snapshotPath->isCurrent, *entry))
+    {
+        fi->direct_io = 1;
+    }
+    std::shared_ptr<const MimeDataSnapshot> data = snapshot.mimeData(*entry);
+    // Pages cached by the kernel can only be kept if they are from this snapshot
+    // If the data has to come from a newer clipboard instead, it can't be known what the kernel has cached
+    // History paths are reused by other snapshots, so their pages are never kept
+    if (data)
+    {
+        fi->keep_cache = snapshotPath->isCurrent &&
+                         getPrivateData()->cacheInvalidator->isCacheCurrent(snapshotPath->mode, snapshot.generation());
+    }
+    else
+    {
+        data = entryData(clipboardData, snapshot, snapshotPath->mode, snapshotPath->isCurrent, *entry);
+    }
+    if (!data)
+    {
+        return -ENOENT;
+    }
+    fi->fh = makeReadFileHandle(std::move(data));
+    return 0;
+}
+
+int create(const char* path, mode_t mode, fuse_file_info* fi)
+{
+    return openForWriting(path, fi, true);
+}
+
+// Reads the next change from /.events
+// The high-level API has to answer from the calling thread, so a read that waits holds a filesystem thread until the next change
+// Polling and reading with O_NONBLOCK holds no thread
+int readEvent(FileHandle& fileHandle, char* buf, size_t size, bool nonBlocking)
+{
+    ChangeEventLog& events = getPrivateData()->events;
+    std::optional<std::string> data = events.read(*fileHandle.eventReader, size);
+    while (!data && !nonBlocking && !events.isStopped())
+    {
+        // Nothing wakes this thread when the read is interrupted, so it checks now and then
+        if (fuse_interrupted())
+        {
+            return -EINTR;
+        }
+        data = events.waitRead(*fileHandle.eventReader, size, EVENT_INTERRUPT_CHECK_INTERVAL);
+    }
+    if (!data)
+    {
+        // Like the end of a pipe once the filesystem is unmounted
+        return events.isStopped() ? 0 : -EAGAIN;
+    }
+    return copyDataWindow(*data, buf, size, 0);
 }
 
 int read(const char* path, char* buf, size_t size, off_t offset, fuse_file_info* fi)
 {
-    if (strncmp(path, CLIPBOARD_BASE_PATH.data(), CLIPBOARD_BASE_PATH.size()) == 0)
+    // Data was pinned in open(), so no path lookup is needed
+    FileHandle* fileHandle = getFileHandle(fi);
+    if (!fileHandle)
+    {
+        return -EBADF;
+    }
+    if (fileHandle->eventReader)
+    {
+        return readEvent(*fileHandle, buf, size, fi->flags & O_NONBLOCK);
+    }
+    return readFileHandle(*fileHandle, buf, size, offset);
+}
+
+// libfuse frees the buffers of the vector after replying, so memory buffers can't point into pinned data
+// Data in a file is given as the file instead, which libfuse splices to the kernel without copying
+int readBuf(const char* path, fuse_bufvec** bufp, size_t size, off_t offset, fuse_file_info* fi)
+{
+    FileHandle* fileHandle = getFileHandle(fi);
+    if (!fileHandle)
+    {
+        return -EBADF;
+    }
+    auto* bufvec = static_cast<fuse_bufvec*>(std::malloc(sizeof(fuse_bufvec)));
+    if (!bufvec)
+    {
+        return -ENOMEM;
+    }
+    if (const std::optional<fuse_bufvec> pinned = pinnedDataBufvec(*fileHandle, size, offset, false))
     {
-        ClipboardData* clipboardData = getClipboardData();
-        auto lock = clipboardData->getLock();
-        const std::optional<const std::vector<uint8_t>> data = clipboardData->mimeData(filePathToFullMimeType(path + CLIPBOARD_BASE_PATH.size() + 1));
-        if (data)
+        *bufvec = *pinned;
+        *bufp = bufvec;
+        return 0;
+    }
+
+    *bufvec = makeBufvec(0);
+    fuse_buf& buf = bufvec->buf[0];
+    buf.mem = std::malloc(std::max<size_t>(size, 1));
+    if (!buf.mem)
+    {
+        std::free(bufvec);
+        return -ENOMEM;
+    }
+    const int result = read(path, static_cast<char*>(buf.mem), size, offset, fi);
+    if (result < 0)
+    {
+        std::free(buf.mem);
+        std::free(bufvec);
+        return result;
+    }
+    buf.size = result;
+    *bufp = bufvec;
+    return 0;
+}
+
+int poll(const char* path, fuse_file_info* fi, fuse_pollhandle* ph, unsigned* reventsp)
+{
+    FileHandle* fileHandle = getFileHandle(fi);
+    if (!fileHandle)
+    {
+        if (ph)
         {
-            if (size + offset >= data->size())
-            {
-                size = data->size() - offset;
-            }
-            std::copy_n(data->begin() + offset, size, buf);
-            return size;
+            fuse_pollhandle_destroy(ph);
         }
+        return -EBADF;
     }
-    return -ENOENT;
+    std::function<void()> notify;
+    if (ph)
+    {
+        // Destroyed once it was notified, or the file was closed
+        std::shared_ptr<fuse_pollhandle> pollHandle(ph, fuse_pollhandle_destroy);
+        notify = [pollHandle]() { fuse_notify_poll(pollHandle.get()); };
+    }
+    *reventsp = pollFileHandle(*getPrivateData(), *fileHandle, std::move(notify));
+    return 0;
+}
+
+int write(const char* path, const char* buf, size_t size, off_t offset, fuse_file_info* fi)
+{
+    FileHandle* fileHandle = getFileHandle(fi);
+    if (!fileHandle)
+    {
+        return -EBADF;
+    }
+    return writeFileHandle(*fileHandle, buf, size, offset);
+}
+
+int truncate(const char* path, off_t size, fuse_file_info* fi)
+{
+    if (size < 0)
+    {
+        return -EINVAL;
+    }
+    if (fi && getFileHandle(fi) && getFileHandle(fi)->writeTarget)
+    {
+        return truncateFileHandle(*getFileHandle(fi), size);
+    }
+    // Not opened, so the truncated data is published right away
+    const auto target = resolveWriteTarget(path);
+    if (!target)
+    {
+        return -EACCES;
+    }
+    return truncateWriteTarget(*getPrivateData(), *target, size);
+}
+
+// Called on every close() of the file, so the clipboard is already set when close() returns
+int flush(const char* path, fuse_file_info* fi)
+{
+    FileHandle* fileHandle = getFileHandle(fi);
+    if (fileHandle && fileHandle->writeTarget)
+    {
+        publishFileHandle(*getPrivateData(), *fileHandle);
+    }
+    return 0;
+}
+
+int release(const char* path, fuse_file_info* fi)
+{
+    releaseFileHandle(*getPrivateData(), getFileHandle(fi));
+    fi->fh = 0;
+    return 0;
+}
+
+// Timestamps aren't stored, but touch needs this to succeed on files that can be written to
+int utimens(const char* path, const struct timespec tv[2], fuse_file_info* fi)
+{
+    if ((fi && getFileHandle(fi) && getFileHandle(fi)->writeTarget) || resolveWriteTarget(path))
+    {
+        return 0;
+    }
+    return -EACCES;
+}
+
+int unlinkFile(const char* path)
+{
+    const auto stagingPath = splitMimePath(path, STAGING_BASE_PATH);
+    if (!stagingPath || stagingPath->fileName.empty())
+    {
+        return -EACCES;
+    }
+    return getPrivateData()->stagingArea.unstage(stagingPath->mainMimeType, stagingPath->fileName) ? 0 : -ENOENT;
+}
+
+// Only main mime type directories in /staging can be created and removed
+int makeDir(const char* path, mode_t mode)
+{
+    const auto stagingPath = splitMimePath(path, STAGING_BASE_PATH);
+    if (!stagingPath || !stagingPath->fileName.empty() || stagingPath->mainMimeType[0] == '.')
+    {
+        return -EACCES;
+    }
+    return getPrivateData()->stagingArea.addDirectory(stagingPath->mainMimeType) ? 0 : -EEXIST;
+}
+
+int removeDir(const char* path)
+{
+    const auto stagingPath = splitMimePath(path, STAGING_BASE_PATH);
+    if (!stagingPath || !stagingPath->fileName.empty())
+    {
+        return -EACCES;
+    }
+    return getPrivateData()->stagingArea.removeDirectory(stagingPath->mainMimeType);
 }
 
 constexpr fuse_operations makeFuseOperations()
 {
     fuse_operations operations = {};
-    operations.getattr = getAttr;
-    operations.open = open;
-    operations.read = read;
-    operations.readdir = readDir;
+    // Operations that are done the most are timed for /.stats
+    // Every operation on a path is routed to the display the path is in, when several displays are served
+    operations.getattr = TimedRouted<Stats::Timer::GetAttr, decltype(operations.getattr), getAttr>::call;
+    operations.open = TimedRouted<Stats::Timer::Open, decltype(operations.open), open>::call;
+    operations.read = TimedRouted<Stats::Timer::Read, decltype(operations.read), read>::call;
+    operations.read_buf = TimedRouted<Stats::Timer::Read, decltype(operations.read_buf), readBuf>::call;
+    operations.create = Routed<decltype(operations.create), create>::call;
+    operations.write = TimedRouted<Stats::Timer::Write, decltype(operations.write), write>::call;
+    operations.truncate = Routed<decltype(operations.truncate), truncate>::call;
+    operations.flush = Routed<decltype(operations.flush), flush>::call;
+    operations.release = TimedRouted<Stats::Timer::Release, decltype(operations.release), release>::call;
+    operations.poll = Routed<decltype(operations.poll), poll>::call;
+    operations.utimens = Routed<decltype(operations.utimens), utimens>::call;
+    operations.unlink = Routed<decltype(operations.unlink), unlinkFile>::call;
+    operations.mkdir = Routed<decltype(operations.mkdir), makeDir>::call;
+    operations.rmdir = Routed<decltype(operations.rmdir), removeDir>::call;
+    operations.readdir = TimedRouted<Stats::Timer::ReadDir, decltype(operations.readdir), readDir>::call;
     operations.init = init;
+    operations.destroy = destroy;
     // Make sure other fields are being value initialized to nullptr
     assert(operations.bmap == nullptr);
     assert(operations.fallocate == nullptr);
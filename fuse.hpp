@@ -5,11 +5,18 @@
 #include <fuse.h>
 
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace FuseImplementation
 {
 struct FuseInitData {
+    // Clipboard served at the root. Null if displays is used instead
     ClipboardData* clipboardData;
+    // Name and clipboard of each display, served in a directory named after the display, like /:1/clipboard
+    // Only supported by the path based engine
+    std::vector<std::pair<std::string, ClipboardData*>> displays;
 };
 
 extern const fuse_operations operations;
@@ -0,0 +1,557 @@
+#include "fuseCommon.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring> // std::memset
+#include <new> // std::bad_alloc
+#include <poll.h>
+#include <utility> // std::move
+
+namespace FuseImplementation
+{
+size_t clipboardTreeIndex(ClipboardData::Mode mode)
+{
+    for (size_t i = 0; i < CLIPBOARD_TREES.size(); ++i)
+    {
+        if (CLIPBOARD_TREES[i].mode == mode)
+        {
+            return i;
+        }
+    }
+    assert(false);
+    return 0;
+}
+
+uint64_t makeReadFileHandle(std::shared_ptr<const MimeDataSnapshot> data)
+{
+    auto* fileHandle = new FileHandle();
+    fileHandle->data = std::move(data);
+    return reinterpret_cast<uint64_t>(fileHandle);
+}
+
+const StatsFile* findStatsFile(std::string_view path)
+{
+    for (const StatsFile& statsFile : STATS_FILES)
+    {
+        if (statsFile.path == path)
+        {
+            return &statsFile;
+        }
+    }
+    return nullptr;
+}
+
+uint64_t makeStatsFileHandle(const StatsFile& statsFile)
+{
+    return makeReadFileHandle(std::make_shared<StringMimeDataSnapshot>(statsFile.render()));
+}
+
+std::optional<std::string_view> fileNameMimeSubType(std::string_view fileName)
+{
+    // +1 for dot after base file name
+    if (fileName.size() <= BASE_FILE_NAME.size() + 1 || fileName.compare(0, BASE_FILE_NAME.size(), BASE_FILE_NAME) != 0 ||
+        fileName[BASE_FILE_NAME.size()] != '.')
+    {
+        return {};
+    }
+    std::string_view mimeSubType = fileName.substr(BASE_FILE_NAME.size() + 1);
+    if (mimeSubType.find('/') != std::string_view::npos)
+    {
+        return {};
+    }
+    return mimeSubType;
+}
+
+std::optional<WriteTarget> makeWriteTarget(WriteTarget::Kind kind, ClipboardData::Mode mode, std::string_view mainMimeType,
+                                           std::string_view fileName)
+{
+    if (mainMimeType.empty() || mainMimeType[0] == '.')
+    {
+        return {};
+    }
+    const auto mimeSubType = fileNameMimeSubType(fileName);
+    if (!mimeSubType)
+    {
+        return {};
+    }
+    WriteTarget target;
+    target.kind = kind;
+    target.mode = mode;
+    target.mainMimeType = mainMimeType;
+    target.fileName = fileName;
+    target.fullMimeType = target.mainMimeType + '/' + std::string(*mimeSubType);
+    return target;
+}
+
+void setChangeTime(struct stat& stbuf, const ClipboardSnapshot& snapshot)
+{
+    const auto sinceEpoch = snapshot.changeTime().time_since_epoch();
+    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>(sinceEpoch);
+    stbuf.st_mtim.tv_sec = seconds.count();
+    stbuf.st_mtim.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(sinceEpoch - seconds).count();
+    stbuf.st_atim = stbuf.st_mtim;
+    stbuf.st_ctim = stbuf.st_mtim;
+}
+
+std::shared_ptr<const MimeDataSnapshot> entryData(ClipboardData* clipboardData, const ClipboardSnapshot& snapshot,
+                                                  ClipboardData::Mode mode, bool isCurrent, const ClipboardSnapshot::MimeEntry& entry)
+{
+    std::shared_ptr<const MimeDataSnapshot> data = snapshot.mimeData(entry);
+    if (!data && isCurrent)
+    {
+        data = clipboardData->mimeData(entry.fullMimeType(), mode);
+    }
+    return data;
+}
+
+std::optional<size_t> knownSize(const ClipboardSnapshot& snapshot, bool isCurrent, const ClipboardSnapshot::MimeEntry& entry)
+{
+    if (isCurrent)
+    {
+        return snapshot.dataSize(entry);
+    }
+    if (const std::shared_ptr<const MimeDataSnapshot> data = snapshot.fetchedMimeData(entry))
+    {
+        return data->size();
+    }
+    return {};
+}
+
+bool isStreamed(ClipboardData* clipboardData, const ClipboardSnapshot& snapshot, bool isCurrent, const ClipboardSnapshot::MimeEntry& entry)
+{
+    // The owner doesn't offer converted formats, so they can't be streamed from it
+    // Data fetched once is fetched whole again if the memory budget dropped it, so its size stays right
+    return isCurrent && !entry.isConverted() && clipboardData->canStream() && !snapshot.dataSize(entry);
+}
+
+bool hasUnknownSize(ClipboardData* clipboardData, const ClipboardSnapshot& snapshot, bool isCurrent, const ClipboardSnapshot::MimeEntry& entry)
+{
+    return !knownSize(snapshot, isCurrent, entry) && (entry.isConverted() || isStreamed(clipboardData, snapshot, isCurrent, entry));
+}
+
+void recordChange(FileSystemData& fileSystemData, ClipboardData::Mode mode, const ClipboardSnapshot& newSnapshot)
+{
+    // +1 to skip leading slash
+    std::string event = std::to_string(newSnapshot.generation()) + ' ' +
+                        std::string(CLIPBOARD_TREES[clipboardTreeIndex(mode)].path.substr(1));
+    for (const auto& [mainMimeType, directory] : newSnapshot.mimeDirectories())
+    {
+        for (const auto& [fileName, entry] : directory)
+        {
+            event += ' ' + entry->fullMimeType();
+        }
+    }
+    event += '\n';
+    fileSystemData.events.push(std::move(event));
+}
+
+uint64_t makeEventsFileHandle(FileSystemData& fileSystemData)
+{
+    auto* fileHandle = new FileHandle();
+    fileHandle->eventReader = fileSystemData.events.makeReader();
+    return reinterpret_cast<uint64_t>(fileHandle);
+}
+
+unsigned pollFileHandle(FileSystemData& fileSystemData, FileHandle& fileHandle, std::function<void()> notify)
+{
+    // Other files never wait, like regular files
+    if (!fileHandle.eventReader)
+    {
+        return POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM;
+    }
+    return fileSystemData.events.pollReady(*fileHandle.eventReader, std::move(notify)) ? POLLIN | POLLRDNORM : 0;
+}
+
+KernelNotifier::KernelNotifier()
+    : m_thread(&KernelNotifier::run, this)
+{
+}
+
+KernelNotifier::~KernelNotifier()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stop = true;
+    }
+    m_condition.notify_one();
+    m_thread.join();
+}
+
+void KernelNotifier::post(std::function<void()> task)
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+    m_condition.notify_one();
+}
+
+void KernelNotifier::run()
+{
+    std::unique_lock lock(m_mutex);
+    while (true)
+    {
+        m_condition.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+        if (m_stop)
+        {
+            return;
+        }
+        std::function<void()> task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+void watchChanges(FileSystemData& fileSystemData, TreeInvalidator invalidateTree, StagingInvalidator invalidateStaging)
+{
+    fileSystemData.notifier = std::make_unique<KernelNotifier>();
+    KernelNotifier* notifier = fileSystemData.notifier.get();
+    fileSystemData.stagingCommitted = [notifier, invalidateStaging](const StagingArea::Directories& directories)
+    {
+        notifier->post([invalidateStaging, directories]() { invalidateStaging(directories); });
+    };
+    fileSystemData.clipboardData->setChangeCallback(
+        [&fileSystemData, notifier, invalidateTree](ClipboardData::Mode mode, const std::shared_ptr<const ClipboardSnapshot>& oldSnapshot,
+                                                    const std::shared_ptr<const ClipboardSnapshot>& newSnapshot)
+        {
+            notifier->post([invalidateTree, mode, oldSnapshot, newGeneration = newSnapshot->generation()]()
+                           { invalidateTree(mode, oldSnapshot, newGeneration); });
+            // Answering reads and waking pollers doesn't wait for the kernel like invalidating does, so it is done right away
+            recordChange(fileSystemData, mode, *newSnapshot);
+        });
+}
+
+void stopWatchingChanges(FileSystemData& fileSystemData)
+{
+    // Once this returns, the callback can't use the notifier anymore
+    fileSystemData.clipboardData->setChangeCallback(nullptr);
+    fileSystemData.events.stop();
+    fileSystemData.stagingCommitted = nullptr;
+    fileSystemData.notifier.reset();
+}
+
+std::vector<size_t> replacedHistoryIndices(const ClipboardHistory::SnapshotList& lastHistory, const ClipboardHistory::SnapshotList& history)
+{
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < lastHistory.size(); ++i)
+    {
+        if (i >= history.size() || history[i] != lastHistory[i])
+        {
+            indices.push_back(i);
+        }
+    }
+    return indices;
+}
+
+void commitStaging(FileSystemData& fileSystemData)
+{
+    StagingArea::Directories directories = fileSystemData.stagingArea.take();
+    ClipboardData::MimeDataList formats;
+    for (const auto& [mainMimeType, files] : directories)
+    {
+        for (const auto& [fileName, data] : files)
+        {
+            formats.emplace_back(mainMimeType + '/' + std::string(*fileNameMimeSubType(fileName)), data);
+        }
+    }
+    if (!formats.empty())
+    {
+        fileSystemData.clipboardData->setMimeData(formats);
+    }
+    // Staged files disappear, so the kernel must forget them
+    if (fileSystemData.stagingCommitted)
+    {
+        fileSystemData.stagingCommitted(directories);
+    }
+}
+
+void publishWrite(FileSystemData& fileSystemData, const WriteTarget& target, std::shared_ptr<const MimeDataSnapshot> data)
+{
+    switch (target.kind)
+    {
+    case WriteTarget::Kind::Clipboard:
+        fileSystemData.clipboardData->setMimeData({{target.fullMimeType, std::move(data)}}, target.mode);
+        break;
+    case WriteTarget::Kind::Staging:
+        fileSystemData.stagingArea.stage(target.mainMimeType, target.fileName, std::move(data));
+        break;
+    case WriteTarget::Kind::Commit:
+        commitStaging(fileSystemData);
+        break;
+    }
+}
+
+std::shared_ptr<const MimeDataSnapshot> writeTargetData(FileSystemData& fileSystemData, const WriteTarget& target)
+{
+    switch (target.kind)
+    {
+    case WriteTarget::Kind::Clipboard:
+        return fileSystemData.clipboardData->mimeData(target.fullMimeType, target.mode);
+    case WriteTarget::Kind::Staging:
+        return fileSystemData.stagingArea.data(target.mainMimeType, target.fileName);
+    case WriteTarget::Kind::Commit:
+        return nullptr;
+    }
+    return nullptr;
+}
+
+int openWriteFileHandle(FileSystemData& fileSystemData, WriteTarget target, bool create, bool truncate,
+                        std::unique_ptr<FileHandle>& fileHandle)
+{
+    auto newFileHandle = std::make_unique<FileHandle>();
+    if (target.kind == WriteTarget::Kind::Commit)
+    {
+        // Opening the commit file for writing is enough to commit, so touch works too
+        newFileHandle->dirty = true;
+    }
+    else if (create)
+    {
+        // New formats can only be added to main mime types the clipboard already has. Others can be staged
+        if (target.kind == WriteTarget::Kind::Clipboard &&
+            !fileSystemData.clipboardData->snapshot(target.mode)->hasMainMimeType(target.mainMimeType))
+        {
+            return -ENOENT;
+        }
+        if (target.kind == WriteTarget::Kind::Staging)
+        {
+            if (!fileSystemData.stagingArea.hasDirectory(target.mainMimeType))
+            {
+                return -ENOENT;
+            }
+            // Staged right away, so the new file can be looked up while it is written
+            fileSystemData.stagingArea.stage(target.mainMimeType, target.fileName, WriteBuffer().toSnapshot());
+        }
+        newFileHandle->dirty = true;
+    }
+    else
+    {
+        std::shared_ptr<const MimeDataSnapshot> data = writeTargetData(fileSystemData, target);
+        if (!data)
+        {
+            return -ENOENT;
+        }
+        if (truncate)
+        {
+            newFileHandle->dirty = true;
+        }
+        else if (data->size() > WriteBuffer::MAX_SIZE)
+        {
+            return -EFBIG;
+        }
+        else
+        {
+            try
+            {
+                newFileHandle->writeBuffer = WriteBuffer(data->data());
+            }
+            catch (const std::bad_alloc&)
+            {
+                return -ENOMEM;
+            }
+        }
+    }
+    newFileHandle->writeTarget = std::move(target);
+    fileHandle = std::move(newFileHandle);
+    return 0;
+}
+
+void publishFileHandle(FileSystemData& fileSystemData, FileHandle& fileHandle)
+{
+    std::lock_guard lock(fileHandle.writeMutex);
+    if (!fileHandle.dirty)
+    {
+        return;
+    }
+    fileHandle.dirty = false;
+    std::shared_ptr<const MimeDataSnapshot> data;
+    if (fileHandle.writeTarget->kind != WriteTarget::Kind::Commit)
+    {
+        data = fileHandle.writeBuffer.toSnapshot();
+    }
+    // Lock is held while publishing, so data written through one file handle is published in order
+    publishWrite(fileSystemData, *fileHandle.writeTarget, std::move(data));
+}
+
+size_t copyDataWindow(std::string_view data, char* buf, size_t size, off_t offset)
+{
+    if (offset < 0 || static_cast<size_t>(offset) >= data.size())
+    {
+        return 0;
+    }
+    size = std::min(size, data.size() - static_cast<size_t>(offset));
+    std::copy_n(data.data() + offset, size, buf);
+    return size;
+}
+
+fuse_bufvec makeBufvec(size_t size)
+{
+    fuse_bufvec bufvec;
+    std::memset(&bufvec, 0, sizeof(bufvec));
+    bufvec.count = 1;
+    bufvec.buf[0].size = size;
+    bufvec.buf[0].fd = -1;
+    return bufvec;
+}
+
+std::optional<fuse_bufvec> pinnedDataBufvec(const FileHandle& fileHandle, size_t size, off_t offset, bool memoryCanBeShared)
+{
+    const MimeDataSnapshot* data = fileHandle.data.get();
+    const bool isFile = data && data->fd() != -1;
+    // Compressed data is read with readFileHandle(), which only decompresses the blocks that are read
+    if (!isFile && !(memoryCanBeShared && data && data->hasContiguousData()))
+    {
+        return {};
+    }
+    const size_t dataSize = data->size();
+    if (offset < 0 || static_cast<size_t>(offset) >= dataSize)
+    {
+        return makeBufvec(0);
+    }
+    fuse_bufvec bufvec = makeBufvec(std::min(size, dataSize - static_cast<size_t>(offset)));
+    fuse_buf& buf = bufvec.buf[0];
+    if (isFile)
+    {
+        buf.flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        buf.fd = data->fd();
+        buf.pos = offset;
+    }
+    else
+    {
+        buf.mem = const_cast<char*>(data->data().data()) + offset;
+    }
+    return bufvec;
+}
+
+int readFileHandle(FileHandle& fileHandle, char* buf, size_t size, off_t offset)
+{
+    // Files opened for reading and writing read what was written so far
+    if (fileHandle.writeTarget)
+    {
+        std::lock_guard lock(fileHandle.writeMutex);
+        return fileHandle.writeBuffer.read(buf, size, offset);
+    }
+    if (fileHandle.stream)
+    {
+        return fileHandle.stream->read(buf, size, offset, STREAM_READ_TIMEOUT);
+    }
+    // Compressed data only decompresses the blocks that are read
+    return offset < 0 ? 0 : fileHandle.data->read(buf, size, static_cast<size_t>(offset));
+}
+
+int writeFileHandle(FileHandle& fileHandle, const char* buf, size_t size, off_t offset)
+{
+    if (!fileHandle.writeTarget)
+    {
+        return -EBADF;
+    }
+    if (offset < 0)
+    {
+        return -EINVAL;
+    }
+    std::lock_guard lock(fileHandle.writeMutex);
+    // What is written to the commit file doesn't matter, so it isn't kept
+    if (fileHandle.writeTarget->kind != WriteTarget::Kind::Commit)
+    {
+        try
+        {
+            if (!fileHandle.writeBuffer.write(buf, size, offset))
+            {
+                return -EFBIG;
+            }
+        }
+        catch (const std::bad_alloc&)
+        {
+            return -ENOMEM;
+        }
+    }
+    fileHandle.dirty = true;
+    return size;
+}
+
+int truncateFileHandle(FileHandle& fileHandle, off_t size)
+{
+    if (size < 0)
+    {
+        return -EINVAL;
+    }
+    std::lock_guard lock(fileHandle.writeMutex);
+    try
+    {
+        if (!fileHandle.writeBuffer.truncate(size))
+        {
+            return -EFBIG;
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        return -ENOMEM;
+    }
+    fileHandle.dirty = true;
+    return 0;
+}
+
+int truncateWriteTarget(FileSystemData& fileSystemData, const WriteTarget& target, off_t size)
+{
+    if (target.kind == WriteTarget::Kind::Commit)
+    {
+        return 0;
+    }
+    if (size < 0)
+    {
+        return -EINVAL;
+    }
+    std::shared_ptr<const MimeDataSnapshot> data = writeTargetData(fileSystemData, target);
+    if (!data)
+    {
+        return -ENOENT;
+    }
+    if (data->size() == static_cast<size_t>(size))
+    {
+        return 0;
+    }
+    if (static_cast<size_t>(size) > WriteBuffer::MAX_SIZE)
+    {
+        return -EFBIG;
+    }
+    std::shared_ptr<const MimeDataSnapshot> truncated;
+    try
+    {
+        // Only the part that is kept is copied
+        WriteBuffer writeBuffer(data->data().substr(0, size));
+        writeBuffer.truncate(size);
+        truncated = writeBuffer.toSnapshot();
+    }
+    catch (const std::bad_alloc&)
+    {
+        return -ENOMEM;
+    }
+    publishWrite(fileSystemData, target, std::move(truncated));
+    return 0;
+}
+
+void releaseFileHandle(FileSystemData& fileSystemData, FileHandle* fileHandle)
+{
+    if (!fileHandle)
+    {
+        return;
+    }
+    // Normally published by flush() already
+    if (fileHandle->writeTarget)
+    {
+        publishFileHandle(fileSystemData, *fileHandle);
+    }
+    // Stops receiving data nobody reads anymore
+    if (fileHandle->stream)
+    {
+        fileHandle->stream->close();
+    }
+    if (fileHandle->eventReader)
+    {
+        fileSystemData.events.forgetReader(*fileHandle->eventReader);
+    }
+    delete fileHandle;
+}
+}
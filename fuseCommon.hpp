@@ -0,0 +1,256 @@
+#pragma once
+
+#include "changeEventLog.hpp"
+#include "clipboardData.hpp"
+#include "clipboardHistory.hpp"
+#include "clipboardSnapshot.hpp"
+#include "fuse.hpp"
+#include "mimeDataStream.hpp"
+#include "stagingArea.hpp"
+#include "stats.hpp"
+#include "writeBuffer.hpp"
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <sys/types.h> // off_t
+#include <thread>
+#include <vector>
+
+// Parts of the filesystem shared by the path based engine in fuse.cpp and the inode based engine in fuseLowlevel.cpp
+namespace FuseImplementation
+{
+// Should use std::string but it's not constexpr yet (as of C++17) and this is an unnecessary optimization I want to make
+constexpr std::string_view CLIPBOARD_BASE_PATH("/clipboard");
+constexpr std::string_view SELECTION_BASE_PATH("/selection");
+// Contains a directory for each snapshot in the clipboard's history, /history/0 being the current contents
+// Each of them has the same layout as /clipboard
+constexpr std::string_view HISTORY_BASE_PATH("/history");
+// Formats written here are published to the clipboard together when the commit file is written to
+// Has the same layout as /clipboard, and main mime type directories are created with mkdir
+constexpr std::string_view STAGING_BASE_PATH("/staging");
+constexpr std::string_view STAGING_COMMIT_PATH("/staging/.commit");
+// Gives the changes of the clipboard after the file was opened, a line for each like "12 clipboard text/plain text/html"
+// A read gives at most one line, and what doesn't fit in it is given by the next read
+// Reads wait for the change, unless the file is opened with O_NONBLOCK. The file can also be polled for the next change
+constexpr std::string_view EVENTS_PATH("/.events");
+
+// Read only file in the root with the stats of the filesystem
+// The contents are made when the file is opened, so the size is unknown until then
+struct StatsFile
+{
+    std::string_view path;
+    std::string (*render)();
+};
+
+constexpr std::array<StatsFile, 2> STATS_FILES = {{
+    {"/.stats", Stats::renderText},
+    {"/.stats.json", Stats::renderJson},
+}};
+
+// Null pointer if path isn't a stats file
+const StatsFile* findStatsFile(std::string_view path);
+
+// Directory in the root that contains the mime type directories of one clipboard
+struct ClipboardTree
+{
+    std::string_view path;
+    ClipboardData::Mode mode;
+};
+
+constexpr std::array<ClipboardTree, 2> CLIPBOARD_TREES = {{
+    {CLIPBOARD_BASE_PATH, ClipboardData::Mode::Clipboard},
+    {SELECTION_BASE_PATH, ClipboardData::Mode::Selection},
+}};
+
+// How long the kernel may cache entries and attributes. Changed paths are invalidated explicitly when the clipboard changes,
+// so this is only an upper bound in case an invalidation is missed
+constexpr double KERNEL_CACHE_TIMEOUT_SECONDS = 60.0;
+
+// How long a read of a streamed file waits for the owner to send the next chunk
+constexpr std::chrono::milliseconds STREAM_READ_TIMEOUT(5000);
+
+size_t clipboardTreeIndex(ClipboardData::Mode mode);
+
+// File that can be written to, and where the written data is published
+struct WriteTarget
+{
+    enum class Kind
+    {
+        // Replaces the clipboard with the single written format
+        Clipboard,
+        // Stages the format in /staging
+        Staging,
+        // Publishes everything in /staging, whatever was written
+        Commit,
+    };
+
+    Kind kind;
+    // Only used for Kind::Clipboard
+    ClipboardData::Mode mode;
+    std::string mainMimeType;
+    std::string fileName;
+    std::string fullMimeType;
+};
+
+// Stored in fuse_file_info::fh between open() and release()
+// Pins the data of the opened file, so reads don't need to look the file up and see the same data even if the clipboard changes
+struct FileHandle
+{
+    // Only set for files opened for reading only. Either data, or stream if the data is read while the owner sends it
+    std::shared_ptr<const MimeDataSnapshot> data;
+    std::shared_ptr<MimeDataStream> stream;
+
+    // Only set for files opened for writing
+    std::optional<WriteTarget> writeTarget;
+    // Writes to one file handle can come from several threads
+    std::mutex writeMutex;
+    WriteBuffer writeBuffer;
+    // Set if writeBuffer has changes that were not published yet
+    bool dirty = false;
+
+    // Only set for /.events
+    std::optional<ChangeEventLog::Reader> eventReader;
+};
+
+// Value for fuse_file_info::fh of a file opened for reading only
+uint64_t makeReadFileHandle(std::shared_ptr<const MimeDataSnapshot> data);
+// Same with the current contents of statsFile
+uint64_t makeStatsFileHandle(const StatsFile& statsFile);
+
+// Runs notifications of the kernel on its own thread, in the order they were posted
+// Notifying the kernel can block on a lookup that is itself waiting for the thread that watches the clipboard
+class KernelNotifier
+{
+  public:
+    KernelNotifier();
+    // Waits for the running task. Tasks that didn't start are dropped
+    ~KernelNotifier();
+
+    // Can be called from any thread. Doesn't wait for task
+    void post(std::function<void()> task);
+
+  private:
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<std::function<void()>> m_tasks;
+    bool m_stop = false;
+    std::thread m_thread;
+
+    void run();
+};
+
+// State of the filesystem that doesn't depend on the engine
+struct FileSystemData
+{
+    ClipboardData* clipboardData;
+    StagingArea stagingArea;
+    ChangeEventLog events;
+    // Called with what was staged after the staging area was committed, so the engine can make the kernel forget it
+    std::function<void(const StagingArea::Directories&)> stagingCommitted;
+    // Set between watchChanges() and stopWatchingChanges()
+    std::unique_ptr<KernelNotifier> notifier;
+};
+
+// Makes the kernel forget what it cached of a clipboard tree, after its snapshot was replaced by the one of newGeneration
+using TreeInvalidator =
+    std::function<void(ClipboardData::Mode mode, const std::shared_ptr<const ClipboardSnapshot>& oldSnapshot, uint64_t newGeneration)>;
+// Makes the kernel forget staged files and directories, after they were committed
+using StagingInvalidator = std::function<void(const StagingArea::Directories& directories)>;
+
+// Records the changes of fileSystemData.clipboardData in /.events, and calls the invalidators on the thread of a new notifier
+void watchChanges(FileSystemData& fileSystemData, TreeInvalidator invalidateTree, StagingInvalidator invalidateStaging);
+// Once this returns, the invalidators aren't called anymore, and reads of /.events don't wait anymore
+void stopWatchingChanges(FileSystemData& fileSystemData);
+
+// Indices of the history directories whose snapshot in lastHistory was replaced by another one in history
+std::vector<size_t> replacedHistoryIndices(const ClipboardHistory::SnapshotList& lastHistory, const ClipboardHistory::SnapshotList& history);
+
+// Mime subtype of a file name like "file.png". Optional has no data if fileName isn't a valid file name for a format
+std::optional<std::string_view> fileNameMimeSubType(std::string_view fileName);
+
+// Target for the format file fileName in the mainMimeType directory. Not for Kind::Commit
+// Optional has no data if the names can't be written to
+std::optional<WriteTarget> makeWriteTarget(WriteTarget::Kind kind, ClipboardData::Mode mode, std::string_view mainMimeType,
+                                           std::string_view fileName);
+
+// Sets the access, modification and status change times of stbuf to when the clipboard changed to snapshot
+void setChangeTime(struct stat& stbuf, const ClipboardSnapshot& snapshot);
+
+// Data of entry, fetching it if needed
+// If the clipboard changed before the data could be fetched and isCurrent is set, uses the same format of the new clipboard
+// History snapshots can't fetch data anymore, so there is no data if it wasn't fetched while it was current
+std::shared_ptr<const MimeDataSnapshot> entryData(ClipboardData* clipboardData, const ClipboardSnapshot& snapshot,
+                                                  ClipboardData::Mode mode, bool isCurrent, const ClipboardSnapshot::MimeEntry& entry);
+
+// Size of entry if it is known without fetching or converting its data
+// Once fetched, the size of a current snapshot stays known even if the memory budget dropped the data, since it can be fetched again
+// History snapshots can't fetch data anymore, so only the size of the data they still hold is known
+std::optional<size_t> knownSize(const ClipboardSnapshot& snapshot, bool isCurrent, const ClipboardSnapshot::MimeEntry& entry);
+// True if entry is read from a stream of the clipboard owner when it is opened, instead of being fetched first
+bool isStreamed(ClipboardData* clipboardData, const ClipboardSnapshot& snapshot, bool isCurrent, const ClipboardSnapshot::MimeEntry& entry);
+// True if the size of entry isn't known without waiting for its data, so its size is reported as 0 and it is read with direct_io
+// That is the case for streamed formats, and for converted formats that weren't converted yet, since only reading them converts them
+bool hasUnknownSize(ClipboardData* clipboardData, const ClipboardSnapshot& snapshot, bool isCurrent, const ClipboardSnapshot::MimeEntry& entry);
+
+// Adds the change of the clipboard of mode to newSnapshot to the events read from /.events
+void recordChange(FileSystemData& fileSystemData, ClipboardData::Mode mode, const ClipboardSnapshot& newSnapshot);
+// Value for fuse_file_info::fh of /.events. Only changes after it is opened are read from it
+uint64_t makeEventsFileHandle(FileSystemData& fileSystemData);
+// Events for poll() of an open file. A file that isn't ready yet calls notify once it is, if notify is set
+unsigned pollFileHandle(FileSystemData& fileSystemData, FileHandle& fileHandle, std::function<void()> notify);
+
+// Publishes everything in the staging area to the clipboard as one change, and empties the staging area
+void commitStaging(FileSystemData& fileSystemData);
+
+// Publishes data written to target
+// Setting the clipboard waits for the clipboard thread, which never waits for a filesystem operation, so this can't deadlock
+void publishWrite(FileSystemData& fileSystemData, const WriteTarget& target, std::shared_ptr<const MimeDataSnapshot> data);
+
+// Current data of target, which a file opened for writing starts with unless it is truncated
+// Null pointer if target has no data yet
+std::shared_ptr<const MimeDataSnapshot> writeTargetData(FileSystemData& fileSystemData, const WriteTarget& target);
+
+// Opens or creates target for writing. Written data is buffered in the file handle, and published when the file is flushed
+// Returns 0 and sets fileHandle, or -errno
+int openWriteFileHandle(FileSystemData& fileSystemData, WriteTarget target, bool create, bool truncate,
+                        std::unique_ptr<FileHandle>& fileHandle);
+
+// Publishes the data written to fileHandle, if it changed since it was last published
+void publishFileHandle(FileSystemData& fileSystemData, FileHandle& fileHandle);
+
+// Copies the window [offset, offset + size) of data into buf, clamped to the end of data
+// Returns number of bytes copied, which is 0 if offset is at or past the end of data
+size_t copyDataWindow(std::string_view data, char* buf, size_t size, off_t offset);
+
+// Same as FUSE_BUFVEC_INIT(size), which is a C compound literal
+fuse_bufvec makeBufvec(size_t size);
+
+// Vector pointing at the window [offset, offset + size) of the data pinned in fileHandle, clamped to its end, without copying it
+// Data in a file is given as the file, which libfuse splices to the kernel. Other data is only pointed at if memoryCanBeShared
+// and it is contiguous, since libfuse frees the memory of vectors given to it by the high-level API
+// Optional has no data if the data must be copied with readFileHandle() instead
+std::optional<fuse_bufvec> pinnedDataBufvec(const FileHandle& fileHandle, size_t size, off_t offset, bool memoryCanBeShared);
+
+// Reads from a file handle opened for reading or writing. Returns number of bytes read, or -errno
+int readFileHandle(FileHandle& fileHandle, char* buf, size_t size, off_t offset);
+// Returns number of bytes written, or -errno. Files can't grow past WriteBuffer::MAX_SIZE
+int writeFileHandle(FileHandle& fileHandle, const char* buf, size_t size, off_t offset);
+// fileHandle must be opened for writing. Returns 0 or -errno
+int truncateFileHandle(FileHandle& fileHandle, off_t size);
+// Truncates target without opening it, publishing the truncated data right away. Returns 0 or -errno
+int truncateWriteTarget(FileSystemData& fileSystemData, const WriteTarget& target, off_t size);
+
+// Publishes what is left to publish, stops the stream, and deletes fileHandle
+void releaseFileHandle(FileSystemData& fileSystemData, FileHandle* fileHandle);
+}
@@ -0,0 +1,1310 @@
+#include "fuseLowlevel.hpp"
+#include "fuseCommon.hpp"
+#include "inodeTable.hpp"
+
+#include <fuse_lowlevel.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <condition_variable>
+#include <cstdlib> // std::free
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace FuseImplementation;
+
+namespace
+{
+using Inode = InodeTable::Inode;
+
+// Inodes of the nodes that always exist, in the order of makeStaticNodes()
+constexpr Inode ROOT_INODE = FUSE_ROOT_ID;
+constexpr Inode TREE_INODES_BEGIN = ROOT_INODE + 1;
+constexpr Inode HISTORY_INODE = TREE_INODES_BEGIN + CLIPBOARD_TREES.size();
+constexpr Inode STAGING_INODE = HISTORY_INODE + 1;
+constexpr Inode STAGING_COMMIT_INODE = STAGING_INODE + 1;
+constexpr Inode STATS_INODES_BEGIN = STAGING_COMMIT_INODE + 1;
+constexpr Inode EVENTS_INODE = STATS_INODES_BEGIN + STATS_FILES.size();
+
+// Inode of directory entries that were listed without being looked up, the same that libfuse's high-level API uses
+constexpr ino_t UNKNOWN_INODE = 0xffffffff;
+
+// +1 to skip slash before the name
+constexpr std::string_view STAGING_COMMIT_NAME = STAGING_COMMIT_PATH.substr(STAGING_BASE_PATH.size() + 1);
+
+// Keys of nodes are their paths, with the generation of the snapshot added to the root of the snapshot, like "/clipboard@12/text"
+// So a path in a changed clipboard is a different node, while a path in the same snapshot stays the same node
+std::vector<Node> makeStaticNodes()
+{
+    std::vector<Node> nodes;
+    Node root;
+    root.kind = Node::Kind::Root;
+    root.key = "/";
+    nodes.push_back(std::move(root));
+    for (const ClipboardTree& tree : CLIPBOARD_TREES)
+    {
+        Node treeNode;
+        treeNode.kind = Node::Kind::Tree;
+        treeNode.key = tree.path;
+        treeNode.mode = tree.mode;
+        treeNode.isCurrent = true;
+        nodes.push_back(std::move(treeNode));
+    }
+    Node history;
+    history.kind = Node::Kind::History;
+    history.key = HISTORY_BASE_PATH;
+    nodes.push_back(std::move(history));
+    Node staging;
+    staging.kind = Node::Kind::Staging;
+    staging.key = STAGING_BASE_PATH;
+    nodes.push_back(std::move(staging));
+    Node stagingCommit;
+    stagingCommit.kind = Node::Kind::StagingCommit;
+    stagingCommit.key = STAGING_COMMIT_PATH;
+    nodes.push_back(std::move(stagingCommit));
+    for (const StatsFile& statsFile : STATS_FILES)
+    {
+        Node statsNode;
+        statsNode.kind = Node::Kind::StatsFile;
+        statsNode.key = statsFile.path;
+        nodes.push_back(std::move(statsNode));
+    }
+    Node events;
+    events.kind = Node::Kind::EventsFile;
+    events.key = EVENTS_PATH;
+    nodes.push_back(std::move(events));
+    return nodes;
+}
+
+// Given to fuse_session_new() as user data
+struct LowlevelData : FileSystemData
+{
+    explicit LowlevelData(ClipboardData* clipboardData)
+    {
+        this->clipboardData = clipboardData;
+    }
+
+    fuse_session* session = nullptr;
+    InodeTable inodes{makeStaticNodes()};
+    // History as of the last invalidation. Only used by the notifier thread
+    std::shared_ptr<const ClipboardHistory::SnapshotList> lastHistory;
+    // Makes the keys of created files unique
+    std::atomic<uint64_t> newFilesCount = 0;
+    // Opens answered by a conversion worker that didn't reply yet. The session must not be destroyed before they do
+    std::mutex pendingOpensMutex;
+    std::condition_variable pendingOpensCondition;
+    size_t pendingOpensCount = 0;
+};
+
+LowlevelData& getData(fuse_req_t req)
+{
+    return *static_cast<LowlevelData*>(fuse_req_userdata(req));
+}
+
+FileHandle* getFileHandle(const fuse_file_info* fi)
+{
+    return fi ? reinterpret_cast<FileHandle*>(fi->fh) : nullptr;
+}
+
+// Listing of a directory, taken when it is opened so offsets stay valid while it is read
+struct DirectoryHandle
+{
+    // Child of the directory, with the node it gets when it is looked up
+    struct Child
+    {
+        std::string name;
+        Node node;
+    };
+
+    Inode inode;
+    std::vector<Child> children;
+};
+
+DirectoryHandle* getDirectoryHandle(const fuse_file_info* fi)
+{
+    return reinterpret_cast<DirectoryHandle*>(fi->fh);
+}
+
+void replyError(fuse_req_t req, int result)
+{
+    fuse_reply_err(req, -result);
+}
+
+bool isDirectory(Node::Kind kind)
+{
+    switch (kind)
+    {
+    case Node::Kind::Root:
+    case Node::Kind::Tree:
+    case Node::Kind::History:
+    case Node::Kind::Staging:
+    case Node::Kind::Snapshot:
+    case Node::Kind::MimeDirectory:
+    case Node::Kind::StagingDirectory:
+        return true;
+    case Node::Kind::StagingCommit:
+    case Node::Kind::MimeFile:
+    case Node::Kind::NewFile:
+    case Node::Kind::StagingFile:
+    case Node::Kind::StatsFile:
+    case Node::Kind::EventsFile:
+        return false;
+    }
+    return false;
+}
+
+Node staticNode(LowlevelData& data, Inode inode)
+{
+    return *data.inodes.get(inode);
+}
+
+// Snapshot whose mime type directories are in node, which is a Kind::Tree or Kind::Snapshot
+std::shared_ptr<const ClipboardSnapshot> rootSnapshot(LowlevelData& data, const Node& node)
+{
+    return node.kind == Node::Kind::Tree ? data.clipboardData->snapshot(node.mode) : node.snapshot;
+}
+
+Node mimeDirectoryNode(const Node& root, std::shared_ptr<const ClipboardSnapshot> snapshot, std::string_view mainMimeType)
+{
+    Node node;
+    node.kind = Node::Kind::MimeDirectory;
+    // A tree shows a different snapshot after every change, so its generation is part of the key of the tree's children
+    node.key = root.key;
+    if (root.kind == Node::Kind::Tree)
+    {
+        node.key += '@';
+        node.key += std::to_string(snapshot->generation());
+    }
+    node.key += '/';
+    node.key += mainMimeType;
+    node.snapshot = std::move(snapshot);
+    node.mode = root.mode;
+    node.isCurrent = root.isCurrent;
+    node.mainMimeType = mainMimeType;
+    return node;
+}
+
+Node mimeFileNode(const Node& directory, std::string_view fileName, const ClipboardSnapshot::MimeEntry* entry)
+{
+    Node node = directory;
+    node.kind = Node::Kind::MimeFile;
+    node.key += '/';
+    node.key += fileName;
+    node.fileName = fileName;
+    node.entry = entry;
+    return node;
+}
+
+Node snapshotNode(std::shared_ptr<const ClipboardSnapshot> snapshot)
+{
+    Node node;
+    node.kind = Node::Kind::Snapshot;
+    node.key = std::string(HISTORY_BASE_PATH) + '@' + std::to_string(snapshot->generation());
+    node.snapshot = std::move(snapshot);
+    return node;
+}
+
+Node stagingDirectoryNode(std::string_view mainMimeType)
+{
+    Node node;
+    node.kind = Node::Kind::StagingDirectory;
+    node.key = std::string(STAGING_BASE_PATH) + '/' + std::string(mainMimeType);
+    node.mainMimeType = mainMimeType;
+    return node;
+}
+
+Node stagingFileNode(std::string_view mainMimeType, std::string_view fileName)
+{
+    Node node = stagingDirectoryNode(mainMimeType);
+    node.kind = Node::Kind::StagingFile;
+    node.key += '/';
+    node.key += fileName;
+    node.fileName = fileName;
+    return node;
+}
+
+// Optional has no data if directory isn't a directory, or doesn't exist anymore
+std::optional<std::vector<DirectoryHandle::Child>> listChildren(LowlevelData& data, const Node& directory)
+{
+    std::vector<DirectoryHandle::Child> children;
+    switch (directory.kind)
+    {
+    case Node::Kind::Root:
+        for (size_t i = 0; i < CLIPBOARD_TREES.size(); ++i)
+        {
+            // +1 to skip leading slash
+            children.push_back({std::string(CLIPBOARD_TREES[i].path.substr(1)), staticNode(data, TREE_INODES_BEGIN + i)});
+        }
+        children.push_back({std::string(HISTORY_BASE_PATH.substr(1)), staticNode(data, HISTORY_INODE)});
+        children.push_back({std::string(STAGING_BASE_PATH.substr(1)), staticNode(data, STAGING_INODE)});
+        for (size_t i = 0; i < STATS_FILES.size(); ++i)
+        {
+            children.push_back({std::string(STATS_FILES[i].path.substr(1)), staticNode(data, STATS_INODES_BEGIN + i)});
+        }
+        children.push_back({std::string(EVENTS_PATH.substr(1)), staticNode(data, EVENTS_INODE)});
+        return children;
+    case Node::Kind::Tree:
+    case Node::Kind::Snapshot:
+    {
+        std::shared_ptr<const ClipboardSnapshot> snapshot = rootSnapshot(data, directory);
+        for (const auto& [mainMimeType, mimeDirectory] : snapshot->mimeDirectories())
+        {
+            children.push_back({mainMimeType, mimeDirectoryNode(directory, snapshot, mainMimeType)});
+        }
+        return children;
+    }
+    case Node::Kind::History:
+    {
+        const std::shared_ptr<const ClipboardHistory::SnapshotList> history = data.clipboardData->history();
+        for (size_t i = 0; i < history->size(); ++i)
+        {
+            children.push_back({std::to_string(i), snapshotNode((*history)[i])});
+        }
+        return children;
+    }
+    case Node::Kind::MimeDirectory:
+        for (const auto& [fileName, entry] : *directory.snapshot->mimeDirectory(directory.mainMimeType))
+        {
+            children.push_back({fileName, mimeFileNode(directory, fileName, entry)});
+        }
+        return children;
+    case Node::Kind::Staging:
+        children.push_back({std::string(STAGING_COMMIT_NAME), staticNode(data, STAGING_COMMIT_INODE)});
+        for (const std::string& mainMimeType : data.stagingArea.directoryNames())
+        {
+            children.push_back({mainMimeType, stagingDirectoryNode(mainMimeType)});
+        }
+        return children;
+    case Node::Kind::StagingDirectory:
+    {
+        const auto fileNames = data.stagingArea.fileNames(directory.mainMimeType);
+        if (!fileNames)
+        {
+            return {};
+        }
+        for (const std::string& fileName : *fileNames)
+        {
+            children.push_back({fileName, stagingFileNode(directory.mainMimeType, fileName)});
+        }
+        return children;
+    }
+    default:
+        return {};
+    }
+}
+
+// Optional has no data if directory has no child called name
+std::optional<Node> findChild(LowlevelData& data, const Node& directory, std::string_view name)
+{
+    switch (directory.kind)
+    {
+    case Node::Kind::Root:
+        for (size_t i = 0; i < CLIPBOARD_TREES.size(); ++i)
+        {
+            if (name == CLIPBOARD_TREES[i].path.substr(1))
+            {
+                return staticNode(data, TREE_INODES_BEGIN + i);
+            }
+        }
+        if (name == HISTORY_BASE_PATH.substr(1))
+        {
+            return staticNode(data, HISTORY_INODE);
+        }
+        if (name == STAGING_BASE_PATH.substr(1))
+        {
+            return staticNode(data, STAGING_INODE);
+        }
+        for (size_t i = 0; i < STATS_FILES.size(); ++i)
+        {
+            if (name == STATS_FILES[i].path.substr(1))
+            {
+                return staticNode(data, STATS_INODES_BEGIN + i);
+            }
+        }
+        if (name == EVENTS_PATH.substr(1))
+        {
+            return staticNode(data, EVENTS_INODE);
+        }
+        return {};
+    case Node::Kind::Tree:
+    case Node::Kind::Snapshot:
+    {
+        std::shared_ptr<const ClipboardSnapshot> snapshot = rootSnapshot(data, directory);
+        if (!snapshot->hasMainMimeType(name))
+        {
+            return {};
+        }
+        return mimeDirectoryNode(directory, std::move(snapshot), name);
+    }
+    case Node::Kind::History:
+    {
+        size_t index;
+        const auto [indexEnd, error] = std::from_chars(name.data(), name.data() + name.size(), index);
+        // Leading zeros would make several names for the same directory
+        if (error != std::errc() || indexEnd != name.data() + name.size() || (name.size() > 1 && name[0] == '0'))
+        {
+            return {};
+        }
+        const std::shared_ptr<const ClipboardHistory::SnapshotList> history = data.clipboardData->history();
+        if (index >= history->size())
+        {
+            return {};
+        }
+        return snapshotNode((*history)[index]);
+    }
+    case Node::Kind::MimeDirectory:
+    {
+        const ClipboardSnapshot::MimeEntry* entry = directory.snapshot->mimeFile(directory.mainMimeType, name);
+        if (!entry)
+        {
+            return {};
+        }
+        return mimeFileNode(directory, name, entry);
+    }
+    case Node::Kind::Staging:
+        if (name == STAGING_COMMIT_NAME)
+        {
+            return staticNode(data, STAGING_COMMIT_INODE);
+        }
+        if (!data.stagingArea.hasDirectory(name))
+        {
+            return {};
+        }
+        return stagingDirectoryNode(name);
+    case Node::Kind::StagingDirectory:
+        if (!data.stagingArea.data(directory.mainMimeType, name))
+        {
+            return {};
+        }
+        return stagingFileNode(directory.mainMimeType, name);
+    default:
+        return {};
+    }
+}
+
+// Optional has no data if node can't be written to
+std::optional<WriteTarget> nodeWriteTarget(const Node& node)
+{
+    switch (node.kind)
+    {
+    case Node::Kind::MimeFile:
+        // History can't be written to
+        if (!node.isCurrent)
+        {
+            return {};
+        }
+        return makeWriteTarget(WriteTarget::Kind::Clipboard, node.mode, node.mainMimeType, node.fileName);
+    case Node::Kind::NewFile:
+        return makeWriteTarget(WriteTarget::Kind::Clipboard, node.mode, node.mainMimeType, node.fileName);
+    case Node::Kind::StagingFile:
+        return makeWriteTarget(WriteTarget::Kind::Staging, ClipboardData::Mode::Clipboard, node.mainMimeType, node.fileName);
+    case Node::Kind::StagingCommit:
+        return WriteTarget{WriteTarget::Kind::Commit, ClipboardData::Mode::Clipboard, {}, {}, {}};
+    default:
+        return {};
+    }
+}
+
+// Attributes of node. Returns 0 or -errno
+// Unless fetch is set, data that wasn't fetched yet isn't fetched to get its size
+// attrTimeout is how long the kernel may keep the attributes. Nodes in a snapshot never change, but sizes that aren't known yet do
+int nodeAttributes(LowlevelData& data, const Node& node, bool fetch, struct stat& stbuf, double& attrTimeout)
+{
+    attrTimeout = KERNEL_CACHE_TIMEOUT_SECONDS;
+    stbuf.st_nlink = 1;
+    switch (node.kind)
+    {
+    case Node::Kind::Root:
+        stbuf.st_mode = S_IFDIR | 0755;
+        // 1 subdir for each clipboard tree, like /clipboard/, /history/ and /staging/
+        stbuf.st_nlink = 2 + CLIPBOARD_TREES.size() + 2;
+        return 0;
+    case Node::Kind::Tree:
+    case Node::Kind::Snapshot:
+    {
+        const std::shared_ptr<const ClipboardSnapshot> snapshot = rootSnapshot(data, node);
+        stbuf.st_mode = S_IFDIR | 0755;
+        stbuf.st_nlink = 2 + snapshot->mainMimeTypesCount();
+        setChangeTime(stbuf, *snapshot);
+        return 0;
+    }
+    case Node::Kind::History:
+    {
+        const std::shared_ptr<const ClipboardHistory::SnapshotList> history = data.clipboardData->history();
+        stbuf.st_mode = S_IFDIR | 0755;
+        stbuf.st_nlink = 2 + history->size();
+        if (!history->empty())
+        {
+            setChangeTime(stbuf, *history->front());
+        }
+        return 0;
+    }
+    case Node::Kind::MimeDirectory:
+        stbuf.st_mode = S_IFDIR | 0755;
+        stbuf.st_nlink = 2 + node.snapshot->mimeDirectory(node.mainMimeType)->size();
+        setChangeTime(stbuf, *node.snapshot);
+        return 0;
+    case Node::Kind::MimeFile:
+    {
+        const ClipboardSnapshot& snapshot = *node.snapshot;
+        // History snapshots can't be written to
+        stbuf.st_mode = S_IFREG | (node.isCurrent ? 0644 : 0444);
+        setChangeTime(stbuf, snapshot);
+        std::optional<size_t> size = knownSize(snapshot, node.isCurrent, *node.entry);
+        // Attributes are never waited for, so looking up a file doesn't fetch a streamed format or convert a converted one
+        if (!size && fetch && !hasUnknownSize(data.clipboardData, snapshot, node.isCurrent, *node.entry))
+        {
+            // Size may only be known after fetching the data
+            const std::shared_ptr<const MimeDataSnapshot> fileData =
+                entryData(data.clipboardData, snapshot, node.mode, node.isCurrent, *node.entry);
+            if (!fileData)
+            {
+                return -ENOENT;
+            }
+            stbuf.st_size = fileData->size();
+        }
+        else
+        {
+            stbuf.st_size = size.value_or(0);
+        }
+        // Data that came from a newer clipboard can be different the next time
+        if (!knownSize(snapshot, node.isCurrent, *node.entry))
+        {
+            attrTimeout = 0;
+        }
+        return 0;
+    }
+    case Node::Kind::NewFile:
+        stbuf.st_mode = S_IFREG | 0644;
+        stbuf.st_size = 0;
+        attrTimeout = 0;
+        return 0;
+    // Staged files change without the kernel being told, so their attributes are never cached
+    case Node::Kind::Staging:
+        stbuf.st_mode = S_IFDIR | 0755;
+        stbuf.st_nlink = 2 + data.stagingArea.directoriesCount();
+        attrTimeout = 0;
+        return 0;
+    // Only written to, to commit
+    case Node::Kind::StagingCommit:
+        stbuf.st_mode = S_IFREG | 0200;
+        stbuf.st_size = 0;
+        return 0;
+    // Made when opened, so the size isn't known
+    case Node::Kind::StatsFile:
+    case Node::Kind::EventsFile:
+        stbuf.st_mode = S_IFREG | 0444;
+        stbuf.st_size = 0;
+        return 0;
+    case Node::Kind::StagingDirectory:
+    {
+        const auto fileNames = data.stagingArea.fileNames(node.mainMimeType);
+        if (!fileNames)
+        {
+            return -ENOENT;
+        }
+        stbuf.st_mode = S_IFDIR | 0755;
+        stbuf.st_nlink = 2 + fileNames->size();
+        attrTimeout = 0;
+        return 0;
+    }
+    case Node::Kind::StagingFile:
+    {
+        const std::shared_ptr<const MimeDataSnapshot> fileData = data.stagingArea.data(node.mainMimeType, node.fileName);
+        if (!fileData)
+        {
+            return -ENOENT;
+        }
+        stbuf.st_mode = S_IFREG | 0644;
+        stbuf.st_size = fileData->data().size();
+        attrTimeout = 0;
+        return 0;
+    }
+    }
+    return -ENOENT;
+}
+
+// Attributes of an open file, the size of the data pinned by the file handle, or of the data written so far
+void fileHandleAttributes(const Node& node, FileHandle& fileHandle, struct stat& stbuf)
+{
+    stbuf.st_nlink = 1;
+    if (fileHandle.writeTarget)
+    {
+        std::lock_guard lock(fileHandle.writeMutex);
+        stbuf.st_mode = S_IFREG | (fileHandle.writeTarget->kind == WriteTarget::Kind::Commit ? 0200 : 0644);
+        stbuf.st_size = fileHandle.writeBuffer.size();
+        return;
+    }
+    if (fileHandle.eventReader)
+    {
+        stbuf.st_mode = S_IFREG | 0444;
+        stbuf.st_size = 0;
+        return;
+    }
+    stbuf.st_mode = S_IFREG | (nodeWriteTarget(node) ? 0644 : 0444);
+    // Size of a stream is unknown until all of it was received
+    stbuf.st_size = fileHandle.stream ? fileHandle.stream->size().value_or(0) : fileHandle.data->size();
+}
+
+// Fills entry for node, and counts a lookup of it. Returns 0 or -errno, in which case no lookup is counted
+int lookupNode(LowlevelData& data, Node node, bool fetch, fuse_entry_param& entry)
+{
+    std::memset(&entry, 0, sizeof(entry));
+    const int result = nodeAttributes(data, node, fetch, entry.attr, entry.attr_timeout);
+    if (result < 0)
+    {
+        return result;
+    }
+    // A new file has its real node once it is in the clipboard
+    entry.entry_timeout = node.kind == Node::Kind::NewFile ? 0 : KERNEL_CACHE_TIMEOUT_SECONDS;
+    entry.ino = data.inodes.acquire(std::move(node));
+    entry.attr.st_ino = entry.ino;
+    return 0;
+}
+
+// Tells the kernel that the names of tree referred to the old snapshot
+// Nodes below them are bound to the old snapshot, so they are still right and only the names need to be invalidated
+void invalidateTree(LowlevelData& data, ClipboardData::Mode mode, const std::shared_ptr<const ClipboardSnapshot>& oldSnapshot)
+{
+    const Inode treeInode = TREE_INODES_BEGIN + clipboardTreeIndex(mode);
+    if (oldSnapshot)
+    {
+        for (const auto& [mainMimeType, directory] : oldSnapshot->mimeDirectories())
+        {
+            fuse_lowlevel_notify_inval_entry(data.session, treeInode, mainMimeType.c_str(), mainMimeType.size());
+        }
+    }
+    fuse_lowlevel_notify_inval_inode(data.session, treeInode, 0, 0);
+    if (mode != ClipboardData::Mode::Clipboard)
+    {
+        return;
+    }
+    // Every history directory whose snapshot was replaced by another one now refers to a different node
+    std::shared_ptr<const ClipboardHistory::SnapshotList> history = data.clipboardData->history();
+    for (const size_t i : replacedHistoryIndices(*data.lastHistory, *history))
+    {
+        const std::string name = std::to_string(i);
+        fuse_lowlevel_notify_inval_entry(data.session, HISTORY_INODE, name.c_str(), name.size());
+    }
+    fuse_lowlevel_notify_inval_inode(data.session, HISTORY_INODE, 0, 0);
+    data.lastHistory = std::move(history);
+}
+
+// Staged files and directories disappear when they are committed
+void invalidateStaging(LowlevelData& data, const StagingArea::Directories& directories)
+{
+    for (const auto& [mainMimeType, files] : directories)
+    {
+        if (const auto directoryInode = data.inodes.find(stagingDirectoryNode(mainMimeType).key))
+        {
+            for (const auto& [fileName, fileData] : files)
+            {
+                fuse_lowlevel_notify_inval_entry(data.session, *directoryInode, fileName.c_str(), fileName.size());
+            }
+        }
+        fuse_lowlevel_notify_inval_entry(data.session, STAGING_INODE, mainMimeType.c_str(), mainMimeType.size());
+    }
+    fuse_lowlevel_notify_inval_inode(data.session, STAGING_INODE, 0, 0);
+}
+
+void init(void* userdata, fuse_conn_info* conn)
+{
+    auto* data = static_cast<LowlevelData*>(userdata);
+    // Replies are spliced to the kernel, so data in a memfd is never copied to user space
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    // O_TRUNC is passed to open instead of truncating first, so opening to overwrite doesn't copy the old data
+    conn->want |= conn->capable & FUSE_CAP_ATOMIC_O_TRUNC;
+
+    data->lastHistory = data->clipboardData->history();
+    watchChanges(*data,
+                 [data](ClipboardData::Mode mode, const std::shared_ptr<const ClipboardSnapshot>& oldSnapshot, uint64_t)
+                 { invalidateTree(*data, mode, oldSnapshot); },
+                 [data](const StagingArea::Directories& directories) { invalidateStaging(*data, directories); });
+}
+
+void destroy(void* userdata)
+{
+    auto* data = static_cast<LowlevelData*>(userdata);
+    stopWatchingChanges(*data);
+    std::unique_lock lock(data->pendingOpensMutex);
+    data->pendingOpensCondition.wait(lock, [data]() { return data->pendingOpensCount == 0; });
+}
+
+void lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    LowlevelData& data = getData(req);
+    const std::shared_ptr<const Node> directory = data.inodes.get(parent);
+    if (!directory)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    std::optional<Node> node = findChild(data, *directory, name);
+    // Negative entries aren't cached, since new mime types aren't invalidated
+    if (!node)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_entry_param entry;
+    const int result = lookupNode(data, std::move(*node), true, entry);
+    if (result < 0)
+    {
+        replyError(req, result);
+        return;
+    }
+    fuse_reply_entry(req, &entry);
+}
+
+void forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+    getData(req).inodes.forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+void forgetMulti(fuse_req_t req, size_t count, fuse_forget_data* forgets)
+{
+    InodeTable& inodes = getData(req).inodes;
+    for (size_t i = 0; i < count; ++i)
+    {
+        inodes.forget(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(req);
+}
+
+void getAttr(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+{
+    LowlevelData& data = getData(req);
+    const std::shared_ptr<const Node> node = data.inodes.get(ino);
+    if (!node)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct stat stbuf = {};
+    stbuf.st_ino = ino;
+    // Open file, whose data can be different from the node's
+    if (FileHandle* fileHandle = getFileHandle(fi))
+    {
+        fileHandleAttributes(*node, *fileHandle, stbuf);
+        fuse_reply_attr(req, &stbuf, 0);
+        return;
+    }
+    double attrTimeout;
+    const int result = nodeAttributes(data, *node, true, stbuf, attrTimeout);
+    if (result < 0)
+    {
+        replyError(req, result);
+        return;
+    }
+    fuse_reply_attr(req, &stbuf, attrTimeout);
+}
+
+// Truncates, and sets timestamps, which aren't stored, but touch needs this to succeed on files that can be written to
+void setAttr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int toSet, fuse_file_info* fi)
+{
+    LowlevelData& data = getData(req);
+    const std::shared_ptr<const Node> node = data.inodes.get(ino);
+    if (!node)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (toSet & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+    {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    FileHandle* fileHandle = getFileHandle(fi);
+    if (fileHandle && !fileHandle->writeTarget)
+    {
+        fileHandle = nullptr;
+    }
+    const std::optional<WriteTarget> target = fileHandle ? std::nullopt : nodeWriteTarget(*node);
+    if (!fileHandle && !target)
+    {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    if (toSet & FUSE_SET_ATTR_SIZE)
+    {
+        if (attr->st_size < 0)
+        {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        // Not opened, so the truncated data is published right away
+        const int result = fileHandle ? truncateFileHandle(*fileHandle, attr->st_size)
+                                      : truncateWriteTarget(data, *target, attr->st_size);
+        if (result < 0)
+        {
+            replyError(req, result);
+            return;
+        }
+    }
+
+    struct stat stbuf = {};
+    stbuf.st_ino = ino;
+    if (fileHandle)
+    {
+        fileHandleAttributes(*node, *fileHandle, stbuf);
+        fuse_reply_attr(req, &stbuf, 0);
+        return;
+    }
+    double attrTimeout;
+    if (const int result = nodeAttributes(data, *node, true, stbuf, attrTimeout); result < 0)
+    {
+        replyError(req, result);
+        return;
+    }
+    // The node may still have the data from before it was truncated
+    if (toSet & FUSE_SET_ATTR_SIZE)
+    {
+        stbuf.st_size = attr->st_size;
+    }
+    fuse_reply_attr(req, &stbuf, 0);
+}
+
+// Answers the open of a clipboard format with its data from the snapshot of node, if it could be fetched
+// Data is only missing if the source of a converted format couldn't be fetched, which a conversion worker never finds out,
+// so fetching from a newer clipboard never holds up a conversion worker
+void replyOpenMimeFile(fuse_req_t req, LowlevelData& data, const Node& node, fuse_file_info& fi, std::shared_ptr<const MimeDataSnapshot> fileData)
+{
+    // The inode is bound to its snapshot, so the pages the kernel has cached for it are always from this data
+    // If the data has to come from a newer clipboard instead, it can be different on every open
+    if (fileData)
+    {
+        fi.keep_cache = 1;
+    }
+    else
+    {
+        fileData = entryData(data.clipboardData, *node.snapshot, node.mode, node.isCurrent, *node.entry);
+    }
+    if (!fileData)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fi.fh = makeReadFileHandle(std::move(fileData));
+    fuse_reply_open(req, &fi);
+}
+
+void open(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+{
+    LowlevelData& data = getData(req);
+    const std::shared_ptr<const Node> node = data.inodes.get(ino);
+    if (!node)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+        auto target = nodeWriteTarget(*node);
+        if (!target)
+        {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+        std::unique_ptr<FileHandle> fileHandle;
+        const int result = openWriteFileHandle(data, std::move(*target), false, fi->flags & O_TRUNC, fileHandle);
+        if (result < 0)
+        {
+            replyError(req, result);
+            return;
+        }
+        fi->fh = reinterpret_cast<uint64_t>(fileHandle.release());
+        fuse_reply_open(req, fi);
+        return;
+    }
+
+    switch (node->kind)
+    {
+    case Node::Kind::StagingFile:
+    {
+        std::shared_ptr<const MimeDataSnapshot> fileData = data.stagingArea.data(node->mainMimeType, node->fileName);
+        if (!fileData)
+        {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        fi->fh = makeReadFileHandle(std::move(fileData));
+        fuse_reply_open(req, fi);
+        return;
+    }
+    case Node::Kind::MimeFile:
+        break;
+    case Node::Kind::StagingCommit:
+        fuse_reply_err(req, EACCES);
+        return;
+    // Reported as empty, so the kernel must not limit reads to the size
+    case Node::Kind::StatsFile:
+        fi->fh = makeStatsFileHandle(*findStatsFile(node->key));
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+        return;
+    case Node::Kind::EventsFile:
+        fi->fh = makeEventsFileHandle(data);
+        fi->direct_io = 1;
+        fi->nonseekable = 1;
+        fuse_reply_open(req, fi);
+        return;
+    case Node::Kind::NewFile:
+        fuse_reply_err(req, ENOENT);
+        return;
+    default:
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    const ClipboardSnapshot& snapshot = *node->snapshot;
+    // Data that isn't fetched yet is read as the owner sends it, so the first bytes don't wait for the last ones
+    // The size is unknown, so the kernel must not cache or limit reads to the size
+    if (isStreamed(data.clipboardData, snapshot, node->isCurrent, *node->entry))
+    {
+        if (std::shared_ptr<MimeDataStream> stream = data.clipboardData->openStream(snapshot, node->entry->fullMimeType(), node->mode))
+        {
+            auto* fileHandle = new FileHandle();
+            fileHandle->stream = std::move(stream);
+            fi->fh = reinterpret_cast<uint64_t>(fileHandle);
+            fi->direct_io = 1;
+            fi->nonseekable = 1;
+            fuse_reply_open(req, fi);
+            return;
+        }
+    }
+    // The kernel was told the size is 0, so it must not limit reads to it
+    if (hasUnknownSize(data.clipboardData, snapshot, node->isCurrent, *node->entry))
+    {
+        fi->direct_io = 1;
+    }
+    // A format that isn't converted yet is answered by the worker that converts it, so this thread doesn't wait for the conversion
+    // fi only lives until this returns, so the reply is made from a copy
+    {
+        std::lock_guard lock(data.pendingOpensMutex);
+        ++data.pendingOpensCount;
+    }
+    snapshot.mimeDataLater(*node->entry,
+                           [req, &data, node, fileInfo = *fi](std::shared_ptr<const MimeDataSnapshot> fileData) mutable
+                           {
+                               replyOpenMimeFile(req, data, *node, fileInfo, std::move(fileData));
+                               std::lock_guard lock(data.pendingOpensMutex);
+                               --data.pendingOpensCount;
+                               data.pendingOpensCondition.notify_all();
+                           });
+}
+
+void create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, fuse_file_info* fi)
+{
+    LowlevelData& data = getData(req);
+    const std::shared_ptr<const Node> directory = data.inodes.get(parent);
+    if (!directory)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    std::optional<WriteTarget> target;
+    Node node;
+    if (directory->kind == Node::Kind::MimeDirectory && directory->isCurrent)
+    {
+        target = makeWriteTarget(WriteTarget::Kind::Clipboard, directory->mode, directory->mainMimeType, name);
+        node = *directory;
+        node.kind = Node::Kind::NewFile;
+        node.key = "/new@" + std::to_string(data.newFilesCount++);
+        node.snapshot = nullptr;
+        node.fileName = name;
+    }
+    else if (directory->kind == Node::Kind::StagingDirectory)
+    {
+        target = makeWriteTarget(WriteTarget::Kind::Staging, ClipboardData::Mode::Clipboard, directory->mainMimeType, name);
+        node = stagingFileNode(directory->mainMimeType, name);
+    }
+    else if (directory->kind == Node::Kind::Staging && name == STAGING_COMMIT_NAME)
+    {
+        target = nodeWriteTarget(staticNode(data, STAGING_COMMIT_INODE));
+        node = staticNode(data, STAGING_COMMIT_INODE);
+    }
+    if (!target)
+    {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    std::unique_ptr<FileHandle> fileHandle;
+    if (const int result = openWriteFileHandle(data, std::move(*target), true, false, fileHandle); result < 0)
+    {
+        replyError(req, result);
+        return;
+    }
+    fuse_entry_param entry = {};
+    fileHandleAttributes(node, *fileHandle, entry.attr);
+    entry.entry_timeout = node.kind == Node::Kind::NewFile ? 0 : KERNEL_CACHE_TIMEOUT_SECONDS;
+    entry.ino = data.inodes.acquire(std::move(node));
+    entry.attr.st_ino = entry.ino;
+    fi->fh = reinterpret_cast<uint64_t>(fileHandle.release());
+    fuse_reply_create(req, &entry, fi);
+}
+
+void cancelEventRead(fuse_req_t req, void*)
+{
+    getData(req).events.cancel(req);
+}
+
+// Reads the next change from /.events
+// If there is none yet, the request is answered by the thread that records the next change, so no thread waits for it
+void readEvent(fuse_req_t req, FileHandle& fileHandle, size_t size, bool nonBlocking)
+{
+    ChangeEventLog& events = getData(req).events;
+    if (nonBlocking)
+    {
+        const std::optional<std::string> data = events.read(*fileHandle.eventReader, size);
+        if (data)
+        {
+            fuse_reply_buf(req, data->data(), data->size());
+        }
+        else if (events.isStopped())
+        {
+            fuse_reply_buf(req, nullptr, 0);
+        }
+        else
+        {
+            fuse_reply_err(req, EAGAIN);
+        }
+        return;
+    }
+    // Registered before waiting, since the request can't be used anymore once it is answered
+    fuse_req_interrupt_func(req, cancelEventRead, nullptr);
+    events.readLater(*fileHandle.eventReader, size, req, [req]() { return fuse_req_interrupted(req) != 0; },
+                     [req, &events](std::optional<std::string> data)
+                     {
+                         if (data)
+                         {
+                             fuse_reply_buf(req, data->data(), data->size());
+                         }
+                         // Like the end of a pipe once the filesystem is unmounted
+                         else if (events.isStopped())
+                         {
+                             fuse_reply_buf(req, nullptr, 0);
+                         }
+                         else
+                         {
+                             fuse_reply_err(req, EINTR);
+                         }
+                     });
+}
+
+// Data pinned in open() is given to the kernel as it is, the reply is sent before this returns
+void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info* fi)
+{
+    FileHandle* fileHandle = getFileHandle(fi);
+    if (!fileHandle)
+    {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    if (fileHandle->eventReader)
+    {
+        readEvent(req, *fileHandle, size, fi->flags & O_NONBLOCK);
+        return;
+    }
+    // Data in a file is spliced to the kernel without copying. Compressed data is copied, since only the blocks read are decompressed
+    if (std::optional<fuse_bufvec> bufvec = pinnedDataBufvec(*fileHandle, size, offset, true))
+    {
+        fuse_reply_data(req, &*bufvec, FUSE_BUF_SPLICE_MOVE);
+        return;
+    }
+    std::vector<char> buffer(size);
+    const int result = readFileHandle(*fileHandle, buffer.data(), size, offset);
+    if (result < 0)
+    {
+        replyError(req, result);
+        return;
+    }
+    fuse_reply_buf(req, buffer.data(), result);
+}
+
+void write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t offset, fuse_file_info* fi)
+{
+    FileHandle* fileHandle = getFileHandle(fi);
+    if (!fileHandle)
+    {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    const int result = writeFileHandle(*fileHandle, buf, size, offset);
+    if (result < 0)
+    {
+        replyError(req, result);
+        return;
+    }
+    fuse_reply_write(req, result);
+}
+
+// Called on every close() of the file, so the clipboard is already set when close() returns
+void flush(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+{
+    FileHandle* fileHandle = getFileHandle(fi);
+    if (fileHandle && fileHandle->writeTarget)
+    {
+        publishFileHandle(getData(req), *fileHandle);
+    }
+    fuse_reply_err(req, 0);
+}
+
+void poll(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi, fuse_pollhandle* ph)
+{
+    FileHandle* fileHandle = getFileHandle(fi);
+    if (!fileHandle)
+    {
+        if (ph)
+        {
+            fuse_pollhandle_destroy(ph);
+        }
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    std::function<void()> notify;
+    if (ph)
+    {
+        // Destroyed once it was notified, or the file was closed
+        std::shared_ptr<fuse_pollhandle> pollHandle(ph, fuse_pollhandle_destroy);
+        notify = [pollHandle]() { fuse_lowlevel_notify_poll(pollHandle.get()); };
+    }
+    fuse_reply_poll(req, pollFileHandle(getData(req), *fileHandle, std::move(notify)));
+}
+
+void release(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+{
+    releaseFileHandle(getData(req), getFileHandle(fi));
+    fi->fh = 0;
+    fuse_reply_err(req, 0);
+}
+
+void unlinkFile(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    LowlevelData& data = getData(req);
+    const std::shared_ptr<const Node> directory = data.inodes.get(parent);
+    if (!directory || directory->kind != Node::Kind::StagingDirectory)
+    {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    fuse_reply_err(req, data.stagingArea.unstage(directory->mainMimeType, name) ? 0 : ENOENT);
+}
+
+// Only main mime type directories in /staging can be created and removed
+void makeDir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode)
+{
+    LowlevelData& data = getData(req);
+    if (parent != STAGING_INODE || name[0] == '.')
+    {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    if (!data.stagingArea.addDirectory(name))
+    {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
+    fuse_entry_param entry;
+    if (const int result = lookupNode(data, stagingDirectoryNode(name), true, entry); result < 0)
+    {
+        replyError(req, result);
+        return;
+    }
+    fuse_reply_entry(req, &entry);
+}
+
+void removeDir(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+    if (parent != STAGING_INODE)
+    {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    replyError(req, getData(req).stagingArea.removeDirectory(name));
+}
+
+void openDir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+{
+    LowlevelData& data = getData(req);
+    const std::shared_ptr<const Node> node = data.inodes.get(ino);
+    if (!node)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (!isDirectory(node->kind))
+    {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+    auto children = listChildren(data, *node);
+    if (!children)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fi->fh = reinterpret_cast<uint64_t>(new DirectoryHandle{ino, std::move(*children)});
+    // Directories bound to a snapshot never change, so the kernel can keep their listing
+    if (node->kind == Node::Kind::Snapshot || node->kind == Node::Kind::MimeDirectory)
+    {
+        fi->cache_readdir = 1;
+        fi->keep_cache = 1;
+    }
+    fuse_reply_open(req, fi);
+}
+
+// Offsets 0 and 1 are "." and "..", children start at 2. The offset stored with each entry is that of the next one
+// With plus, each child is looked up, so the kernel gets its attributes without a lookup per child
+void readDirectory(fuse_req_t req, size_t size, off_t offset, fuse_file_info* fi, bool plus)
+{
+    LowlevelData& data = getData(req);
+    const DirectoryHandle& directoryHandle = *getDirectoryHandle(fi);
+    std::vector<char> buffer(size);
+    size_t bufferSize = 0;
+    for (size_t index = std::max<off_t>(offset, 0); index < 2 + directoryHandle.children.size(); ++index)
+    {
+        const DirectoryHandle::Child* child = index >= 2 ? &directoryHandle.children[index - 2] : nullptr;
+        const char* name = child ? child->name.c_str() : (index == 0 ? "." : "..");
+        // Size doesn't depend on the attributes, so the child is only looked up if it fits
+        const size_t entrySize =
+            plus ? fuse_add_direntry_plus(req, nullptr, 0, name, nullptr, 0) : fuse_add_direntry(req, nullptr, 0, name, nullptr, 0);
+        if (entrySize > size - bufferSize)
+        {
+            break;
+        }
+        // Inode 0 tells the kernel not to keep an entry for it, which isn't counted as a lookup
+        fuse_entry_param entry = {};
+        if (!child)
+        {
+            entry.attr.st_ino = index == 0 ? directoryHandle.inode : UNKNOWN_INODE;
+            entry.attr.st_mode = S_IFDIR;
+        }
+        // Data isn't fetched to get its size, so listing a lazy clipboard doesn't fetch every format
+        else if (!plus || lookupNode(data, child->node, false, entry) < 0)
+        {
+            entry = {};
+            entry.attr.st_ino = data.inodes.find(child->node.key).value_or(UNKNOWN_INODE);
+            entry.attr.st_mode = isDirectory(child->node.kind) ? S_IFDIR : S_IFREG;
+        }
+        bufferSize += plus ? fuse_add_direntry_plus(req, buffer.data() + bufferSize, size - bufferSize, name, &entry, index + 1)
+                           : fuse_add_direntry(req, buffer.data() + bufferSize, size - bufferSize, name, &entry.attr, index + 1);
+    }
+    fuse_reply_buf(req, buffer.data(), bufferSize);
+}
+
+void readDir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info* fi)
+{
+    readDirectory(req, size, offset, fi, false);
+}
+
+void readDirPlus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info* fi)
+{
+    readDirectory(req, size, offset, fi, true);
+}
+
+void releaseDir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi)
+{
+    delete getDirectoryHandle(fi);
+    fi->fh = 0;
+    fuse_reply_err(req, 0);
+}
+
+constexpr fuse_lowlevel_ops makeLowlevelOperations()
+{
+    fuse_lowlevel_ops operations = {};
+    operations.init = init;
+    operations.destroy = destroy;
+    // Operations that are done the most are timed for /.stats
+    operations.lookup = Stats::Timed<Stats::Timer::Lookup, decltype(operations.lookup), lookup>::call;
+    operations.forget = forget;
+    operations.forget_multi = forgetMulti;
+    operations.getattr = Stats::Timed<Stats::Timer::GetAttr, decltype(operations.getattr), getAttr>::call;
+    operations.setattr = setAttr;
+    operations.open = Stats::Timed<Stats::Timer::Open, decltype(operations.open), open>::call;
+    operations.create = create;
+    operations.read = Stats::Timed<Stats::Timer::Read, decltype(operations.read), read>::call;
+    operations.write = Stats::Timed<Stats::Timer::Write, decltype(operations.write), write>::call;
+    operations.flush = flush;
+    operations.release = Stats::Timed<Stats::Timer::Release, decltype(operations.release), release>::call;
+    operations.poll = poll;
+    operations.unlink = unlinkFile;
+    operations.mkdir = makeDir;
+    operations.rmdir = removeDir;
+    operations.opendir = openDir;
+    operations.readdir = Stats::Timed<Stats::Timer::ReadDir, decltype(operations.readdir), readDir>::call;
+    operations.readdirplus = Stats::Timed<Stats::Timer::ReadDir, decltype(operations.readdirplus), readDirPlus>::call;
+    operations.releasedir = releaseDir;
+    return operations;
+}
+
+const fuse_lowlevel_ops lowlevelOperations = makeLowlevelOperations();
+} // namespace
+
+int FuseImplementation::lowlevelMain(fuse_args* args, FuseInitData* initData)
+{
+    fuse_cmdline_opts options;
+    if (fuse_parse_cmdline(args, &options) != 0)
+    {
+        return 1;
+    }
+    if (options.show_help)
+    {
+        std::cout << "usage: " << args->argv[0] << " [options] <mountpoint>\n\n";
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        return 0;
+    }
+    if (options.show_version)
+    {
+        fuse_lowlevel_version();
+        return 0;
+    }
+    if (!options.mountpoint)
+    {
+        std::cerr << "usage: " << args->argv[0] << " [options] <mountpoint>" << std::endl;
+        return 1;
+    }
+
+    int ret = 1;
+    LowlevelData data(initData->clipboardData);
+    fuse_session* session = fuse_session_new(args, &lowlevelOperations, sizeof(lowlevelOperations), &data);
+    if (session)
+    {
+        data.session = session;
+        if (fuse_set_signal_handlers(session) == 0)
+        {
+            if (fuse_session_mount(session, options.mountpoint) == 0)
+            {
+                if (options.singlethread)
+                {
+                    ret = fuse_session_loop(session);
+                }
+                else
+                {
+                    fuse_loop_config config = {};
+                    config.clone_fd = options.clone_fd;
+                    config.max_idle_threads = options.max_idle_threads;
+                    ret = fuse_session_loop_mt(session, &config);
+                }
+                fuse_session_unmount(session);
+            }
+            fuse_remove_signal_handlers(session);
+        }
+        // Calls destroy()
+        fuse_session_destroy(session);
+    }
+    std::free(options.mountpoint);
+    return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "fuse.hpp"
+
+namespace FuseImplementation
+{
+// Runs the filesystem with the low-level, inode based fuse API until it is unmounted
+// Operations find their file by inode number instead of parsing a path, and the kernel gets attributes with readdirplus
+// args are the same as for fuse_main(). Returns the exit status for main()
+int lowlevelMain(fuse_args* args, FuseInitData* initData);
+}
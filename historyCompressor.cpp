@@ -0,0 +1,70 @@
+#include "historyCompressor.hpp"
+
+#include "compressedMimeDataSnapshot.hpp"
+#include "stats.hpp"
+
+#include <unordered_map>
+
+HistoryCompressor::HistoryCompressor(const ClipboardDataOptions& options) : m_threshold(options.compressThreshold)
+{
+    if (m_threshold != 0)
+    {
+        // One thread, since nothing waits for it
+        m_workerPool = std::make_unique<WorkerPool>(1);
+    }
+}
+
+bool HistoryCompressor::isEnabled() const
+{
+    return m_workerPool != nullptr;
+}
+
+void HistoryCompressor::compressLater(const std::shared_ptr<const ClipboardSnapshot>& snapshot)
+{
+    if (!isEnabled() || !snapshot)
+    {
+        return;
+    }
+    // Weak, so snapshots that leave history before their turn aren't kept alive just to be compressed
+    m_workerPool->submit([this, weakSnapshot = std::weak_ptr<const ClipboardSnapshot>(snapshot)]()
+        {
+            if (std::shared_ptr<const ClipboardSnapshot> snapshot = weakSnapshot.lock())
+            {
+                compress(*snapshot);
+            }
+        });
+}
+
+void HistoryCompressor::compress(const ClipboardSnapshot& snapshot) const
+{
+    // Formats with the same bytes share one payload, which is compressed once
+    std::unordered_map<std::shared_ptr<const MimeDataSnapshot>, size_t> payloads;
+    for (const auto& [mainMimeType, directory] : snapshot.mimeDirectories())
+    {
+        for (const auto& [fileName, entry] : directory)
+        {
+            std::shared_ptr<const MimeDataSnapshot> data = snapshot.fetchedMimeData(*entry);
+            if (data && data->hasContiguousData() && data->size() >= m_threshold)
+            {
+                ++payloads[std::move(data)];
+            }
+        }
+    }
+    for (const auto& [data, formatsCount] : payloads)
+    {
+        // A payload also used elsewhere, like by the current clipboard or an open file, stays in memory anyway
+        // Compressing it would only add a copy. use_count() is only a hint, but a wrong guess just costs memory
+        if (static_cast<size_t>(data.use_count()) > formatsCount + 1)
+        {
+            continue;
+        }
+        const Stats::ScopedTimer timer(Stats::Timer::Compress);
+        if (std::shared_ptr<const MimeDataSnapshot> compressedData = CompressedMimeDataSnapshot::create(data->data()))
+        {
+            Stats::add(Stats::Counter::CompressedBytes, data->size());
+            // Hashing it later would have to decompress it
+            compressedData->setContentHash(data->contentHash());
+            snapshot.replaceData(data, compressedData);
+        }
+    }
+}
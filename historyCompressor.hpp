@@ -0,0 +1,31 @@
+#pragma once
+
+#include "clipboardData.hpp"
+#include "clipboardSnapshot.hpp"
+#include "workerPool.hpp"
+
+#include <cstddef>
+#include <memory>
+
+// Compresses the large payloads of snapshots that were replaced, so history takes less memory
+// The current snapshots are read the most, so their payloads stay uncompressed. Compressing is done on a worker thread,
+// and reading compressed data only decompresses the blocks that are read
+class HistoryCompressor
+{
+public:
+    // Compresses nothing unless options.compressThreshold isn't 0
+    explicit HistoryCompressor(const ClipboardDataOptions& options);
+
+    bool isEnabled() const;
+
+    // Compresses the payloads of at least options.compressThreshold bytes of snapshot, in the background
+    // Must be called once snapshot was replaced. Nothing is compressed if snapshot is dropped before the worker gets to it
+    void compressLater(const std::shared_ptr<const ClipboardSnapshot>& snapshot);
+
+private:
+    const size_t m_threshold;
+    // Only created if compressing is enabled
+    std::unique_ptr<WorkerPool> m_workerPool;
+
+    void compress(const ClipboardSnapshot& snapshot) const;
+};
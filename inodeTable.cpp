@@ -0,0 +1,77 @@
+#include "inodeTable.hpp"
+
+#include <utility> // std::move
+
+InodeTable::InodeTable(std::vector<Node> staticNodes)
+    : m_firstDynamicInode(staticNodes.size() + 1), m_nextInode(m_firstDynamicInode)
+{
+    Inode inode = 1;
+    for (Node& node : staticNodes)
+    {
+        auto sharedNode = std::make_shared<const Node>(std::move(node));
+        m_inodesByKey.emplace(sharedNode->key, inode);
+        m_items.emplace(inode, Item{std::move(sharedNode), 0});
+        ++inode;
+    }
+}
+
+InodeTable::Inode InodeTable::acquire(Node node)
+{
+    std::lock_guard lock(m_mutex);
+    if (auto it = m_inodesByKey.find(node.key); it != m_inodesByKey.end())
+    {
+        ++m_items[it->second].lookupCount;
+        return it->second;
+    }
+    const Inode inode = m_nextInode++;
+    auto sharedNode = std::make_shared<const Node>(std::move(node));
+    m_inodesByKey.emplace(sharedNode->key, inode);
+    m_items.emplace(inode, Item{std::move(sharedNode), 1});
+    return inode;
+}
+
+std::shared_ptr<const Node> InodeTable::get(Inode inode) const
+{
+    std::lock_guard lock(m_mutex);
+    auto it = m_items.find(inode);
+    if (it == m_items.end())
+    {
+        return nullptr;
+    }
+    return it->second.node;
+}
+
+std::optional<InodeTable::Inode> InodeTable::find(std::string_view key) const
+{
+    std::lock_guard lock(m_mutex);
+    auto it = m_inodesByKey.find(key);
+    if (it == m_inodesByKey.end())
+    {
+        return {};
+    }
+    return it->second;
+}
+
+void InodeTable::forget(Inode inode, uint64_t count)
+{
+    std::lock_guard lock(m_mutex);
+    auto it = m_items.find(inode);
+    if (it == m_items.end() || inode < m_firstDynamicInode)
+    {
+        return;
+    }
+    Item& item = it->second;
+    if (item.lookupCount > count)
+    {
+        item.lookupCount -= count;
+        return;
+    }
+    m_inodesByKey.erase(item.node->key);
+    m_items.erase(it);
+}
+
+size_t InodeTable::size() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_items.size();
+}
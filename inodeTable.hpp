@@ -0,0 +1,93 @@
+#pragma once
+
+#include "clipboardData.hpp"
+#include "clipboardSnapshot.hpp"
+#include "stats.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// File or directory of the inode based filesystem engine
+// Nodes in a snapshot are bound to its generation, so an inode never refers to other data once the clipboard changes
+// Immutable once it is in the inode table
+struct Node
+{
+    enum class Kind
+    {
+        // Always exist
+        Root,
+        // Like /clipboard, always showing the current snapshot of its mode
+        Tree,
+        History,
+        Staging,
+        StagingCommit,
+        // Like /history/2
+        Snapshot,
+        MimeDirectory,
+        MimeFile,
+        // File created in a mime type directory, which isn't in the clipboard until it is flushed
+        NewFile,
+        StagingDirectory,
+        StagingFile,
+        // Like /.stats
+        StatsFile,
+        EventsFile,
+    };
+
+    Kind kind;
+    // Unique among all nodes. Looking up a node with the same key gives the same inode
+    std::string key;
+    // Only set for Kind::Snapshot, Kind::MimeDirectory and Kind::MimeFile
+    std::shared_ptr<const ClipboardSnapshot> snapshot;
+    ClipboardData::Mode mode = ClipboardData::Mode::Clipboard;
+    // False for nodes in history, which can't be written to and can't fall back to the current clipboard
+    bool isCurrent = false;
+    std::string mainMimeType;
+    std::string fileName;
+    // Only set for Kind::MimeFile. Points into snapshot
+    const ClipboardSnapshot::MimeEntry* entry = nullptr;
+};
+
+// Inode numbers of nodes the kernel knows about, counted like the kernel counts lookups
+// A node stays in the table until the kernel forgot every lookup of it, so it keeps its snapshot alive until then
+// Can be used from any thread
+class InodeTable
+{
+public:
+    using Inode = uint64_t;
+
+    // staticNodes get inodes 1, 2, ... in order, and are never removed. Inode 1 is the root
+    explicit InodeTable(std::vector<Node> staticNodes);
+
+    // Inode of the node with the key of node, adding node if there is none. Counts one lookup
+    Inode acquire(Node node);
+    // Null pointer if there is no such inode, for example because it was forgotten
+    std::shared_ptr<const Node> get(Inode inode) const;
+    // Optional has no data if no node has key. Doesn't count a lookup
+    std::optional<Inode> find(std::string_view key) const;
+    // Takes back count lookups. The node is removed once all of its lookups were taken back
+    void forget(Inode inode, uint64_t count);
+
+    size_t size() const;
+
+private:
+    struct Item
+    {
+        std::shared_ptr<const Node> node;
+        uint64_t lookupCount;
+    };
+
+    const Inode m_firstDynamicInode;
+    mutable Stats::TimedMutex m_mutex;
+    std::unordered_map<Inode, Item> m_items;
+    // Keys point into the nodes of m_items
+    std::unordered_map<std::string_view, Inode> m_inodesByKey;
+    Inode m_nextInode;
+};
@@ -1,19 +1,157 @@
 #include "fuse.hpp"
+#include "fuseLowlevel.hpp"
 #include "clipboardData.hpp"
+#include "clipboardServices.hpp"
+#include "mockClipboardData.hpp"
 #include "qtClipboardData.hpp"
+#include "xcbClipboardData.hpp"
 
 #include <thread>
 #include <future>
+#include <functional>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <mutex> // std::lock_guard
 #include <chrono> // std::chrono::milliseconds
 #include <memory>
 #include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <exception> // std::current_exception
+#include <utility> // std::move
 
-std::unique_ptr<ClipboardData> createClipboardData(int& argc, char* argv[])
+#include <cstddef> // offsetof
+#include <cstdlib> // std::free
+
+// Options for fuse-clipboard itself. Parsed and removed from the arguments before they are given to Qt and fuse
+struct Options
+{
+    // See ClipboardDataOptions for descriptions
+    // fuse_opt can only parse into int and unsigned long, so these are not ClipboardDataOptions directly
+    int lazy = 0;
+    unsigned long historyCount = ClipboardDataOptions().historyCount;
+    unsigned long historyBytes = ClipboardDataOptions().historyBytes;
+    int stream = 0;
+    unsigned long spillThreshold = ClipboardDataOptions().spillThreshold;
+    int convert = 0;
+    int webpQuality = ClipboardDataOptions().webpQuality;
+    // Comma separated. Allocated by fuse_opt
+    char* prefetch = nullptr;
+    unsigned long prefetchBytes = ClipboardDataOptions().prefetchBytes;
+    unsigned long maxCachedBytes = ClipboardDataOptions().maxCachedBytes;
+    unsigned long maxFormatBytes = ClipboardDataOptions().maxFormatBytes;
+    unsigned long compressThreshold = ClipboardDataOptions().compressThreshold;
+    // Use XcbClipboardData instead of QtClipboardData
+    int xcb = 0;
+    // Comma separated X displays, like ":0,:1", each served in a directory named after it. Allocated by fuse_opt
+    // Needs xcb or mock, since Qt connects to one display per process
+    char* displays = nullptr;
+    // Use MockClipboardData instead of the real clipboard. See MockClipboardDataOptions for descriptions
+    int mock = 0;
+    unsigned long mockFormats = MockClipboardDataOptions().formatsCount;
+    unsigned long mockSize = MockClipboardDataOptions().dataSize;
+    // In milliseconds
+    unsigned long mockInterval = MockClipboardDataOptions().changeInterval.count();
+    // Serve the filesystem with the inode based low-level fuse API instead of the path based one
+    int lowlevel = 0;
+};
+
+const fuse_opt optionSpecification[] = {
+    {"--lazy", offsetof(Options, lazy), 1},
+    {"lazy", offsetof(Options, lazy), 1},
+    {"--history-count=%lu", offsetof(Options, historyCount), 0},
+    {"history_count=%lu", offsetof(Options, historyCount), 0},
+    {"--history-bytes=%lu", offsetof(Options, historyBytes), 0},
+    {"history_bytes=%lu", offsetof(Options, historyBytes), 0},
+    {"--spill-threshold=%lu", offsetof(Options, spillThreshold), 0},
+    {"spill_threshold=%lu", offsetof(Options, spillThreshold), 0},
+    {"--stream", offsetof(Options, stream), 1},
+    {"stream", offsetof(Options, stream), 1},
+    {"--convert", offsetof(Options, convert), 1},
+    {"convert", offsetof(Options, convert), 1},
+    {"--webp-quality=%d", offsetof(Options, webpQuality), 0},
+    {"webp_quality=%d", offsetof(Options, webpQuality), 0},
+    {"--prefetch=%s", offsetof(Options, prefetch), 0},
+    {"prefetch=%s", offsetof(Options, prefetch), 0},
+    {"--prefetch-bytes=%lu", offsetof(Options, prefetchBytes), 0},
+    {"prefetch_bytes=%lu", offsetof(Options, prefetchBytes), 0},
+    {"--max-cached-bytes=%lu", offsetof(Options, maxCachedBytes), 0},
+    {"max_cached_bytes=%lu", offsetof(Options, maxCachedBytes), 0},
+    {"--max-format-bytes=%lu", offsetof(Options, maxFormatBytes), 0},
+    {"max_format_bytes=%lu", offsetof(Options, maxFormatBytes), 0},
+    {"--compress-threshold=%lu", offsetof(Options, compressThreshold), 0},
+    {"compress_threshold=%lu", offsetof(Options, compressThreshold), 0},
+    {"--xcb", offsetof(Options, xcb), 1},
+    {"xcb", offsetof(Options, xcb), 1},
+    {"--displays=%s", offsetof(Options, displays), 0},
+    {"displays=%s", offsetof(Options, displays), 0},
+    {"--mock", offsetof(Options, mock), 1},
+    {"mock", offsetof(Options, mock), 1},
+    {"--mock-formats=%lu", offsetof(Options, mockFormats), 0},
+    {"mock_formats=%lu", offsetof(Options, mockFormats), 0},
+    {"--mock-size=%lu", offsetof(Options, mockSize), 0},
+    {"mock_size=%lu", offsetof(Options, mockSize), 0},
+    {"--mock-interval=%lu", offsetof(Options, mockInterval), 0},
+    {"mock_interval=%lu", offsetof(Options, mockInterval), 0},
+    {"--lowlevel", offsetof(Options, lowlevel), 1},
+    {"lowlevel", offsetof(Options, lowlevel), 1},
+    FUSE_OPT_END,
+};
+
+// Non-empty items of a comma separated list
+std::vector<std::string> splitList(std::string_view list)
+{
+    std::vector<std::string> items;
+    while (!list.empty())
+    {
+        const size_t commaIndex = list.find(',');
+        if (commaIndex != 0)
+        {
+            items.emplace_back(list.substr(0, commaIndex));
+        }
+        list = commaIndex == std::string_view::npos ? std::string_view() : list.substr(commaIndex + 1);
+    }
+    return items;
+}
+
+ClipboardDataOptions makeClipboardDataOptions(const Options& options)
 {
-    // For now, always use Qt
-    return std::make_unique<QtClipboardData>(argc, argv);
+    ClipboardDataOptions clipboardDataOptions;
+    clipboardDataOptions.lazy = options.lazy;
+    clipboardDataOptions.historyCount = options.historyCount;
+    clipboardDataOptions.historyBytes = options.historyBytes;
+    clipboardDataOptions.stream = options.stream;
+    clipboardDataOptions.spillThreshold = options.spillThreshold;
+    clipboardDataOptions.convert = options.convert;
+    clipboardDataOptions.webpQuality = options.webpQuality;
+    clipboardDataOptions.prefetchFormats = splitList(options.prefetch ? options.prefetch : "");
+    clipboardDataOptions.prefetchBytes = options.prefetchBytes;
+    clipboardDataOptions.maxCachedBytes = options.maxCachedBytes;
+    clipboardDataOptions.maxFormatBytes = options.maxFormatBytes;
+    clipboardDataOptions.compressThreshold = options.compressThreshold;
+    return clipboardDataOptions;
+}
+
+// services is used by the XCB and mock clipboards, which can share it. The Qt clipboard makes its own
+// displayName is only used by the XCB clipboard. Null connects to $DISPLAY
+std::unique_ptr<ClipboardData> createClipboardData(int& argc, char* argv[], const Options& options,
+                                                   const ClipboardDataOptions& clipboardDataOptions, ClipboardServices* services,
+                                                   const char* displayName = nullptr)
+{
+    if (options.mock)
+    {
+        MockClipboardDataOptions mockOptions;
+        mockOptions.formatsCount = options.mockFormats;
+        mockOptions.dataSize = options.mockSize;
+        mockOptions.changeInterval = std::chrono::milliseconds(options.mockInterval);
+        return std::make_unique<MockClipboardData>(clipboardDataOptions, mockOptions, *services);
+    }
+    if (options.xcb)
+    {
+        return std::make_unique<XcbClipboardData>(clipboardDataOptions, *services, displayName);
+    }
+    return std::make_unique<QtClipboardData>(argc, argv, clipboardDataOptions);
 }
 
 #if 0
@@ -50,7 +188,7 @@ void onClipboardChanged()
 #endif
 
 //int fuseMainThread(int argc, char* argv[], const fuse_operations* op, void* privateData = NULL)
-int fuseMainThread(int argc, char* argv[], const fuse_operations* op, void* privateData = nullptr)
+int fuseMainThread(int argc, char* argv[], const fuse_operations* op, void* privateData = nullptr, bool lowlevel = false)
 {
     fuse_args args = FUSE_ARGS_INIT(argc, argv);
     if (fuse_opt_parse(&args, nullptr, nullptr, nullptr) == -1)
@@ -61,31 +199,201 @@ int fuseMainThread(int argc, char* argv[], const fuse_operations* op, void* priv
     fuse_opt_add_arg(&args, "-f");
 
     //int ret = fuse_main(args.argc, args.argv, &FuseImplementation::operations, NULL);
-    int ret = fuse_main(args.argc, args.argv, op, privateData);
+    int ret;
+    if (lowlevel)
+    {
+        ret = FuseImplementation::lowlevelMain(&args, reinterpret_cast<FuseImplementation::FuseInitData*>(privateData));
+    }
+    else
+    {
+        ret = fuse_main(args.argc, args.argv, op, privateData);
+    }
     fuse_opt_free_args(&args);
     if (privateData)
     {
-        reinterpret_cast<FuseImplementation::FuseInitData*>(privateData)->clipboardData->quit();
+        auto* initData = reinterpret_cast<FuseImplementation::FuseInitData*>(privateData);
+        if (initData->clipboardData)
+        {
+            initData->clipboardData->quit();
+        }
+        for (const auto& [displayName, clipboardData] : initData->displays)
+        {
+            clipboardData->quit();
+        }
     }
     return ret;
 }
 
+// Clipboard of one display, created and run on its own thread until it is destroyed
+// The XCB clipboard does all its X traffic on the thread that created it, so each display needs a thread anyway
+class DisplayThread
+{
+  public:
+    // Throws what create throws
+    explicit DisplayThread(const std::function<std::unique_ptr<ClipboardData>()>& create)
+    {
+        std::promise<void> created;
+        std::future<void> createdFuture = created.get_future();
+        // The promise is moved to the thread, so it is still alive while the thread sets it
+        m_thread = std::thread(
+            [this, &create](std::promise<void> created)
+            {
+                try
+                {
+                    m_clipboardData = create();
+                }
+                catch (...)
+                {
+                    created.set_exception(std::current_exception());
+                    return;
+                }
+                created.set_value();
+                m_clipboardData->run();
+            },
+            std::move(created));
+        try
+        {
+            createdFuture.get();
+        }
+        catch (...)
+        {
+            m_thread.join();
+            throw;
+        }
+    }
+
+    ~DisplayThread()
+    {
+        m_clipboardData->quit();
+        m_thread.join();
+    }
+
+    DisplayThread(const DisplayThread&) = delete;
+    DisplayThread& operator=(const DisplayThread&) = delete;
+
+    ClipboardData* clipboardData() const
+    {
+        return m_clipboardData.get();
+    }
+
+  private:
+    std::unique_ptr<ClipboardData> m_clipboardData;
+    std::thread m_thread;
+};
+
+// A display name is a directory name in the root, where names starting with a dot are the filesystem's own files
+bool isValidDisplayName(const std::string& displayName)
+{
+    return displayName[0] != '.' && displayName.find('/') == std::string::npos;
+}
+
+// Serves the clipboard of each display in displayNames from this process, each in a directory named after the display
+// Their clipboards share one ClipboardServices, so the worker threads and the stored data don't grow with the number of displays
+int serveDisplays(fuse_args& args, const Options& options, const ClipboardDataOptions& clipboardDataOptions,
+                  const std::vector<std::string>& displayNames)
+{
+    if (!options.xcb && !options.mock)
+    {
+        std::cerr << "--displays needs --xcb or --mock, since Qt connects to one display per process" << std::endl;
+        return 1;
+    }
+    if (options.lowlevel)
+    {
+        std::cerr << "--displays isn't supported with --lowlevel" << std::endl;
+        return 1;
+    }
+    for (auto it = displayNames.begin(); it != displayNames.end(); ++it)
+    {
+        if (!isValidDisplayName(*it) || std::find(displayNames.begin(), it, *it) != it)
+        {
+            std::cerr << "Invalid or repeated display name " << *it << std::endl;
+            return 1;
+        }
+    }
+
+    // Declared first, so it is destroyed after the clipboards that use it
+    ClipboardServices services(clipboardDataOptions);
+    std::vector<std::unique_ptr<DisplayThread>> displayThreads;
+    FuseImplementation::FuseInitData initData{nullptr, {}};
+    try
+    {
+        for (const std::string& displayName : displayNames)
+        {
+            displayThreads.push_back(std::make_unique<DisplayThread>(
+                [&args, &options, &clipboardDataOptions, &services, &displayName]()
+                {
+                    return createClipboardData(args.argc, args.argv, options, clipboardDataOptions, &services, displayName.c_str());
+                }));
+            initData.displays.emplace_back(displayName, displayThreads.back()->clipboardData());
+        }
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    // No Qt application needs the main thread, so fuse runs on it
+    return fuseMainThread(args.argc, args.argv, &FuseImplementation::operations, &initData);
+}
+
 int main(int argc, char* argv[])
 {
-    std::unique_ptr<ClipboardData> clipboardData = createClipboardData(argc, argv);
-    FuseImplementation::FuseInitData privateData{clipboardData.get()};
-    auto future = std::async(fuseMainThread, argc, argv, &FuseImplementation::operations, &privateData);
+    Options options;
+    // Must outlive the Qt application, which keeps a reference to the arguments
+    fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, optionSpecification, nullptr) == -1)
+    {
+        return 1;
+    }
+
+    const ClipboardDataOptions clipboardDataOptions = makeClipboardDataOptions(options);
+    const std::vector<std::string> displayNames = splitList(options.displays ? options.displays : "");
+    std::free(options.prefetch);
+    std::free(options.displays);
+    if (!displayNames.empty())
+    {
+        const int ret = serveDisplays(args, options, clipboardDataOptions, displayNames);
+        fuse_opt_free_args(&args);
+        return ret;
+    }
+
+    // Declared first, so it is destroyed after the clipboard that uses it
+    std::unique_ptr<ClipboardServices> services;
+    if (options.xcb || options.mock)
+    {
+        services = std::make_unique<ClipboardServices>(clipboardDataOptions);
+    }
+    std::unique_ptr<ClipboardData> clipboardData;
+    try
+    {
+        clipboardData = createClipboardData(args.argc, args.argv, options, clipboardDataOptions, services.get());
+    }
+    catch (const std::runtime_error& error)
+    {
+        std::cerr << error.what() << std::endl;
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    FuseImplementation::FuseInitData privateData{clipboardData.get(), {}};
+    auto future = std::async(fuseMainThread, args.argc, args.argv, &FuseImplementation::operations, &privateData,
+                             static_cast<bool>(options.lowlevel));
 
     // Check early in case fuse exits early (for incorrect option or another reason)
     // If fuse exits very quickly and calls QGuiApplication::quit(), maybe before app.exec() runs, the program never exits (not sure what circumstnaces causes the issues)
     // This is an attempt to return if Fuse exits early and never run app.exec()
     std::chrono::milliseconds waitSpan(50);
+    int ret;
     if (future.wait_for(waitSpan) == std::future_status::ready)
     {
-        return future.get();
+        ret = future.get();
+    }
+    else
+    {
+        clipboardData->run();
+        ret = future.get();
     }
 
-    clipboardData->run();
-
-    return future.get();
+    clipboardData.reset();
+    fuse_opt_free_args(&args);
+    return ret;
 }
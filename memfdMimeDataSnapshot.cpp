@@ -0,0 +1,74 @@
+#include "memfdMimeDataSnapshot.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+std::shared_ptr<const MimeDataSnapshot> MemfdMimeDataSnapshot::create(std::string_view data)
+{
+    const int fd = memfd_create("fuse-clipboard", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1)
+    {
+        return nullptr;
+    }
+    // Written with pwrite instead of through a writable mapping, which would prevent sealing
+    size_t written = 0;
+    while (written < data.size())
+    {
+        const ssize_t result = pwrite(fd, data.data() + written, data.size() - written, written);
+        if (result == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            close(fd);
+            return nullptr;
+        }
+        written += result;
+    }
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+    {
+        close(fd);
+        return nullptr;
+    }
+    // mmap() can't map 0 bytes
+    const char* mapping = nullptr;
+    if (!data.empty())
+    {
+        void* address = mmap(nullptr, data.size(), PROT_READ, MAP_SHARED, fd, 0);
+        if (address == MAP_FAILED)
+        {
+            close(fd);
+            return nullptr;
+        }
+        mapping = static_cast<const char*>(address);
+    }
+    // Constructor is private, so std::make_shared can't be used
+    return std::shared_ptr<const MimeDataSnapshot>(new MemfdMimeDataSnapshot(fd, mapping, data.size()));
+}
+
+MemfdMimeDataSnapshot::MemfdMimeDataSnapshot(int fd, const char* mapping, size_t size) : m_fd(fd), m_mapping(mapping), m_size(size)
+{
+}
+
+MemfdMimeDataSnapshot::~MemfdMimeDataSnapshot()
+{
+    if (m_mapping)
+    {
+        munmap(const_cast<char*>(m_mapping), m_size);
+    }
+    close(m_fd);
+}
+
+std::string_view MemfdMimeDataSnapshot::data() const
+{
+    return std::string_view(m_mapping, m_size);
+}
+
+int MemfdMimeDataSnapshot::fd() const
+{
+    return m_fd;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "clipboardSnapshot.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+// Data kept in a sealed memfd instead of on the heap
+// The pages are shmem, so the kernel can swap them out, and large payloads don't fragment the heap
+// Mapped read only, so data() needs no copy
+class MemfdMimeDataSnapshot : public MimeDataSnapshot
+{
+public:
+    // Copies data into a new memfd. Null pointer if it can't be created, like when memfd isn't supported
+    static std::shared_ptr<const MimeDataSnapshot> create(std::string_view data);
+
+    ~MemfdMimeDataSnapshot();
+
+    std::string_view data() const;
+    // Sealed, so its contents never change while it is open, and reads can be spliced from it
+    int fd() const;
+
+private:
+    MemfdMimeDataSnapshot(int fd, const char* mapping, size_t size);
+
+    const int m_fd;
+    const char* const m_mapping;
+    const size_t m_size;
+};
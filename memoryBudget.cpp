@@ -0,0 +1,68 @@
+#include "memoryBudget.hpp"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+MemoryBudget::MemoryBudget(size_t maxBytes, size_t maxFormatBytes) : m_maxBytes(maxBytes), m_maxFormatBytes(maxFormatBytes)
+{
+}
+
+bool MemoryBudget::isEnabled() const
+{
+    return m_maxBytes || m_maxFormatBytes;
+}
+
+bool MemoryBudget::fitsFormat(size_t size) const
+{
+    return (!m_maxFormatBytes || size <= m_maxFormatBytes) && (!m_maxBytes || size <= m_maxBytes);
+}
+
+void MemoryBudget::add(const ClipboardSnapshot& snapshot, const ClipboardSnapshot::MimeEntry& entry, size_t size)
+{
+    // Dropped after the lock is released, since freeing data can unmap memory
+    std::vector<std::shared_ptr<const MimeDataSnapshot>> evicted;
+    std::lock_guard lock(m_mutex);
+    if (snapshot.m_retired)
+    {
+        return;
+    }
+    m_items.push_back({&snapshot, &entry, size, entry.m_lastRead.load(std::memory_order_relaxed)});
+    m_usedBytes += size;
+    Stats::adjust(Stats::Gauge::CachedBytes, static_cast<int64_t>(size));
+    // Each item is requeued at most once, so data that is read all the time can't keep this from finishing
+    size_t requeuesLeft = m_items.size();
+    while (m_maxBytes && m_usedBytes > m_maxBytes && !m_items.empty())
+    {
+        Item& item = m_items.front();
+        const auto lastRead = item.entry->m_lastRead.load(std::memory_order_relaxed);
+        if (lastRead != item.queuedLastRead && requeuesLeft > 0)
+        {
+            --requeuesLeft;
+            item.queuedLastRead = lastRead;
+            m_items.splice(m_items.end(), m_items, m_items.begin());
+            continue;
+        }
+        evicted.push_back(std::atomic_exchange(&item.entry->m_data, std::shared_ptr<const MimeDataSnapshot>()));
+        m_usedBytes -= item.size;
+        Stats::adjust(Stats::Gauge::CachedBytes, -static_cast<int64_t>(item.size));
+        Stats::add(Stats::Counter::EvictedBytes, item.size);
+        m_items.pop_front();
+    }
+}
+
+void MemoryBudget::retire(const ClipboardSnapshot& snapshot)
+{
+    std::lock_guard lock(m_mutex);
+    snapshot.m_retired = true;
+    m_items.remove_if([this, &snapshot](const Item& item)
+        {
+            if (item.snapshot != &snapshot)
+            {
+                return false;
+            }
+            m_usedBytes -= item.size;
+            Stats::adjust(Stats::Gauge::CachedBytes, -static_cast<int64_t>(item.size));
+            return true;
+        });
+}
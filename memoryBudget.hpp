@@ -0,0 +1,47 @@
+#pragma once
+
+#include "clipboardSnapshot.hpp"
+#include "stats.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <list>
+
+// Limits the memory held by the fetched and converted data of the current snapshots
+// When the data counted goes over the limit, data that wasn't read recently is dropped. It is fetched or converted
+// again the next time it is read, so only data that can be made again is counted
+// Readers never take its lock, only storing and retiring data does. Since reads don't reorder it, data is kept in the order it
+// was stored, and data read since it was queued gets a second chance at the back instead of being dropped
+class MemoryBudget
+{
+public:
+    // 0 means no limit
+    MemoryBudget(size_t maxBytes, size_t maxFormatBytes);
+
+    // False if it has no limits, so snapshots don't need to use it
+    bool isEnabled() const;
+    // True if data of size bytes can be kept
+    bool fitsFormat(size_t size) const;
+
+    // Counts size bytes of data just stored in entry, then evicts until the total fits. Ignored if snapshot was retired
+    void add(const ClipboardSnapshot& snapshot, const ClipboardSnapshot::MimeEntry& entry, size_t size);
+    // Stops counting the data of snapshot, and ignores what it stores later
+    void retire(const ClipboardSnapshot& snapshot);
+
+private:
+    struct Item
+    {
+        const ClipboardSnapshot* snapshot;
+        const ClipboardSnapshot::MimeEntry* entry;
+        size_t size;
+        // Last read time of entry when it was queued at the back
+        std::chrono::steady_clock::rep queuedLastRead;
+    };
+
+    const size_t m_maxBytes;
+    const size_t m_maxFormatBytes;
+    Stats::TimedMutex m_mutex;
+    // Next to be dropped first
+    std::list<Item> m_items;
+    size_t m_usedBytes = 0;
+};
@@ -0,0 +1,126 @@
+#include "mimeDataStream.hpp"
+
+#include "stats.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <utility> // std::move
+
+MimeDataStream::MimeDataStream(std::function<void()> chunkConsumed, std::function<void()> closed)
+    : m_chunkConsumed(std::move(chunkConsumed)), m_closed(std::move(closed))
+{
+}
+
+bool MimeDataStream::wantsChunk() const
+{
+    std::lock_guard lock(m_mutex);
+    return !m_hasChunk && !m_isClosed;
+}
+
+void MimeDataStream::push(std::string chunk)
+{
+    Stats::add(Stats::Counter::FetchedBytes, chunk.size());
+    {
+        std::lock_guard lock(m_mutex);
+        m_receivedSize += chunk.size();
+        m_chunk = std::move(chunk);
+        m_chunkOffset = 0;
+        m_hasChunk = true;
+    }
+    m_condition.notify_all();
+}
+
+void MimeDataStream::finish()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_finished = true;
+    }
+    m_condition.notify_all();
+}
+
+void MimeDataStream::fail()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_failed = true;
+    }
+    m_condition.notify_all();
+}
+
+int MimeDataStream::read(char* buf, size_t size, off_t offset, std::chrono::milliseconds timeout)
+{
+    std::unique_lock lock(m_mutex);
+    // Data that was read is gone
+    if (offset < 0 || static_cast<size_t>(offset) < m_position)
+    {
+        return -ESPIPE;
+    }
+    size_t copied = 0;
+    while (copied < size)
+    {
+        if (!m_hasChunk)
+        {
+            // Return what is there instead of waiting for more
+            if (copied > 0)
+            {
+                break;
+            }
+            if (!m_condition.wait_for(lock, timeout, [this]() { return m_hasChunk || m_finished || m_failed; }))
+            {
+                return -EIO;
+            }
+            if (!m_hasChunk)
+            {
+                if (m_failed)
+                {
+                    return -EIO;
+                }
+                return 0;
+            }
+        }
+        const size_t available = m_chunk.size() - m_chunkOffset;
+        // Skips data before offset, for readers that seek forward
+        // Compared to where this read is now, since a chunk pushed while reading continues right after the last copied byte
+        const size_t readPosition = static_cast<size_t>(offset) + copied;
+        const size_t skipped = std::min(available, readPosition > m_position ? readPosition - m_position : 0);
+        const size_t count = std::min(available - skipped, size - copied);
+        std::copy_n(m_chunk.data() + m_chunkOffset + skipped, count, buf + copied);
+        copied += count;
+        m_chunkOffset += skipped + count;
+        m_position += skipped + count;
+        if (m_chunkOffset == m_chunk.size())
+        {
+            m_chunk = std::string();
+            m_hasChunk = false;
+            // Ask for the next chunk before waiting for it
+            lock.unlock();
+            m_chunkConsumed();
+            lock.lock();
+        }
+    }
+    return copied;
+}
+
+std::optional<size_t> MimeDataStream::size() const
+{
+    std::lock_guard lock(m_mutex);
+    if (!m_finished)
+    {
+        return {};
+    }
+    return m_receivedSize;
+}
+
+void MimeDataStream::close()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_isClosed)
+        {
+            return;
+        }
+        m_isClosed = true;
+    }
+    m_closed();
+}
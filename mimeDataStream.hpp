@@ -0,0 +1,58 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <sys/types.h> // off_t
+
+// Data of a format that is read while the owner is still sending it, one chunk at a time
+// Holds at most one chunk that wasn't read yet. The producer only asks the owner for the next chunk once it was read,
+// so a slow reader slows down the owner instead of the data piling up in memory
+// Can be used from any thread
+class MimeDataStream
+{
+public:
+    // chunkConsumed is called when the pending chunk was read, so the producer can ask for the next one
+    // closed is called once when the reader closes the stream, so the producer can stop
+    // Both are called from the reader's thread, without holding a lock
+    MimeDataStream(std::function<void()> chunkConsumed, std::function<void()> closed);
+
+    // Producer side
+    // True if there is no pending chunk, so push() can be called
+    bool wantsChunk() const;
+    void push(std::string chunk);
+    // All data was pushed
+    void finish();
+    // Data can't be received anymore, so reading fails
+    void fail();
+
+    // Reader side
+    // Reads sequentially. Waits for the next chunk if needed, up to timeout
+    // Returns number of bytes read, 0 at the end of the data, or -errno
+    int read(char* buf, size_t size, off_t offset, std::chrono::milliseconds timeout);
+    // Total size, only known once all data was received
+    std::optional<size_t> size() const;
+    void close();
+
+private:
+    const std::function<void()> m_chunkConsumed;
+    const std::function<void()> m_closed;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::string m_chunk;
+    // Read position in m_chunk
+    size_t m_chunkOffset = 0;
+    bool m_hasChunk = false;
+    // Bytes received so far, including m_chunk
+    size_t m_receivedSize = 0;
+    // Offset of the next byte the reader gets
+    size_t m_position = 0;
+    bool m_finished = false;
+    bool m_failed = false;
+    bool m_isClosed = false;
+};
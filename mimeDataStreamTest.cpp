@@ -0,0 +1,99 @@
+#include "mimeDataStream.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <utility> // std::move
+
+namespace
+{
+int failures = 0;
+
+void check(bool condition, const char* what)
+{
+    if (!condition)
+    {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+// Producer that has all chunks ready, so it pushes the next one from the chunkConsumed callback, while a read is in progress
+struct EagerProducer
+{
+    explicit EagerProducer(std::deque<std::string> chunks)
+        : chunks(std::move(chunks)), stream([this]() { pushNext(); }, []() {})
+    {
+        pushNext();
+    }
+
+    void pushNext()
+    {
+        if (chunks.empty())
+        {
+            stream.finish();
+            return;
+        }
+        stream.push(std::move(chunks.front()));
+        chunks.pop_front();
+    }
+
+    std::deque<std::string> chunks;
+    MimeDataStream stream;
+};
+
+std::string readAll(MimeDataStream& stream, off_t offset, size_t bufferSize)
+{
+    std::string data;
+    std::string buffer(bufferSize, '\0');
+    while (true)
+    {
+        const int result = stream.read(buffer.data(), buffer.size(), offset, std::chrono::milliseconds(100));
+        if (result <= 0)
+        {
+            check(result == 0, "read ends without error");
+            return data;
+        }
+        data.append(buffer.data(), result);
+        offset += result;
+    }
+}
+
+void testChunkPushedWhileReading()
+{
+    EagerProducer producer({"abc", "def", "ghi"});
+    check(readAll(producer.stream, 0, 16) == "abcdefghi", "chunk pushed while reading isn't skipped");
+    check(producer.stream.size() == 9u, "size is known once finished");
+}
+
+void testSeekForward()
+{
+    EagerProducer producer({"abc", "def", "ghi"});
+    check(readAll(producer.stream, 4, 16) == "efghi", "seeking forward skips across chunks");
+}
+
+void testSmallReads()
+{
+    EagerProducer producer({"abc", "def", "ghi"});
+    check(readAll(producer.stream, 0, 2) == "abcdefghi", "reads smaller than a chunk");
+}
+
+void testSeekBackward()
+{
+    EagerProducer producer({"abc", "def"});
+    char buf[4];
+    check(producer.stream.read(buf, sizeof(buf), 0, std::chrono::milliseconds(100)) == 4, "first read");
+    check(producer.stream.read(buf, sizeof(buf), 0, std::chrono::milliseconds(100)) == -ESPIPE, "data that was read is gone");
+}
+} // namespace
+
+int main()
+{
+    testChunkPushedWhileReading();
+    testSeekForward();
+    testSmallReads();
+    testSeekBackward();
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
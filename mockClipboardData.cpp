@@ -0,0 +1,175 @@
+#include "mockClipboardData.hpp"
+
+#include "stats.hpp"
+
+#include <cassert>
+#include <string>
+#include <utility> // std::move
+
+namespace
+{
+const std::string MOCK_MIME_TYPE_PREFIX("application/x-mock-");
+
+// Data of every format for the contents of generation, so a change is visible in the data
+// Counted as fetched from the owner, like the data of a real clipboard
+std::shared_ptr<const MimeDataSnapshot> makeSyntheticData(size_t dataSize, uint64_t generation)
+{
+    Stats::add(Stats::Counter::FetchedBytes, dataSize);
+    return std::make_shared<StringMimeDataSnapshot>(std::string(dataSize, static_cast<char>('a' + generation % 26)));
+}
+} // namespace
+
+MockClipboardData::Contents::Contents(size_t historyCount, size_t historyBytes) : history(historyCount, historyBytes)
+{
+}
+
+MockClipboardData::MockClipboardData(const ClipboardDataOptions& options, const MockClipboardDataOptions& mockOptions,
+                                     ClipboardServices& services)
+    : m_lazy(options.fetchesLazily()), m_changeInterval(mockOptions.changeInterval), m_clipboard(options.historyCount, options.historyBytes),
+      // Like the Qt clipboard, history is only kept for the clipboard
+      m_selection(0, options.historyBytes), m_formatConverter(services.formatConverter),
+      m_prefetcher(services.prefetcher), m_memoryBudget(services.memoryBudget), m_historyCompressor(services.historyCompressor)
+{
+    std::lock_guard lock(m_changeMutex);
+    setSyntheticContentsLocked(mockOptions.formatsCount, mockOptions.dataSize, Mode::Clipboard);
+    setSyntheticContentsLocked(0, 0, Mode::Selection);
+}
+
+void MockClipboardData::run()
+{
+    std::unique_lock lock(m_runMutex);
+    while (!m_quit)
+    {
+        if (m_changeInterval.count() == 0)
+        {
+            m_runCondition.wait(lock, [this]() { return m_quit; });
+        }
+        else if (!m_runCondition.wait_for(lock, m_changeInterval, [this]() { return m_quit; }))
+        {
+            lock.unlock();
+            change(Mode::Clipboard);
+            lock.lock();
+        }
+    }
+}
+
+void MockClipboardData::quit()
+{
+    // Also makes a later run() return right away, in case quit() is called first
+    {
+        std::lock_guard lock(m_runMutex);
+        m_quit = true;
+    }
+    m_runCondition.notify_all();
+}
+
+void MockClipboardData::setChangeCallback(ChangeCallback callback)
+{
+    std::lock_guard lock(m_changeCallbackMutex);
+    m_changeCallback = std::move(callback);
+}
+
+std::shared_ptr<const ClipboardSnapshot> MockClipboardData::snapshot(Mode mode)
+{
+    return contentsForMode(mode).snapshot.load();
+}
+
+std::shared_ptr<const ClipboardHistory::SnapshotList> MockClipboardData::history(Mode mode)
+{
+    return contentsForMode(mode).history.snapshots();
+}
+
+void MockClipboardData::setMimeData(const MimeDataList& formats, Mode mode)
+{
+    std::lock_guard lock(m_changeMutex);
+    auto snapshot = std::make_shared<ClipboardSnapshot>(++m_generation, nullptr, &m_memoryBudget);
+    for (const auto& [fullMimeType, data] : formats)
+    {
+        snapshot->addMimeType(fullMimeType, data);
+    }
+    m_formatConverter.addConvertedFormats(*snapshot);
+    publish(std::move(snapshot), mode);
+}
+
+void MockClipboardData::setSyntheticContents(size_t formatsCount, size_t dataSize, Mode mode)
+{
+    std::lock_guard lock(m_changeMutex);
+    setSyntheticContentsLocked(formatsCount, dataSize, mode);
+}
+
+void MockClipboardData::change(Mode mode)
+{
+    std::lock_guard lock(m_changeMutex);
+    const Contents& contents = contentsForMode(mode);
+    setSyntheticContentsLocked(contents.formatsCount, contents.dataSize, mode);
+}
+
+MockClipboardData::Contents& MockClipboardData::contentsForMode(Mode mode)
+{
+    switch (mode)
+    {
+    case Mode::Clipboard:
+        return m_clipboard;
+    case Mode::Selection:
+        return m_selection;
+    }
+    assert(false);
+    return m_clipboard;
+}
+
+void MockClipboardData::setSyntheticContentsLocked(size_t formatsCount, size_t dataSize, Mode mode)
+{
+    const Stats::ScopedTimer timer(Stats::Timer::ClipboardChange);
+    Contents& contents = contentsForMode(mode);
+    contents.formatsCount = formatsCount;
+    contents.dataSize = dataSize;
+
+    const uint64_t generation = ++m_generation;
+    // Even if formats aren't lazy, since data the memory budget dropped is fetched again
+    ClipboardSnapshot::Fetcher fetcher = [this, dataSize, generation, mode](const std::string&) { return fetchMimeData(dataSize, generation, mode); };
+    std::shared_ptr<const MimeDataSnapshot> data;
+    if (!m_lazy)
+    {
+        // All formats share one payload, so large sizes only cost their memory once
+        data = makeSyntheticData(dataSize, generation);
+    }
+    auto snapshot = std::make_shared<ClipboardSnapshot>(generation, std::move(fetcher), &m_memoryBudget);
+    for (size_t i = 0; i < formatsCount; ++i)
+    {
+        snapshot->addMimeType(MOCK_MIME_TYPE_PREFIX + std::to_string(i), data);
+    }
+    publish(snapshot, mode);
+    if (m_prefetcher.isEnabled())
+    {
+        m_prefetcher.prefetch(snapshot, [dataSize, generation](const std::string&) { return makeSyntheticData(dataSize, generation); }, nullptr);
+    }
+}
+
+void MockClipboardData::publish(std::shared_ptr<const ClipboardSnapshot> snapshot, Mode mode)
+{
+    Contents& contents = contentsForMode(mode);
+    std::shared_ptr<const ClipboardSnapshot> oldSnapshot = contents.snapshot.exchange(snapshot);
+    if (oldSnapshot)
+    {
+        oldSnapshot->retire();
+        m_historyCompressor.compressLater(oldSnapshot);
+    }
+    contents.history.push(snapshot);
+    notifyPublished();
+    // Held while calling, so setChangeCallback() can't return while the old callback is running
+    std::lock_guard lock(m_changeCallbackMutex);
+    if (m_changeCallback)
+    {
+        m_changeCallback(mode, oldSnapshot, snapshot);
+    }
+}
+
+std::shared_ptr<const MimeDataSnapshot> MockClipboardData::fetchMimeData(size_t dataSize, uint64_t generation, Mode mode)
+{
+    // Like a real clipboard, the data is gone once the contents changed
+    if (snapshot(mode)->generation() != generation)
+    {
+        return nullptr;
+    }
+    return makeSyntheticData(dataSize, generation);
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "clipboardData.hpp"
+#include "clipboardHistory.hpp"
+#include "clipboardServices.hpp"
+#include "formatConverter.hpp"
+#include "historyCompressor.hpp"
+#include "memoryBudget.hpp"
+#include "prefetcher.hpp"
+#include "publishedPtr.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// Options for the mock clipboard, which makes up its contents instead of reading a real clipboard
+struct MockClipboardDataOptions
+{
+    // Initial contents of the clipboard. The selection starts empty
+    size_t formatsCount = 4;
+    size_t dataSize = 4096;
+    // How often run() changes the contents of the clipboard. 0 never changes them
+    std::chrono::milliseconds changeInterval{0};
+};
+
+// Clipboard with synthetic contents that doesn't need a display server, so the filesystem can be measured without a desktop session
+// Formats are named application/x-mock-<index>, and each change fills their data with a different byte
+// Contents can also be changed programmatically from any thread
+class MockClipboardData : public ClipboardData
+{
+  public:
+    // services must outlive this object
+    MockClipboardData(const ClipboardDataOptions& options, const MockClipboardDataOptions& mockOptions, ClipboardServices& services);
+
+    // Changes the clipboard every changeInterval until quit() is called
+    void run();
+    void quit();
+
+    void setChangeCallback(ChangeCallback callback);
+
+    std::shared_ptr<const ClipboardSnapshot> snapshot(Mode mode = Mode::Clipboard);
+    std::shared_ptr<const ClipboardHistory::SnapshotList> history(Mode mode = Mode::Clipboard);
+
+    void setMimeData(const MimeDataList& formats, Mode mode = Mode::Clipboard);
+
+    // Replaces the contents with formatsCount synthetic formats of dataSize bytes each
+    void setSyntheticContents(size_t formatsCount, size_t dataSize, Mode mode = Mode::Clipboard);
+    // Replaces the contents with new synthetic data of the last formats count and size
+    void change(Mode mode = Mode::Clipboard);
+
+  private:
+    struct Contents
+    {
+        Contents(size_t historyCount, size_t historyBytes);
+
+        ClipboardHistory history;
+        // Only replaced while m_changeMutex is held
+        PublishedPtr<const ClipboardSnapshot> snapshot;
+        // Of the last synthetic contents. Only used while m_changeMutex is held
+        size_t formatsCount = 0;
+        size_t dataSize = 0;
+    };
+
+    const bool m_lazy;
+    const std::chrono::milliseconds m_changeInterval;
+
+    std::mutex m_changeCallbackMutex;
+    ChangeCallback m_changeCallback;
+
+    // Serializes changes, since history is only pushed to from one thread at a time
+    std::mutex m_changeMutex;
+    uint64_t m_generation = 0;
+    Contents m_clipboard;
+    Contents m_selection;
+    // Synthetic formats can't be converted, but formats set with setMimeData() can
+    FormatConverter& m_formatConverter;
+    Prefetcher& m_prefetcher;
+    MemoryBudget& m_memoryBudget;
+    HistoryCompressor& m_historyCompressor;
+
+    std::mutex m_runMutex;
+    std::condition_variable m_runCondition;
+    bool m_quit = false;
+
+    Contents& contentsForMode(Mode mode);
+    // Must be called with m_changeMutex held
+    void setSyntheticContentsLocked(size_t formatsCount, size_t dataSize, Mode mode);
+    void publish(std::shared_ptr<const ClipboardSnapshot> snapshot, Mode mode);
+    // Null pointer if the contents changed since the snapshot of generation was published
+    std::shared_ptr<const MimeDataSnapshot> fetchMimeData(size_t dataSize, uint64_t generation, Mode mode);
+};
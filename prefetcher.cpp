@@ -0,0 +1,121 @@
+#include "prefetcher.hpp"
+
+#include <algorithm>
+#include <string_view>
+#include <utility> // std::move
+
+namespace
+{
+// A format that is transferred, and the hot converted formats made from it
+struct PrefetchItem
+{
+    const ClipboardSnapshot::MimeEntry* entry;
+    std::vector<const ClipboardSnapshot::MimeEntry*> convertedEntries;
+};
+
+// Formats of snapshot matching pattern, which is a full mime type or ends with "/*"
+std::vector<const ClipboardSnapshot::MimeEntry*> matchingEntries(const ClipboardSnapshot& snapshot, const std::string& pattern)
+{
+    std::vector<const ClipboardSnapshot::MimeEntry*> entries;
+    const size_t slashIndex = pattern.find('/');
+    if (slashIndex == std::string::npos)
+    {
+        return entries;
+    }
+    const std::string_view mainMimeType = std::string_view(pattern).substr(0, slashIndex);
+    const ClipboardSnapshot::MimeDirectory* directory = snapshot.mimeDirectory(mainMimeType);
+    if (!directory)
+    {
+        return entries;
+    }
+    const bool allSubTypes = pattern.compare(slashIndex + 1, std::string::npos, "*") == 0;
+    for (const auto& [fileName, entry] : *directory)
+    {
+        if (allSubTypes || entry->fullMimeType() == pattern)
+        {
+            entries.push_back(entry);
+        }
+    }
+    return entries;
+}
+
+// Hot formats of snapshot in the order they are transferred, each transferred once even if several converted formats need it
+std::vector<PrefetchItem> prefetchItems(const ClipboardSnapshot& snapshot, const std::vector<std::string>& patterns)
+{
+    std::vector<PrefetchItem> items;
+    for (const std::string& pattern : patterns)
+    {
+        for (const ClipboardSnapshot::MimeEntry* entry : matchingEntries(snapshot, pattern))
+        {
+            const ClipboardSnapshot::MimeEntry* transferredEntry = entry->isConverted() ? entry->source() : entry;
+            auto it = std::find_if(items.begin(), items.end(), [transferredEntry](const PrefetchItem& item) { return item.entry == transferredEntry; });
+            if (it == items.end())
+            {
+                it = items.insert(items.end(), PrefetchItem{transferredEntry, {}});
+            }
+            if (entry != transferredEntry && std::find(it->convertedEntries.begin(), it->convertedEntries.end(), entry) == it->convertedEntries.end())
+            {
+                it->convertedEntries.push_back(entry);
+            }
+        }
+    }
+    return items;
+}
+} // namespace
+
+Prefetcher::Prefetcher(const ClipboardDataOptions& options) : m_formats(options.prefetchFormats), m_maxBytes(options.prefetchBytes)
+{
+    if (!m_formats.empty())
+    {
+        m_workerPool = std::make_unique<WorkerPool>(WorkerPool::defaultThreadsCount(options.workerPoolsCount()));
+    }
+}
+
+bool Prefetcher::isEnabled() const
+{
+    return m_workerPool != nullptr;
+}
+
+void Prefetcher::prefetch(const std::shared_ptr<const ClipboardSnapshot>& snapshot, const Transfer& transfer, BlobStore* blobStore)
+{
+    if (!isEnabled())
+    {
+        return;
+    }
+    size_t transferredBytes = 0;
+    for (PrefetchItem& item : prefetchItems(*snapshot, m_formats))
+    {
+        // Checked before each transfer, since a format's size is only known once it was transferred
+        if (transferredBytes >= m_maxBytes)
+        {
+            break;
+        }
+        // A reader may have fetched it already
+        std::shared_ptr<const MimeDataSnapshot> data;
+        if (!snapshot->fetchedMimeData(*item.entry))
+        {
+            data = transfer(item.entry->fullMimeType());
+            if (!data)
+            {
+                continue;
+            }
+            transferredBytes += data->data().size();
+        }
+        if (!data && item.convertedEntries.empty())
+        {
+            continue;
+        }
+        // Converted formats wait for their source in the same job, so converting never fetches the source from the owner
+        m_workerPool->submit([snapshot, item = std::move(item), data = std::move(data), blobStore]()
+            {
+                if (data)
+                {
+                    snapshot->provideMimeData(*item.entry, blobStore ? blobStore->intern(data) : data);
+                }
+                for (const ClipboardSnapshot::MimeEntry* convertedEntry : item.convertedEntries)
+                {
+                    snapshot->mimeData(*convertedEntry);
+                }
+            });
+    }
+}
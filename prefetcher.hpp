@@ -0,0 +1,39 @@
+#pragma once
+
+#include "blobStore.hpp"
+#include "clipboardData.hpp"
+#include "clipboardSnapshot.hpp"
+#include "workerPool.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Gets the hot formats of a lazy snapshot ready as soon as the clipboard changes, so their first read doesn't wait for the owner
+// Only the transfers from the owner are done on the thread that watches the clipboard. Interning the data, which hashes it,
+// and converting it are done on worker threads. Formats that aren't hot stay lazy
+class Prefetcher
+{
+public:
+    // Transfers the data of fullMimeType from the clipboard owner. Null pointer if it can't be transferred
+    using Transfer = std::function<std::shared_ptr<const MimeDataSnapshot>(const std::string& fullMimeType)>;
+
+    // Prefetches nothing unless options.prefetchFormats has formats
+    explicit Prefetcher(const ClipboardDataOptions& options);
+
+    bool isEnabled() const;
+
+    // Transfers the hot formats of snapshot, until options.prefetchBytes were transferred, and provides them to snapshot on a worker
+    // A hot converted format has its source transferred, and is converted on a worker
+    // Must be called on the thread that watches the clipboard, after snapshot was published
+    // The data is interned in blobStore unless it is null. blobStore must outlive this object
+    void prefetch(const std::shared_ptr<const ClipboardSnapshot>& snapshot, const Transfer& transfer, BlobStore* blobStore);
+
+private:
+    const std::vector<std::string> m_formats;
+    const size_t m_maxBytes;
+    // Only created if there are hot formats
+    std::unique_ptr<WorkerPool> m_workerPool;
+};
@@ -0,0 +1,72 @@
+#include "publishedPtr.hpp"
+
+namespace
+{
+// Slots are never freed, since a writer may be reading any of them. A thread that exits gives its slot to the next new thread
+struct Slot
+{
+    std::atomic<const void*> pointer = nullptr;
+    std::atomic<bool> isUsed = true;
+    Slot* next = nullptr;
+};
+
+std::atomic<Slot*> slots = nullptr;
+
+Slot& acquireSlot()
+{
+    for (Slot* slot = slots.load(std::memory_order_acquire); slot; slot = slot->next)
+    {
+        bool isUsed = false;
+        if (!slot->isUsed.load(std::memory_order_relaxed) && slot->isUsed.compare_exchange_strong(isUsed, true))
+        {
+            return *slot;
+        }
+    }
+    auto* slot = new Slot();
+    slot->next = slots.load(std::memory_order_relaxed);
+    while (!slots.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    return *slot;
+}
+
+// Gives the slot of a thread back when the thread exits
+struct SlotOwner
+{
+    Slot& slot = acquireSlot();
+
+    ~SlotOwner()
+    {
+        slot.pointer.store(nullptr, std::memory_order_relaxed);
+        slot.isUsed.store(false, std::memory_order_release);
+    }
+};
+} // namespace
+
+namespace HazardSlots
+{
+std::atomic<const void*>& threadSlot()
+{
+    // Plain pointer, so checking it doesn't go through the guard of a thread_local with a destructor
+    thread_local std::atomic<const void*>* slot = nullptr;
+    if (!slot)
+    {
+        thread_local SlotOwner owner;
+        slot = &owner.slot.pointer;
+    }
+    return *slot;
+}
+
+std::vector<const void*> heldPointers()
+{
+    std::vector<const void*> pointers;
+    for (Slot* slot = slots.load(std::memory_order_acquire); slot; slot = slot->next)
+    {
+        if (const void* pointer = slot->pointer.load(std::memory_order_seq_cst))
+        {
+            pointers.push_back(pointer);
+        }
+    }
+    return pointers;
+}
+}
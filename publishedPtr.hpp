@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <utility> // std::move
+#include <vector>
+
+namespace HazardSlots
+{
+// Slot of the calling thread, which holds the pointer it is loading from a PublishedPtr, so it isn't freed meanwhile
+// Each thread has one slot, so loads must not be nested
+std::atomic<const void*>& threadSlot();
+// Pointers held by the slots of all threads right now
+std::vector<const void*> heldPointers();
+}
+
+// std::shared_ptr that is replaced by one thread at a time and loaded by any thread without a lock
+// std::atomic_load of a std::shared_ptr locks one of a few mutexes that libstdc++ picks by address, so all readers of the same
+// snapshot would take the same mutex on every filesystem operation
+// Here a load is two atomic loads, a store to the slot of the thread and the reference count increment. The writer frees a replaced
+// value's node once no slot holds it, which is right away unless a reader was in the middle of a load
+template <typename T>
+class PublishedPtr
+{
+public:
+    explicit PublishedPtr(std::shared_ptr<T> value = nullptr) : m_current(new Node{std::move(value)})
+    {
+    }
+
+    // No loads may run anymore
+    ~PublishedPtr()
+    {
+        delete m_current.load(std::memory_order_relaxed);
+        for (Node* node : m_retired)
+        {
+            delete node;
+        }
+    }
+
+    PublishedPtr(const PublishedPtr&) = delete;
+    PublishedPtr& operator=(const PublishedPtr&) = delete;
+
+    // Can be called from any thread
+    std::shared_ptr<T> load() const
+    {
+        std::atomic<const void*>& slot = HazardSlots::threadSlot();
+        Node* node = m_current.load(std::memory_order_acquire);
+        // Only safe to use once the slot is seen by the writer. If node was replaced meanwhile, it may be freed, so try again
+        while (true)
+        {
+            slot.store(node, std::memory_order_seq_cst);
+            Node* current = m_current.load(std::memory_order_seq_cst);
+            if (current == node)
+            {
+                break;
+            }
+            node = current;
+        }
+        std::shared_ptr<T> value = node->value;
+        slot.store(nullptr, std::memory_order_release);
+        return value;
+    }
+
+    // Only called from one thread at a time. Returns the value that was replaced
+    std::shared_ptr<T> exchange(std::shared_ptr<T> value)
+    {
+        Node* oldNode = m_current.exchange(new Node{std::move(value)}, std::memory_order_seq_cst);
+        // Only the writer frees nodes, so oldNode can still be read here
+        std::shared_ptr<T> oldValue = oldNode->value;
+        m_retired.push_back(oldNode);
+        freeRetired();
+        return oldValue;
+    }
+
+    void store(std::shared_ptr<T> value)
+    {
+        exchange(std::move(value));
+    }
+
+private:
+    struct Node
+    {
+        const std::shared_ptr<T> value;
+    };
+
+    std::atomic<Node*> m_current;
+    // Replaced nodes that a reader may still be loading from. Only used by the writer
+    std::vector<Node*> m_retired;
+
+    void freeRetired()
+    {
+        const std::vector<const void*> heldPointers = HazardSlots::heldPointers();
+        auto it = std::partition(m_retired.begin(), m_retired.end(), [&heldPointers](Node* node)
+            {
+                return std::find(heldPointers.begin(), heldPointers.end(), node) != heldPointers.end();
+            });
+        for (auto freeIt = it; freeIt != m_retired.end(); ++freeIt)
+        {
+            delete *freeIt;
+        }
+        m_retired.erase(it, m_retired.end());
+    }
+};
@@ -1,29 +1,30 @@
 #include "qtClipboardData.hpp"
 
+#include <QMetaObject>
+#include <QMimeData>
+#include <QThread>
+
+#include <cassert>
 #include <functional> // std::bind
 #include <utility>    // std::move
-#include <cassert>
-
-#include <QClipboard>
-#include <QMimeData>
-#include <QStringList>
 
 namespace
 {
-bool fullMimeTypeHasSubType(const QString& fullMimeType, const QString& mimeSubType)
+ClipboardDataOptions withoutHistory(ClipboardDataOptions options)
 {
-    return fullMimeType.endsWith(mimeSubType) && fullMimeType.size() >= mimeSubType.size() + 2 &&
-           fullMimeType[fullMimeType.size() - 1 - mimeSubType.size()] == '/' && fullMimeType[fullMimeType.size() - 1 - mimeSubType.size() - 1] != '/';
-}
-
-bool fullMimeTypeHasMainType(const QString& fullMimeType, const QString& mainMimeType)
-{
-    return fullMimeType.startsWith(mainMimeType) && fullMimeType.size() > mainMimeType.size() + 1 &&
-           fullMimeType[mainMimeType.size()] == '/' && fullMimeType[mainMimeType.size() + 1] != '/';
-}
+    options.historyCount = 0;
+    return options;
 }
+} // namespace
 
-QtClipboardData::QtClipboardData(int& argc, char** argv) : m_qtApp(argc, argv), m_clipboardData(QClipboard::Mode::Clipboard), m_selectionData(QClipboard::Mode::Selection)
+QtClipboardData::QtClipboardData(int& argc, char** argv, const ClipboardDataOptions& options)
+    : m_memoryBudget(options.maxCachedBytes, options.maxFormatBytes), m_blobStore(options.spillThreshold), m_qtApp(argc, argv),
+      m_formatConverter(options), m_prefetcher(options), m_historyCompressor(options),
+      m_clipboardData(QClipboard::Mode::Clipboard, options, m_blobStore, m_formatConverter, m_prefetcher, m_memoryBudget, m_historyCompressor,
+                      std::bind(&QtClipboardData::onClipboardChanged, this, Mode::Clipboard, std::placeholders::_1, std::placeholders::_2)),
+      m_selectionData(QClipboard::Mode::Selection, withoutHistory(options), m_blobStore, m_formatConverter, m_prefetcher, m_memoryBudget,
+                      m_historyCompressor,
+                      std::bind(&QtClipboardData::onClipboardChanged, this, Mode::Selection, std::placeholders::_1, std::placeholders::_2))
 {
 
 }
@@ -36,6 +37,8 @@ QtClipboardData::~QtClipboardData()
 void QtClipboardData::run()
 {
     m_qtApp.exec();
+    // Data can only be fetched by the Qt thread
+    notifyStopped();
 }
 
 void QtClipboardData::quit()
@@ -43,143 +46,53 @@ void QtClipboardData::quit()
     QGuiApplication::quit();
 }
 
-std::lock_guard<std::mutex> QtClipboardData::getLock(ClipboardData::Mode mode)
+void QtClipboardData::setChangeCallback(ChangeCallback callback)
 {
-    switch (mode)
-    {
-    case ClipboardData::Mode::Clipboard:
-        return m_clipboardData.getLock();
-    case ClipboardData::Mode::Selection:
-        return m_selectionData.getLock();
-    default:
-        throw;
-    }
-}
-
-bool QtClipboardData::hasData(Mode mode)
-{
-    switch (mode)
-    {
-    case QtClipboardData::Mode::Clipboard:
-        return m_clipboardData.hasData();
-    case QtClipboardData::Mode::Selection:
-        return m_selectionData.hasData();
-    default:
-        throw;
-    }
+    std::lock_guard lock(m_changeCallbackMutex);
+    m_changeCallback = std::move(callback);
 }
 
-const std::vector<std::string> QtClipboardData::mainMimeTypes(Mode mode)
+void QtClipboardData::onClipboardChanged(Mode mode, const std::shared_ptr<const ClipboardSnapshot>& oldSnapshot,
+                                         const std::shared_ptr<const ClipboardSnapshot>& newSnapshot)
 {
-    QtClipboardDataBase& dataObject = dataObjectForMode(mode);
-    const auto hash = dataObject.mainMimeTypes();
-
-    std::vector<std::string> result;
-    result.reserve(hash.size());
-    for (const QString& mainMimeType : hash)
+    notifyPublished();
+    // Held while calling, so setChangeCallback() can't return while the old callback is running
+    std::lock_guard lock(m_changeCallbackMutex);
+    if (m_changeCallback)
     {
-        result.emplace_back(mainMimeType.toStdString());
+        m_changeCallback(mode, oldSnapshot, newSnapshot);
     }
-    return result;
 }
 
-size_t QtClipboardData::mainMimeTypesCount(Mode mode)
+std::shared_ptr<const ClipboardSnapshot> QtClipboardData::snapshot(Mode mode)
 {
-    QtClipboardDataBase& dataObject = dataObjectForMode(mode);
-    return dataObject.mainMimeTypes().size();
+    return dataObjectForMode(mode).snapshot();
 }
 
-const std::vector<std::string> QtClipboardData::mimeSubTypes(const std::string& mainMimeType, Mode mode)
+std::shared_ptr<const ClipboardHistory::SnapshotList> QtClipboardData::history(Mode mode)
 {
-    QtClipboardDataBase& dataObject = dataObjectForMode(mode);
-    std::vector<std::string> result;
-    const QString mainMimeTypeQString = QString::fromStdString(mainMimeType);
-    const auto& hash = dataObject.fullMimeTypeToDataMap();
-    for (auto it = hash.keyBegin(), itEnd = hash.keyEnd(); it != itEnd; ++it)
-    {
-        const QString& fullMimeType = *it;
-        if (fullMimeTypeHasMainType(fullMimeType, mainMimeTypeQString))
-        {
-            // -1 to skip slash
-            result.emplace_back(fullMimeType.right(fullMimeType.size() - mainMimeTypeQString.size() - 1).toStdString());
-        }
-    }
-    return result;
+    return dataObjectForMode(mode).history();
 }
 
-size_t QtClipboardData::mimeSubTypesCount(const std::string& mainMimeType, Mode mode)
+void QtClipboardData::setMimeData(const MimeDataList& formats, Mode mode)
 {
-    size_t count = 0;
-    QtClipboardDataBase& dataObject = dataObjectForMode(mode);
-    const QString mainMimeTypeQString = QString::fromStdString(mainMimeType);
-    const auto& hash = dataObject.fullMimeTypeToDataMap();
-    // Use std::count instead
-    for (auto it = hash.keyBegin(), itEnd = hash.keyEnd(); it != itEnd; ++it)
+    // Data is copied into the QMimeData here, so the Qt thread only has to hand it to the clipboard
+    auto* mimeData = new QMimeData();
+    for (const auto& [fullMimeType, data] : formats)
     {
-        const QString& fullMimeType = *it;
-        if (fullMimeTypeHasMainType(fullMimeType, mainMimeTypeQString))
-        {
-            ++count;
-        }
+        mimeData->setData(QString::fromStdString(fullMimeType), QByteArray(data->data().data(), data->data().size()));
     }
-    return count;
-}
-
-bool QtClipboardData::hasMainMimeType(const std::string& mainMimeType, Mode mode)
-{
-    QtClipboardDataBase& dataObject = dataObjectForMode(mode);
-
-    const auto& mainTypes = dataObject.mainMimeTypes();
-    return mainTypes.contains(QString::fromStdString(mainMimeType));
-//    return std::any_of(hash.keyBegin(), hash.keyEnd(), [&mainMimeType](const QString& fullMimeType)
-//        {
-//            return fullMimeTypeHasMainType(fullMimeType, mainMimeType);
-//        });
-}
-
-bool QtClipboardData::hasMimeSubType(const std::string& mimeSubType, Mode mode)
-{
-    QtClipboardDataBase& dataObject = dataObjectForMode(mode);
-
-    const QString mimeSubTypeQString = QString::fromStdString(mimeSubType);
-
-    const auto& hash = dataObject.fullMimeTypeToDataMap();
-    return std::any_of(hash.keyBegin(), hash.keyEnd(), [&mimeSubTypeQString](const QString& fullMimeType)
-        {
-            return fullMimeTypeHasSubType(fullMimeType, mimeSubTypeQString);
-        });
-}
-
-bool QtClipboardData::hasFullMimeType(const std::string& fullMimeType, Mode mode)
-{
-    QtClipboardDataBase& dataObject = dataObjectForMode(mode);
-    return dataObject.fullMimeTypeToDataMap().contains(QString::fromStdString(fullMimeType));
-}
-
-std::optional<size_t> QtClipboardData::dataSize(const std::string& fullMimeType, Mode mode)
-{
-    QtClipboardDataBase& dataObject = dataObjectForMode(mode);
-    const auto& hash = dataObject.fullMimeTypeToDataMap();
-    auto it = hash.find(QString::fromStdString(fullMimeType));
-    if (it == hash.constEnd())
+    const QClipboard::Mode qtMode = mode == Mode::Selection ? QClipboard::Mode::Selection : QClipboard::Mode::Clipboard;
+    // Clipboard can only be accessed from the Qt thread. It takes ownership of mimeData
+    auto setClipboard = [mimeData, qtMode]() { QGuiApplication::clipboard()->setMimeData(mimeData, qtMode); };
+    if (QThread::currentThread() == m_qtApp.thread())
     {
-        return {};
+        setClipboard();
     }
-    return (*it).size();
-}
-
-std::optional<const std::vector<uint8_t>> QtClipboardData::mimeData(const std::string& fullMimeType, Mode mode)
-{
-    QtClipboardDataBase& dataObject = dataObjectForMode(mode);
-    const auto& hash = dataObject.fullMimeTypeToDataMap();
-    auto it = hash.find(QString::fromStdString(fullMimeType));
-    if (it == hash.constEnd())
+    else
     {
-        return {};
+        QMetaObject::invokeMethod(&m_qtApp, setClipboard, Qt::BlockingQueuedConnection);
     }
-    std::vector<uint8_t> result;
-    result.assign(it->cbegin(), it->cend());
-    return result;
 }
 
 QtClipboardDataBase& QtClipboardData::dataObjectForMode(ClipboardData::Mode mode)
@@ -1,44 +1,51 @@
 #pragma once
 
 #include "clipboardData.hpp"
+#include "formatConverter.hpp"
+#include "historyCompressor.hpp"
+#include "memoryBudget.hpp"
+#include "prefetcher.hpp"
 #include "qtClipboardDataBase.hpp"
 
+#include <mutex>
+
 class QtClipboardData : public ClipboardData
 {
   public:
     void run();
     void quit();
 
-    // Lock object so data won't change while using it.
-    // Must call before using any function below (any function not run() or and quit())
-    std::lock_guard<std::mutex> getLock(Mode mode = Mode::Clipboard);
-
-    bool hasData(Mode mode = Mode::Clipboard);
-
-    const std::vector<std::string> mainMimeTypes(Mode mode = Mode::Clipboard);
-    size_t mainMimeTypesCount(Mode mode);
-
-    const std::vector<std::string> mimeSubTypes(const std::string& mainMimeType, Mode mode = Mode::Clipboard);
-    size_t mimeSubTypesCount(const std::string& mainMimeType, Mode mode);
+    void setChangeCallback(ChangeCallback callback);
 
-    bool hasMainMimeType(const std::string& mainMimeType, Mode mode = Mode::Clipboard);
+    std::shared_ptr<const ClipboardSnapshot> snapshot(Mode mode = Mode::Clipboard);
+    std::shared_ptr<const ClipboardHistory::SnapshotList> history(Mode mode = Mode::Clipboard);
 
-    bool hasMimeSubType(const std::string& mimeSubType, Mode mode = Mode::Clipboard);
+    void setMimeData(const MimeDataList& formats, Mode mode = Mode::Clipboard);
 
-    bool hasFullMimeType(const std::string& fullMimeType, Mode mode = Mode::Clipboard);
-
-    // Optional has no data if no mimetype found
-    std::optional<size_t> dataSize(const std::string& fullMimeType, Mode mode = Mode::Clipboard);
-    std::optional<const std::vector<uint8_t>> mimeData(const std::string& fullMimeType, Mode mode = Mode::Clipboard);
-
-    QtClipboardData(int& argc, char** argv);
+    // History is only kept for the clipboard. The selection changes with every mouse selection, so its history would be mostly noise
+    QtClipboardData(int& argc, char** argv, const ClipboardDataOptions& options = ClipboardDataOptions());
     ~QtClipboardData();
 
   private:
+    // Declared before the clipboard data objects, which call the callback from their constructors
+    std::mutex m_changeCallbackMutex;
+    ChangeCallback m_changeCallback;
+    // Before the prefetcher, whose jobs can still hold snapshots when it is destroyed
+    MemoryBudget m_memoryBudget;
+    // Shared by the clipboard and the selection, which often hold the same data
+    BlobStore m_blobStore;
+
     QGuiApplication m_qtApp;
+    // After m_qtApp, so the image plugins it asks for are found in the application's plugin paths
+    FormatConverter m_formatConverter;
+    // After m_formatConverter, since prefetching converts hot converted formats
+    Prefetcher m_prefetcher;
+    HistoryCompressor m_historyCompressor;
     QtClipboardDataBase m_clipboardData;
     QtClipboardDataBase m_selectionData;
 
     QtClipboardDataBase& dataObjectForMode(ClipboardData::Mode mode);
+    void onClipboardChanged(Mode mode, const std::shared_ptr<const ClipboardSnapshot>& oldSnapshot,
+                            const std::shared_ptr<const ClipboardSnapshot>& newSnapshot);
 
 };
@@ -1,18 +1,39 @@
 #include "qtClipboardDataBase.hpp"
 
+#include "stats.hpp"
+
 #include <QMimeData>
+#include <QMetaObject>
+#include <QStringList>
+#include <QThread>
 
 namespace
 {
-bool fullMimeTypeHasMainMimeType(const QString& fullMimeType, const QString& mainMimeType)
+// QByteArray is implicitly shared, so holding a copy only increments its reference count
+// Only made from data the clipboard owner sent
+class QtMimeDataSnapshot : public MimeDataSnapshot
 {
-    // +2 to make sure there is room for a slash and at least one character after the slash
-    return fullMimeType.startsWith(mainMimeType) && fullMimeType.size() >= mainMimeType.size() + 2 &&
-           fullMimeType[mainMimeType.size()] == '/';
-}
+  public:
+    explicit QtMimeDataSnapshot(const QByteArray& data) : m_data(data)
+    {
+        Stats::add(Stats::Counter::FetchedBytes, m_data.size());
+    }
+
+    std::string_view data() const
+    {
+        return std::string_view(m_data.constData(), m_data.size());
+    }
+
+  private:
+    const QByteArray m_data;
+};
 } // namespace
 
-QtClipboardDataBase::QtClipboardDataBase(QClipboard::Mode mode)
+QtClipboardDataBase::QtClipboardDataBase(QClipboard::Mode mode, const ClipboardDataOptions& options, BlobStore& blobStore,
+                                         FormatConverter& formatConverter, Prefetcher& prefetcher, MemoryBudget& memoryBudget,
+                                         HistoryCompressor& historyCompressor, ChangeCallback changeCallback)
+    : m_mode(mode), m_lazy(options.fetchesLazily()), m_blobStore(blobStore), m_formatConverter(formatConverter), m_prefetcher(prefetcher),
+      m_memoryBudget(memoryBudget), m_historyCompressor(historyCompressor), m_changeCallback(std::move(changeCallback)), m_history(options.historyCount, options.historyBytes)
 {
     const QClipboard* clipboard = QGuiApplication::clipboard();
 
@@ -30,93 +51,97 @@ QtClipboardDataBase::QtClipboardDataBase(QClipboard::Mode mode)
     onClipboardChanged();
 }
 
-std::lock_guard<std::mutex> QtClipboardDataBase::getLock()
+std::shared_ptr<const ClipboardSnapshot> QtClipboardDataBase::snapshot() const
 {
-    return std::lock_guard(m_mutex);
+    return m_snapshot.load();
 }
 
-bool QtClipboardDataBase::hasData()
+std::shared_ptr<const ClipboardHistory::SnapshotList> QtClipboardDataBase::history() const
 {
-    return m_fullMimeTypeToDataMap.size() != 0;
+    return m_history.snapshots();
 }
 
-std::optional<size_t> QtClipboardDataBase::dataSize(const QString& fullMimeType)
+std::shared_ptr<const MimeDataSnapshot> QtClipboardDataBase::fetchMimeData(const QString& fullMimeType, uint64_t generation)
 {
-    auto it = m_fullMimeTypeToDataMap.constFind(fullMimeType);
-    if (it != m_fullMimeTypeToDataMap.cend())
+    std::shared_ptr<const MimeDataSnapshot> result;
+    // Clipboard can only be accessed from the Qt thread
+    if (QThread::currentThread() == QGuiApplication::instance()->thread())
     {
-        return (*it).size();
+        result = fetchMimeDataInQtThread(fullMimeType, generation);
     }
     else
     {
-        return {};
+        QMetaObject::invokeMethod(
+            QGuiApplication::instance(), [this, &fullMimeType, generation, &result]() { result = fetchMimeDataInQtThread(fullMimeType, generation); },
+            Qt::BlockingQueuedConnection);
     }
+    // Interned by the reader, so the Qt thread only transfers the data and isn't held up hashing it
+    return result ? m_blobStore.intern(std::move(result)) : nullptr;
 }
 
-const QHash<QString, QByteArray>& QtClipboardDataBase::fullMimeTypeToDataMap()
+std::shared_ptr<const MimeDataSnapshot> QtClipboardDataBase::fetchMimeDataInQtThread(const QString& fullMimeType, uint64_t generation)
 {
-    return m_fullMimeTypeToDataMap;
-}
-
-const QSet<QString>& QtClipboardDataBase::mainMimeTypes()
-{
-    return m_mainMimeTypes;
-}
-
-#if 0
-bool QtClipboardDataBase::hasMimeSubType(const QString& mimeSubType)
-{
-    for (const QString& fullMimeType : std::as_const(m_fullMimeTypeToDataMap))
+    // Clipboard changed since the snapshot was made, so its data is gone
+    if (generation != m_generation)
     {
-        if (fullMimeType.endsWith(mimeSubType) && fullMimeType.size() >= mimeSubType.size() + 2 && fullMimeType[fullMimeType.size() - 1 - mimeSubType.size()] == '/')
-        {
-            return true;
-        }
+        return nullptr;
     }
-    return false;
+    const QMimeData* mimeData = QGuiApplication::clipboard()->mimeData(m_mode);
+    return std::make_shared<QtMimeDataSnapshot>(mimeData ? mimeData->data(fullMimeType) : QByteArray());
 }
 
-bool QtClipboardDataBase::hasFullMimeType(const QString& fullMimeType)
-{
-    return m_fullMimeTypeToDataMap.contains(fullMimeType);
-}
-#endif
-const QByteArray* QtClipboardDataBase::mimeData(const QString& fullMimeType)
+void QtClipboardDataBase::onClipboardChanged()
 {
-    auto it = m_fullMimeTypeToDataMap.constFind(fullMimeType);
-    if (it != m_fullMimeTypeToDataMap.constEnd())
+    const Stats::ScopedTimer timer(Stats::Timer::ClipboardChange);
+    // New snapshot is built without blocking readers of the old one, then published at once
+    const uint64_t generation = ++m_generation;
+    // Even if formats aren't lazy, since data the memory budget dropped is fetched again
+    ClipboardSnapshot::Fetcher fetcher = [this, generation](const std::string& fullMimeType)
     {
-        return &(*it);
-    }
-    return nullptr;
-}
+        return fetchMimeData(QString::fromStdString(fullMimeType), generation);
+    };
+    auto snapshot = std::make_shared<ClipboardSnapshot>(generation, std::move(fetcher), &m_memoryBudget);
 
-void QtClipboardDataBase::onClipboardChanged()
-{
-    std::lock_guard lock(m_mutex);
     const QClipboard* clipboard = QGuiApplication::clipboard();
-    const QMimeData* mimeData = clipboard->mimeData();
-    const QStringList formats = mimeData->formats();
-    m_fullMimeTypeToDataMap.clear();
-    m_fullMimeTypeToDataMap.reserve(formats.size());
-    m_mainMimeTypes.clear();
-
+    const QMimeData* mimeData = clipboard->mimeData(m_mode);
+    const QStringList formats = mimeData ? mimeData->formats() : QStringList();
     for (auto it = formats.constBegin(); it != formats.constEnd(); ++it)
     {
         const QString& fullMimeType = *it;
-        auto slashIndex = fullMimeType.indexOf('/');
-        if (slashIndex == -1)
+        if (fullMimeType.indexOf('/') == -1)
         {
             continue;
         }
 
+        std::shared_ptr<const MimeDataSnapshot> data;
+        if (!m_lazy)
         {
-            QString mainMimeType = fullMimeType.first(slashIndex);
-            m_mainMimeTypes.insert(std::move(mainMimeType));
-            QByteArray data = mimeData->data(fullMimeType);
-            m_fullMimeTypeToDataMap.insert(fullMimeType, std::move(data));
+            data = m_blobStore.intern(std::make_shared<QtMimeDataSnapshot>(mimeData->data(fullMimeType)));
         }
+        snapshot->addMimeType(fullMimeType.toStdString(), std::move(data));
     }
-}
-
+    m_formatConverter.addConvertedFormats(*snapshot);
 
+    std::shared_ptr<const ClipboardSnapshot> newSnapshot(std::move(snapshot));
+    std::shared_ptr<const ClipboardSnapshot> oldSnapshot = m_snapshot.exchange(newSnapshot);
+    if (oldSnapshot)
+    {
+        oldSnapshot->retire();
+        m_historyCompressor.compressLater(oldSnapshot);
+    }
+    m_history.push(newSnapshot);
+    if (m_changeCallback)
+    {
+        m_changeCallback(oldSnapshot, newSnapshot);
+    }
+    // Transferred while the owner is known to be the same. Only the transfers are done here, the rest on the prefetcher's workers
+    if (mimeData && m_prefetcher.isEnabled())
+    {
+        m_prefetcher.prefetch(newSnapshot,
+                              [mimeData](const std::string& fullMimeType)
+                              {
+                                  return std::make_shared<QtMimeDataSnapshot>(mimeData->data(QString::fromStdString(fullMimeType)));
+                              },
+                              &m_blobStore);
+    }
+}
@@ -1,39 +1,65 @@
 #pragma once
 
+#include "blobStore.hpp"
+#include "clipboardData.hpp"
+#include "clipboardHistory.hpp"
+#include "clipboardSnapshot.hpp"
+#include "formatConverter.hpp"
+#include "historyCompressor.hpp"
+#include "memoryBudget.hpp"
+#include "prefetcher.hpp"
+#include "publishedPtr.hpp"
+
 #include <QByteArray>
 #include <QClipboard>
 #include <QGuiApplication>
-#include <QHash>
 #include <QObject>
-#include <QSet>
 #include <QString>
 
+#include <cstdint>
 #include <functional> // std::bind
-#include <mutex>
-#include <optional>
+#include <memory>
 
 class QtClipboardDataBase
 {
   public:
-    QtClipboardDataBase(QClipboard::Mode mode);
-
-    // Consider QReadWriteLock
-    std::lock_guard<std::mutex> getLock();
+    // Called after every new snapshot is published, with the old and new snapshot
+    using ChangeCallback = std::function<void(const std::shared_ptr<const ClipboardSnapshot>& oldSnapshot,
+                                              const std::shared_ptr<const ClipboardSnapshot>& newSnapshot)>;
 
-    bool hasData();
-    std::optional<size_t> dataSize(const QString& fullMimeType);
+    // If options.lazy, only the list of formats is read when the clipboard changes
+    // The data of a format is fetched the first time it is needed, then cached until the clipboard changes
+    // All data is interned in blobStore, converted formats are added by formatConverter, hot formats are prefetched by prefetcher,
+    // the data kept is limited by memoryBudget, and replaced snapshots are compressed by historyCompressor
+    // They must all outlive this object
+    QtClipboardDataBase(QClipboard::Mode mode, const ClipboardDataOptions& options, BlobStore& blobStore, FormatConverter& formatConverter,
+                        Prefetcher& prefetcher, MemoryBudget& memoryBudget, HistoryCompressor& historyCompressor,
+                        ChangeCallback changeCallback = nullptr);
 
-    const QHash<QString, QByteArray>& fullMimeTypeToDataMap();
-    const QSet<QString>& mainMimeTypes();
-
-    // Pointer only valid while lock is held
-    // Null pointer indicates no data
-    const QByteArray* mimeData(const QString& fullMimeType);
+    // Current contents of the clipboard. Never blocks, even while the clipboard is changing
+    std::shared_ptr<const ClipboardSnapshot> snapshot() const;
+    // Most recent snapshots, most recent first
+    std::shared_ptr<const ClipboardHistory::SnapshotList> history() const;
 
   private:
-    std::mutex m_mutex;
-    QHash<QString, QByteArray> m_fullMimeTypeToDataMap;
-    QSet<QString> m_mainMimeTypes;
+    const QClipboard::Mode m_mode;
+    const bool m_lazy;
+    BlobStore& m_blobStore;
+    FormatConverter& m_formatConverter;
+    Prefetcher& m_prefetcher;
+    MemoryBudget& m_memoryBudget;
+    HistoryCompressor& m_historyCompressor;
+    const ChangeCallback m_changeCallback;
+    ClipboardHistory m_history;
+
+    // Replaced by onClipboardChanged() on the Qt thread after the new snapshot is fully built
+    PublishedPtr<const ClipboardSnapshot> m_snapshot;
+    // Incremented on every clipboard change. Only used from the Qt thread
+    uint64_t m_generation = 0;
 
     void onClipboardChanged();
+    // Fetcher of the snapshots. Can be called from any thread
+    std::shared_ptr<const MimeDataSnapshot> fetchMimeData(const QString& fullMimeType, uint64_t generation);
+    // Must be called from the Qt thread. The data isn't interned yet
+    std::shared_ptr<const MimeDataSnapshot> fetchMimeDataInQtThread(const QString& fullMimeType, uint64_t generation);
 };
@@ -0,0 +1,128 @@
+#include "stagingArea.hpp"
+
+#include <cerrno>
+#include <utility> // std::move
+
+bool StagingArea::hasDirectory(std::string_view mainMimeType) const
+{
+    std::lock_guard lock(m_mutex);
+    return m_directories.find(mainMimeType) != m_directories.end();
+}
+
+std::optional<std::vector<std::string>> StagingArea::fileNames(std::string_view mainMimeType) const
+{
+    std::lock_guard lock(m_mutex);
+    auto it = m_directories.find(mainMimeType);
+    if (it == m_directories.end())
+    {
+        return {};
+    }
+    std::vector<std::string> names;
+    names.reserve(it->second.size());
+    for (const auto& [fileName, data] : it->second)
+    {
+        names.push_back(fileName);
+    }
+    return names;
+}
+
+std::vector<std::string> StagingArea::directoryNames() const
+{
+    std::lock_guard lock(m_mutex);
+    std::vector<std::string> names;
+    names.reserve(m_directories.size());
+    for (const auto& [mainMimeType, files] : m_directories)
+    {
+        names.push_back(mainMimeType);
+    }
+    return names;
+}
+
+size_t StagingArea::directoriesCount() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_directories.size();
+}
+
+std::shared_ptr<const MimeDataSnapshot> StagingArea::data(std::string_view mainMimeType, std::string_view fileName) const
+{
+    std::lock_guard lock(m_mutex);
+    auto directoryIt = m_directories.find(mainMimeType);
+    if (directoryIt == m_directories.end())
+    {
+        return nullptr;
+    }
+    auto fileIt = directoryIt->second.find(fileName);
+    if (fileIt == directoryIt->second.end())
+    {
+        return nullptr;
+    }
+    return fileIt->second;
+}
+
+bool StagingArea::addDirectory(std::string_view mainMimeType)
+{
+    std::lock_guard lock(m_mutex);
+    return m_directories.emplace(mainMimeType, Files()).second;
+}
+
+int StagingArea::removeDirectory(std::string_view mainMimeType)
+{
+    std::lock_guard lock(m_mutex);
+    auto it = m_directories.find(mainMimeType);
+    if (it == m_directories.end())
+    {
+        return -ENOENT;
+    }
+    if (!it->second.empty())
+    {
+        return -ENOTEMPTY;
+    }
+    m_directories.erase(it);
+    return 0;
+}
+
+void StagingArea::stage(std::string_view mainMimeType, std::string_view fileName, std::shared_ptr<const MimeDataSnapshot> data)
+{
+    std::lock_guard lock(m_mutex);
+    auto directoryIt = m_directories.find(mainMimeType);
+    if (directoryIt == m_directories.end())
+    {
+        directoryIt = m_directories.emplace(mainMimeType, Files()).first;
+    }
+    Files& files = directoryIt->second;
+    auto fileIt = files.find(fileName);
+    if (fileIt == files.end())
+    {
+        files.emplace(fileName, std::move(data));
+    }
+    else
+    {
+        fileIt->second = std::move(data);
+    }
+}
+
+bool StagingArea::unstage(std::string_view mainMimeType, std::string_view fileName)
+{
+    std::lock_guard lock(m_mutex);
+    auto directoryIt = m_directories.find(mainMimeType);
+    if (directoryIt == m_directories.end())
+    {
+        return false;
+    }
+    auto fileIt = directoryIt->second.find(fileName);
+    if (fileIt == directoryIt->second.end())
+    {
+        return false;
+    }
+    directoryIt->second.erase(fileIt);
+    return true;
+}
+
+StagingArea::Directories StagingArea::take()
+{
+    std::lock_guard lock(m_mutex);
+    Directories directories = std::move(m_directories);
+    m_directories.clear();
+    return directories;
+}
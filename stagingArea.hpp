@@ -0,0 +1,51 @@
+#pragma once
+
+#include "clipboardSnapshot.hpp"
+#include "stats.hpp"
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Formats written to the staging directory, waiting to be published to the clipboard together
+// Laid out like a clipboard snapshot, main mime type directories containing {BASE_FILE_NAME}.{mime subtype} files
+// Can be used from any thread
+class StagingArea
+{
+public:
+    // File name to its data
+    using Files = std::map<std::string, std::shared_ptr<const MimeDataSnapshot>, std::less<>>;
+    // Main mime type to its files
+    using Directories = std::map<std::string, Files, std::less<>>;
+
+    bool hasDirectory(std::string_view mainMimeType) const;
+    // Optional has no data if there is no such directory
+    std::optional<std::vector<std::string>> fileNames(std::string_view mainMimeType) const;
+    std::vector<std::string> directoryNames() const;
+    size_t directoriesCount() const;
+
+    // Null pointer if there is no such file
+    std::shared_ptr<const MimeDataSnapshot> data(std::string_view mainMimeType, std::string_view fileName) const;
+
+    // Returns false if the directory already exists
+    bool addDirectory(std::string_view mainMimeType);
+    // Returns 0, or -ENOENT or -ENOTEMPTY
+    int removeDirectory(std::string_view mainMimeType);
+
+    // Adds or replaces a file, adding its directory if needed
+    void stage(std::string_view mainMimeType, std::string_view fileName, std::shared_ptr<const MimeDataSnapshot> data);
+    // Returns false if there is no such file
+    bool unstage(std::string_view mainMimeType, std::string_view fileName);
+
+    // Removes and returns everything that was staged
+    Directories take();
+
+private:
+    mutable Stats::TimedMutex m_mutex;
+    Directories m_directories;
+};
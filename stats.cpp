@@ -0,0 +1,288 @@
+#include "stats.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+constexpr size_t TIMERS_COUNT = static_cast<size_t>(Stats::Timer::Count);
+constexpr size_t COUNTERS_COUNT = static_cast<size_t>(Stats::Counter::Count);
+constexpr size_t GAUGES_COUNT = static_cast<size_t>(Stats::Gauge::Count);
+
+constexpr std::array<std::string_view, TIMERS_COUNT> TIMER_NAMES = {
+    "getattr", "lookup", "readdir", "open", "read", "write", "release", "clipboard_change", "fetch", "convert", "compress", "lock_wait",
+};
+constexpr std::array<std::string_view, COUNTERS_COUNT> COUNTER_NAMES = {
+    "fetched_bytes", "data_cache_hits", "data_cache_misses", "blob_store_hits", "blob_store_misses", "evicted_bytes", "compressed_bytes",
+};
+constexpr std::array<std::string_view, GAUGES_COUNT> GAUGE_NAMES = {
+    "cached_bytes",
+};
+
+struct TimerValues
+{
+    std::array<uint64_t, Stats::BUCKETS_COUNT> buckets = {};
+    uint64_t totalNanoseconds = 0;
+    uint64_t maxNanoseconds = 0;
+};
+
+struct Values
+{
+    std::array<TimerValues, TIMERS_COUNT> timers;
+    std::array<uint64_t, COUNTERS_COUNT> counters = {};
+};
+
+// Counters of one thread. Only written by that thread, so an increment is a load and a store instead of a locked add
+// Atomic so other threads can read them while they are written
+struct Shard
+{
+    struct Timer
+    {
+        std::array<std::atomic<uint64_t>, Stats::BUCKETS_COUNT> buckets = {};
+        std::atomic<uint64_t> totalNanoseconds = 0;
+        std::atomic<uint64_t> maxNanoseconds = 0;
+    };
+
+    std::array<Timer, TIMERS_COUNT> timers;
+    std::array<std::atomic<uint64_t>, COUNTERS_COUNT> counters = {};
+
+    void addTo(Values& values) const
+    {
+        for (size_t i = 0; i < TIMERS_COUNT; ++i)
+        {
+            for (size_t bucket = 0; bucket < Stats::BUCKETS_COUNT; ++bucket)
+            {
+                values.timers[i].buckets[bucket] += timers[i].buckets[bucket].load(std::memory_order_relaxed);
+            }
+            values.timers[i].totalNanoseconds += timers[i].totalNanoseconds.load(std::memory_order_relaxed);
+            values.timers[i].maxNanoseconds =
+                std::max(values.timers[i].maxNanoseconds, timers[i].maxNanoseconds.load(std::memory_order_relaxed));
+        }
+        for (size_t i = 0; i < COUNTERS_COUNT; ++i)
+        {
+            values.counters[i] += counters[i].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+void increase(std::atomic<uint64_t>& value, uint64_t amount)
+{
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// Shards of the running threads, and what the threads that exited recorded
+struct Registry
+{
+    std::mutex mutex;
+    std::vector<const Shard*> shards;
+    Values exitedThreads;
+};
+
+Registry& registry()
+{
+    // Never destroyed, since threads can exit after static objects are destroyed
+    static auto* registry = new Registry();
+    return *registry;
+}
+
+// Registers the shard of a thread when the thread first records something, and keeps what it recorded when the thread exits
+struct ShardOwner
+{
+    Shard shard;
+
+    ShardOwner()
+    {
+        Registry& registry = ::registry();
+        std::lock_guard lock(registry.mutex);
+        registry.shards.push_back(&shard);
+    }
+
+    ~ShardOwner()
+    {
+        Registry& registry = ::registry();
+        std::lock_guard lock(registry.mutex);
+        shard.addTo(registry.exitedThreads);
+        registry.shards.erase(std::find(registry.shards.begin(), registry.shards.end(), &shard));
+    }
+};
+
+// Shared by all threads instead of sharded, since gauges only change when data is stored or freed, which is rare next to reads
+std::array<std::atomic<int64_t>, GAUGES_COUNT> gauges = {};
+
+Shard& threadShard()
+{
+    // Plain pointer, so checking it doesn't go through the guard of a thread_local with a destructor
+    thread_local Shard* shard = nullptr;
+    if (!shard)
+    {
+        thread_local ShardOwner owner;
+        shard = &owner.shard;
+    }
+    return *shard;
+}
+
+Values collect()
+{
+    Registry& registry = ::registry();
+    std::lock_guard lock(registry.mutex);
+    Values values = registry.exitedThreads;
+    for (const Shard* shard : registry.shards)
+    {
+        shard->addTo(values);
+    }
+    return values;
+}
+
+uint64_t count(const TimerValues& timer)
+{
+    uint64_t count = 0;
+    for (uint64_t bucketCount : timer.buckets)
+    {
+        count += bucketCount;
+    }
+    return count;
+}
+
+// Upper bound of the bucket that has the duration at fraction of the recorded durations. 0 if nothing was recorded
+uint64_t percentileNanoseconds(const TimerValues& timer, uint64_t count, double fraction)
+{
+    const auto rank = static_cast<uint64_t>(static_cast<double>(count) * fraction);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < Stats::BUCKETS_COUNT; ++bucket)
+    {
+        seen += timer.buckets[bucket];
+        if (seen > rank)
+        {
+            return std::min(uint64_t(2) << bucket, timer.maxNanoseconds);
+        }
+    }
+    return timer.maxNanoseconds;
+}
+
+// Fraction of hits, or 0 if there weren't any hits or misses
+double hitRate(const Values& values, Stats::Counter hits, Stats::Counter misses)
+{
+    const uint64_t hitsCount = values.counters[static_cast<size_t>(hits)];
+    const uint64_t total = hitsCount + values.counters[static_cast<size_t>(misses)];
+    return total ? static_cast<double>(hitsCount) / static_cast<double>(total) : 0.0;
+}
+
+void appendFormat(std::string& text, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void appendFormat(std::string& text, const char* format, ...)
+{
+    std::array<char, 256> buffer;
+    va_list arguments;
+    va_start(arguments, format);
+    const int length = std::vsnprintf(buffer.data(), buffer.size(), format, arguments);
+    va_end(arguments);
+    if (length > 0)
+    {
+        text.append(buffer.data(), std::min(static_cast<size_t>(length), buffer.size() - 1));
+    }
+}
+} // namespace
+
+namespace Stats
+{
+void record(Timer timer, std::chrono::nanoseconds duration)
+{
+    const auto nanoseconds = static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0));
+    // Index of the highest set bit. | 1 puts 0 ns in the first bucket, since __builtin_clzll(0) is undefined
+    const size_t bucket = std::min<size_t>(63 - __builtin_clzll(nanoseconds | 1), BUCKETS_COUNT - 1);
+    Shard::Timer& shardTimer = threadShard().timers[static_cast<size_t>(timer)];
+    increase(shardTimer.buckets[bucket], 1);
+    increase(shardTimer.totalNanoseconds, nanoseconds);
+    if (nanoseconds > shardTimer.maxNanoseconds.load(std::memory_order_relaxed))
+    {
+        shardTimer.maxNanoseconds.store(nanoseconds, std::memory_order_relaxed);
+    }
+}
+
+void add(Counter counter, uint64_t value)
+{
+    increase(threadShard().counters[static_cast<size_t>(counter)], value);
+}
+
+void adjust(Gauge gauge, int64_t delta)
+{
+    gauges[static_cast<size_t>(gauge)].fetch_add(delta, std::memory_order_relaxed);
+}
+
+std::string renderText()
+{
+    const Values values = collect();
+    std::string text;
+    appendFormat(text, "# Latency in microseconds. Percentiles are rounded up to a power of two nanoseconds\n");
+    appendFormat(text, "%-20s %12s %12s %12s %12s %12s %12s\n", "timer", "count", "mean", "p50", "p90", "p99", "max");
+    for (size_t i = 0; i < TIMERS_COUNT; ++i)
+    {
+        const TimerValues& timer = values.timers[i];
+        const uint64_t timerCount = count(timer);
+        const double mean = timerCount ? static_cast<double>(timer.totalNanoseconds) / static_cast<double>(timerCount) : 0.0;
+        appendFormat(text, "%-20s %12llu %12.3f %12.3f %12.3f %12.3f %12.3f\n", TIMER_NAMES[i].data(),
+                     static_cast<unsigned long long>(timerCount), mean / 1000,
+                     static_cast<double>(percentileNanoseconds(timer, timerCount, 0.5)) / 1000,
+                     static_cast<double>(percentileNanoseconds(timer, timerCount, 0.9)) / 1000,
+                     static_cast<double>(percentileNanoseconds(timer, timerCount, 0.99)) / 1000,
+                     static_cast<double>(timer.maxNanoseconds) / 1000);
+    }
+    text += '\n';
+    for (size_t i = 0; i < COUNTERS_COUNT; ++i)
+    {
+        appendFormat(text, "%-20s %12llu\n", COUNTER_NAMES[i].data(), static_cast<unsigned long long>(values.counters[i]));
+    }
+    appendFormat(text, "%-20s %12.3f\n", "data_cache_hit_rate", hitRate(values, Counter::DataCacheHits, Counter::DataCacheMisses));
+    appendFormat(text, "%-20s %12.3f\n", "blob_store_hit_rate", hitRate(values, Counter::BlobStoreHits, Counter::BlobStoreMisses));
+    for (size_t i = 0; i < GAUGES_COUNT; ++i)
+    {
+        appendFormat(text, "%-20s %12lld\n", GAUGE_NAMES[i].data(), static_cast<long long>(gauges[i].load(std::memory_order_relaxed)));
+    }
+    return text;
+}
+
+std::string renderJson()
+{
+    const Values values = collect();
+    std::string json = "{\"timers\":{";
+    for (size_t i = 0; i < TIMERS_COUNT; ++i)
+    {
+        const TimerValues& timer = values.timers[i];
+        const uint64_t timerCount = count(timer);
+        appendFormat(json, "%s\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,",
+                     i ? "," : "", TIMER_NAMES[i].data(), static_cast<unsigned long long>(timerCount),
+                     static_cast<unsigned long long>(timer.totalNanoseconds),
+                     static_cast<unsigned long long>(percentileNanoseconds(timer, timerCount, 0.5)),
+                     static_cast<unsigned long long>(percentileNanoseconds(timer, timerCount, 0.9)),
+                     static_cast<unsigned long long>(percentileNanoseconds(timer, timerCount, 0.99)),
+                     static_cast<unsigned long long>(timer.maxNanoseconds));
+        // Bucket i counts durations in [2^i, 2^(i+1)) ns
+        json += "\"buckets\":[";
+        for (size_t bucket = 0; bucket < BUCKETS_COUNT; ++bucket)
+        {
+            appendFormat(json, "%s%llu", bucket ? "," : "", static_cast<unsigned long long>(timer.buckets[bucket]));
+        }
+        json += "]}";
+    }
+    json += "},\"counters\":{";
+    for (size_t i = 0; i < COUNTERS_COUNT; ++i)
+    {
+        appendFormat(json, "%s\"%s\":%llu", i ? "," : "", COUNTER_NAMES[i].data(), static_cast<unsigned long long>(values.counters[i]));
+    }
+    json += "},\"gauges\":{";
+    for (size_t i = 0; i < GAUGES_COUNT; ++i)
+    {
+        appendFormat(json, "%s\"%s\":%lld", i ? "," : "", GAUGE_NAMES[i].data(), static_cast<long long>(gauges[i].load(std::memory_order_relaxed)));
+    }
+    appendFormat(json, "},\"hit_rates\":{\"data_cache\":%.6f,\"blob_store\":%.6f}}\n",
+                 hitRate(values, Counter::DataCacheHits, Counter::DataCacheMisses),
+                 hitRate(values, Counter::BlobStoreHits, Counter::BlobStoreMisses));
+    return json;
+}
+}
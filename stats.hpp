@@ -0,0 +1,136 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Counters and latency histograms of the whole process, read from /.stats and /.stats.json
+// Every thread records into its own counters, so recording never waits for another thread and never shares a cache line
+// The counters of all threads are only added up when the stats are read
+namespace Stats
+{
+enum class Timer
+{
+    GetAttr,
+    Lookup,
+    ReadDir,
+    Open,
+    Read,
+    Write,
+    Release,
+    // Handling a change of the clipboard, from reading its formats to publishing the snapshot and starting prefetches
+    ClipboardChange,
+    // Fetching one format from the clipboard owner
+    Fetch,
+    // Converting one format to another
+    Convert,
+    // Compressing one payload of a snapshot that was replaced
+    Compress,
+    // Waiting for a lock that another thread held
+    LockWait,
+    Count,
+};
+
+enum class Counter
+{
+    // Bytes received from clipboard owners, whether read or prefetched
+    FetchedBytes,
+    // Data of a snapshot that was read after it was already fetched, or that had to be fetched first
+    DataCacheHits,
+    DataCacheMisses,
+    // Payloads that were already stored with the same bytes, or were stored
+    BlobStoreHits,
+    BlobStoreMisses,
+    // Bytes of data evicted by the memory budget
+    EvictedBytes,
+    // Bytes of history payloads that were compressed, counted before compressing
+    CompressedBytes,
+    Count,
+};
+
+// Values that go down as well as up, shared by all threads. Only changed when something is stored or freed, not on every read
+enum class Gauge
+{
+    // Bytes of data counted by the memory budget
+    CachedBytes,
+    Count,
+};
+
+// Durations are put in buckets by their power of two in nanoseconds, so bucket i has durations in [2^i, 2^(i+1)) ns
+constexpr size_t BUCKETS_COUNT = 40;
+
+void record(Timer timer, std::chrono::nanoseconds duration);
+void add(Counter counter, uint64_t value = 1);
+void adjust(Gauge gauge, int64_t delta);
+
+// Records the time from its construction to its destruction
+class ScopedTimer
+{
+  public:
+    explicit ScopedTimer(Timer timer) : m_timer(timer), m_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~ScopedTimer()
+    {
+        record(m_timer, std::chrono::steady_clock::now() - m_start);
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+  private:
+    const Timer m_timer;
+    const std::chrono::steady_clock::time_point m_start;
+};
+
+// Function that times function, for tables of callbacks like fuse_operations
+// Its type is given, so function can be overloaded, like open(): Timed<Timer::Open, decltype(operations.open), open>::call
+template <Timer timer, typename Function, Function function>
+struct Timed;
+
+template <Timer timer, typename Result, typename... Args, Result (*function)(Args...)>
+struct Timed<timer, Result (*)(Args...), function>
+{
+    static Result call(Args... args)
+    {
+        const ScopedTimer scopedTimer(timer);
+        return function(args...);
+    }
+};
+
+// std::mutex that records how long lock() waited when the mutex was held by another thread
+// Uncontended locking only costs a try_lock, so it isn't timed
+class TimedMutex
+{
+  public:
+    void lock()
+    {
+        if (!m_mutex.try_lock())
+        {
+            const ScopedTimer scopedTimer(Timer::LockWait);
+            m_mutex.lock();
+        }
+    }
+
+    bool try_lock()
+    {
+        return m_mutex.try_lock();
+    }
+
+    void unlock()
+    {
+        m_mutex.unlock();
+    }
+
+  private:
+    std::mutex m_mutex;
+};
+
+// Counters and histograms of all threads so far, as lines of text
+std::string renderText();
+// Same as renderText() as a JSON object
+std::string renderJson();
+}
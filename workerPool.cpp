@@ -0,0 +1,58 @@
+#include "workerPool.hpp"
+
+#include <algorithm> // std::max
+#include <utility>   // std::move
+
+WorkerPool::WorkerPool(size_t threadsCount)
+{
+    for (size_t i = 0; i < threadsCount; ++i)
+    {
+        m_threads.emplace_back(&WorkerPool::runThread, this);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard lock(m_jobsMutex);
+        m_quit = true;
+    }
+    m_jobsCondition.notify_all();
+    for (std::thread& thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+void WorkerPool::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard lock(m_jobsMutex);
+        m_jobs.push_back(std::move(job));
+    }
+    m_jobsCondition.notify_one();
+}
+
+size_t WorkerPool::defaultThreadsCount(size_t poolsCount)
+{
+    return std::max<size_t>(1, std::thread::hardware_concurrency() / 2 / std::max<size_t>(1, poolsCount));
+}
+
+void WorkerPool::runThread()
+{
+    while (true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock lock(m_jobsMutex);
+            m_jobsCondition.wait(lock, [this]() { return m_quit || !m_jobs.empty(); });
+            if (m_jobs.empty())
+            {
+                return;
+            }
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        job();
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed number of threads that run submitted jobs in the order they were submitted
+class WorkerPool
+{
+public:
+    explicit WorkerPool(size_t threadsCount);
+    // Runs the jobs that were already submitted, since someone may wait for them, then stops the threads
+    ~WorkerPool();
+
+    // Can be called from any thread, but not from a job that is then waited for by another job, or the pool can run out of threads
+    void submit(std::function<void()> job);
+
+    // Work in the background is CPU bound, but shouldn't take every core from the applications the clipboard is for
+    // Split between poolsCount pools that are busy at the same time, since they can't share threads when jobs of one wait for the other
+    static size_t defaultThreadsCount(size_t poolsCount = 1);
+
+private:
+    std::mutex m_jobsMutex;
+    std::condition_variable m_jobsCondition;
+    std::deque<std::function<void()>> m_jobs;
+    bool m_quit = false;
+    std::vector<std::thread> m_threads;
+
+    void runThread();
+};
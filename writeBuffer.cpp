@@ -0,0 +1,110 @@
+#include "writeBuffer.hpp"
+
+#include <algorithm>
+#include <cstring> // std::memcpy, std::memset
+#include <new> // std::bad_alloc
+#include <string>
+#include <utility> // std::move
+
+WriteBuffer::WriteBuffer(std::string_view data)
+{
+    write(data.data(), data.size(), 0);
+}
+
+size_t WriteBuffer::size() const
+{
+    return m_size;
+}
+
+bool WriteBuffer::write(const char* buf, size_t size, off_t offset)
+{
+    // Checked before adding, so the end can't overflow
+    if (offset < 0 || size > MAX_SIZE || static_cast<size_t>(offset) > MAX_SIZE - size)
+    {
+        return false;
+    }
+    const size_t end = static_cast<size_t>(offset) + size;
+    if (end > m_size)
+    {
+        truncate(end);
+    }
+    size_t position = static_cast<size_t>(offset);
+    while (size > 0)
+    {
+        const size_t chunkOffset = position % CHUNK_SIZE;
+        const size_t copySize = std::min(size, CHUNK_SIZE - chunkOffset);
+        std::memcpy(m_chunks[position / CHUNK_SIZE].get() + chunkOffset, buf, copySize);
+        buf += copySize;
+        position += copySize;
+        size -= copySize;
+    }
+    return true;
+}
+
+bool WriteBuffer::truncate(size_t size)
+{
+    if (size > MAX_SIZE)
+    {
+        return false;
+    }
+    // Round up to whole chunks
+    const size_t chunkCount = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (size < m_size)
+    {
+        m_chunks.resize(chunkCount);
+        m_size = size;
+        return true;
+    }
+    // Bytes between the old and new end must read as zeros, including the rest of the old last chunk
+    if (m_size % CHUNK_SIZE != 0)
+    {
+        const size_t chunkOffset = m_size % CHUNK_SIZE;
+        std::memset(m_chunks.back().get() + chunkOffset, 0, CHUNK_SIZE - chunkOffset);
+    }
+    const size_t oldChunkCount = m_chunks.size();
+    try
+    {
+        m_chunks.reserve(chunkCount);
+        while (m_chunks.size() < chunkCount)
+        {
+            // Value initialized, so new chunks are zeroed
+            m_chunks.push_back(std::make_unique<char[]>(CHUNK_SIZE));
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        // Chunks past the end would otherwise be reused later without being zeroed
+        m_chunks.resize(oldChunkCount);
+        throw;
+    }
+    m_size = size;
+    return true;
+}
+
+size_t WriteBuffer::read(char* buf, size_t size, off_t offset) const
+{
+    if (offset < 0 || static_cast<size_t>(offset) >= m_size)
+    {
+        return 0;
+    }
+    size = std::min(size, m_size - static_cast<size_t>(offset));
+    size_t position = static_cast<size_t>(offset);
+    size_t remaining = size;
+    while (remaining > 0)
+    {
+        const size_t chunkOffset = position % CHUNK_SIZE;
+        const size_t copySize = std::min(remaining, CHUNK_SIZE - chunkOffset);
+        std::memcpy(buf, m_chunks[position / CHUNK_SIZE].get() + chunkOffset, copySize);
+        buf += copySize;
+        position += copySize;
+        remaining -= copySize;
+    }
+    return size;
+}
+
+std::shared_ptr<const MimeDataSnapshot> WriteBuffer::toSnapshot() const
+{
+    std::string data(m_size, '\0');
+    read(data.data(), m_size, 0);
+    return std::make_shared<StringMimeDataSnapshot>(std::move(data));
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "clipboardSnapshot.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <sys/types.h> // off_t
+#include <vector>
+
+// Growable buffer for data written to a file before it is published
+// Stored as fixed size chunks, so writes never move data that was already written, and a large file streams in without quadratic copying
+// Not thread safe. Each open file has its own buffer
+class WriteBuffer
+{
+public:
+    // Largest size a file can be written or truncated to, so a bad offset can't exhaust memory
+    static constexpr size_t MAX_SIZE = size_t(4) << 30;
+
+    WriteBuffer() = default;
+    // Starts with a copy of data, for files opened for writing without truncating
+    explicit WriteBuffer(std::string_view data);
+
+    size_t size() const;
+
+    // Writes past the end fill the gap with zeros
+    // Both return false and leave the buffer unchanged if it would grow past MAX_SIZE
+    // Throw std::bad_alloc if memory runs out, also leaving the buffer unchanged
+    bool write(const char* buf, size_t size, off_t offset);
+    bool truncate(size_t size);
+
+    // Returns number of bytes copied, which is 0 if offset is at or past the end
+    size_t read(char* buf, size_t size, off_t offset) const;
+
+    // Copies the data into one contiguous, immutable snapshot
+    std::shared_ptr<const MimeDataSnapshot> toSnapshot() const;
+
+private:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> m_chunks;
+    size_t m_size = 0;
+};
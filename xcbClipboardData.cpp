@@ -0,0 +1,896 @@
+#include "xcbClipboardData.hpp"
+#include "stats.hpp"
+
+#include <xcb/xfixes.h>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstring> // std::memcpy
+#include <future>
+#include <stdexcept>
+
+namespace
+{
+// Same as Qt. An owner that takes longer is treated as having refused
+constexpr std::chrono::milliseconds TRANSFER_TIMEOUT(5000);
+
+uint8_t eventType(const xcb_generic_event_t& event)
+{
+    // Highest bit is set for events sent with SendEvent
+    return event.response_type & ~0x80;
+}
+} // namespace
+
+XcbClipboardData::Selection::Selection(Mode mode, size_t historyCount, size_t historyBytes)
+    : mode(mode), history(historyCount, historyBytes)
+{
+}
+
+XcbClipboardData::XcbClipboardData(const ClipboardDataOptions& options, ClipboardServices& services, const char* displayName)
+    : m_lazy(options.fetchesLazily()), m_stream(options.stream), m_xThreadId(std::this_thread::get_id()), m_blobStore(services.blobStore),
+      m_formatConverter(services.formatConverter), m_prefetcher(services.prefetcher),
+      m_memoryBudget(services.memoryBudget), m_historyCompressor(services.historyCompressor),
+      m_clipboard(Mode::Clipboard, options.historyCount, options.historyBytes),
+      // History is only kept for the clipboard. The selection changes with every mouse selection, so its history would be mostly noise
+      m_selection(Mode::Selection, 0, options.historyBytes)
+{
+    int screenNumber = 0;
+    m_connection = xcb_connect(displayName, &screenNumber);
+    if (xcb_connection_has_error(m_connection))
+    {
+        xcb_disconnect(m_connection);
+        throw std::runtime_error(displayName ? std::string("Can't connect to X display ") + displayName : "Can't connect to X display");
+    }
+    const xcb_query_extension_reply_t* xfixes = xcb_get_extension_data(m_connection, &xcb_xfixes_id);
+    if (!xfixes || !xfixes->present)
+    {
+        xcb_disconnect(m_connection);
+        throw std::runtime_error("X server doesn't support XFixes");
+    }
+    m_xfixesFirstEvent = xfixes->first_event;
+    // Must be queried before any other XFixes request
+    XcbPointer<xcb_xfixes_query_version_reply_t>(xcb_xfixes_query_version_reply(
+        m_connection, xcb_xfixes_query_version(m_connection, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION), nullptr));
+
+    // Leave room for the request header
+    m_maxChunkBytes = std::min<size_t>(xcb_get_maximum_request_length(m_connection) * 4 - 100, 1024 * 1024);
+
+    xcb_screen_iterator_t screenIterator = xcb_setup_roots_iterator(xcb_get_setup(m_connection));
+    for (int i = 0; i < screenNumber && screenIterator.rem; ++i)
+    {
+        xcb_screen_next(&screenIterator);
+    }
+    const xcb_screen_t* screen = screenIterator.data;
+    m_window = xcb_generate_id(m_connection);
+    const uint32_t eventMask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+    xcb_create_window(m_connection, XCB_COPY_FROM_PARENT, m_window, screen->root, 0, 0, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY,
+                      screen->root_visual, XCB_CW_EVENT_MASK, &eventMask);
+
+    m_clipboard.atom = internAtom("CLIPBOARD");
+    m_selection.atom = XCB_ATOM_PRIMARY;
+    m_targetsAtom = internAtom("TARGETS");
+    m_timestampAtom = internAtom("TIMESTAMP");
+    m_incrAtom = internAtom("INCR");
+    m_utf8StringAtom = internAtom("UTF8_STRING");
+    m_transferProperty = internAtom("FUSE_CLIPBOARD_TRANSFER");
+    m_timestampProperty = internAtom("FUSE_CLIPBOARD_TIMESTAMP");
+
+    m_wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (m_wakeFd == -1)
+    {
+        xcb_disconnect(m_connection);
+        throw std::runtime_error("Can't create eventfd");
+    }
+
+    const uint32_t selectionEventMask = XCB_XFIXES_SELECTION_EVENT_MASK_SET_SELECTION_OWNER |
+                                        XCB_XFIXES_SELECTION_EVENT_MASK_SELECTION_WINDOW_DESTROY |
+                                        XCB_XFIXES_SELECTION_EVENT_MASK_SELECTION_CLIENT_CLOSE;
+    for (Selection* selection : {&m_clipboard, &m_selection})
+    {
+        xcb_xfixes_select_selection_input(m_connection, m_window, selection->atom, selectionEventMask);
+    }
+    // Owners that got the selection before this point are never reported, so read their contents now
+    for (Selection* selection : {&m_clipboard, &m_selection})
+    {
+        XcbPointer<xcb_get_selection_owner_reply_t> owner(
+            xcb_get_selection_owner_reply(m_connection, xcb_get_selection_owner(m_connection, selection->atom), nullptr));
+        onOwnerChanged(*selection, owner ? owner->owner : static_cast<xcb_window_t>(XCB_WINDOW_NONE), XCB_CURRENT_TIME);
+    }
+}
+
+XcbClipboardData::~XcbClipboardData()
+{
+    xcb_destroy_window(m_connection, m_window);
+    xcb_disconnect(m_connection);
+    close(m_wakeFd);
+}
+
+void XcbClipboardData::run()
+{
+    assert(std::this_thread::get_id() == m_xThreadId);
+    while (!m_quit)
+    {
+        runTasks();
+        bool handledEvents = !m_deferredEvents.empty();
+        while (!m_deferredEvents.empty())
+        {
+            EventPointer event = std::move(m_deferredEvents.front());
+            m_deferredEvents.pop_front();
+            handleEvent(*event);
+        }
+        // Events may already have been read from the socket while waiting for a reply, so the socket isn't readable anymore
+        while (EventPointer event{xcb_poll_for_event(m_connection)})
+        {
+            handleEvent(*event);
+            handledEvents = true;
+        }
+        if (xcb_connection_has_error(m_connection))
+        {
+            break;
+        }
+        // Handling events may have deferred more events
+        if (handledEvents)
+        {
+            continue;
+        }
+        pollfd fds[] = {{xcb_get_file_descriptor(m_connection), POLLIN, 0}, {m_wakeFd, POLLIN, 0}};
+        poll(fds, 2, -1);
+        uint64_t wakeCount;
+        while (read(m_wakeFd, &wakeCount, sizeof(wakeCount)) > 0)
+        {
+        }
+    }
+
+    // Threads waiting for a task must not wait forever
+    {
+        std::lock_guard lock(m_tasksMutex);
+        m_tasksStopped = true;
+    }
+    runTasks();
+    // Nothing can be fetched anymore, so readers waiting for a new snapshot give up
+    notifyStopped();
+}
+
+void XcbClipboardData::quit()
+{
+    m_quit = true;
+    wakeXThread();
+}
+
+void XcbClipboardData::setChangeCallback(ChangeCallback callback)
+{
+    std::lock_guard lock(m_changeCallbackMutex);
+    m_changeCallback = std::move(callback);
+}
+
+std::shared_ptr<const ClipboardSnapshot> XcbClipboardData::snapshot(Mode mode)
+{
+    return selectionForMode(mode).snapshot.load();
+}
+
+std::shared_ptr<const ClipboardHistory::SnapshotList> XcbClipboardData::history(Mode mode)
+{
+    return selectionForMode(mode).history.snapshots();
+}
+
+void XcbClipboardData::setMimeData(const MimeDataList& formats, Mode mode)
+{
+    runInXThread([this, &formats, mode]() { setOwnedSelection(selectionForMode(mode), formats); });
+}
+
+XcbClipboardData::Selection& XcbClipboardData::selectionForMode(Mode mode)
+{
+    switch (mode)
+    {
+    case Mode::Clipboard:
+        return m_clipboard;
+    case Mode::Selection:
+        return m_selection;
+    }
+    assert(false);
+    return m_clipboard;
+}
+
+XcbClipboardData::Selection* XcbClipboardData::selectionForAtom(xcb_atom_t atom)
+{
+    for (Selection* selection : {&m_clipboard, &m_selection})
+    {
+        if (selection->atom == atom)
+        {
+            return selection;
+        }
+    }
+    return nullptr;
+}
+
+bool XcbClipboardData::runInXThread(const std::function<void()>& task)
+{
+    if (std::this_thread::get_id() == m_xThreadId)
+    {
+        task();
+        return true;
+    }
+    std::promise<void> done;
+    {
+        std::lock_guard lock(m_tasksMutex);
+        if (m_tasksStopped)
+        {
+            return false;
+        }
+        m_tasks.push_back([&task, &done]()
+        {
+            task();
+            done.set_value();
+        });
+    }
+    wakeXThread();
+    done.get_future().wait();
+    return true;
+}
+
+void XcbClipboardData::postToXThread(std::function<void()> task)
+{
+    {
+        std::lock_guard lock(m_tasksMutex);
+        if (m_tasksStopped)
+        {
+            return;
+        }
+        m_tasks.push_back(std::move(task));
+    }
+    wakeXThread();
+}
+
+void XcbClipboardData::runTasks()
+{
+    std::deque<std::function<void()>> tasks;
+    {
+        std::lock_guard lock(m_tasksMutex);
+        tasks.swap(m_tasks);
+    }
+    for (const std::function<void()>& task : tasks)
+    {
+        task();
+    }
+}
+
+void XcbClipboardData::wakeXThread()
+{
+    const uint64_t one = 1;
+    [[maybe_unused]] ssize_t written = write(m_wakeFd, &one, sizeof(one));
+}
+
+xcb_atom_t XcbClipboardData::internAtom(const std::string& name)
+{
+    auto it = m_atoms.find(name);
+    if (it != m_atoms.end())
+    {
+        return it->second;
+    }
+    XcbPointer<xcb_intern_atom_reply_t> reply(
+        xcb_intern_atom_reply(m_connection, xcb_intern_atom(m_connection, 0, name.size(), name.c_str()), nullptr));
+    const xcb_atom_t atom = reply ? reply->atom : static_cast<xcb_atom_t>(XCB_ATOM_NONE);
+    if (atom != XCB_ATOM_NONE)
+    {
+        m_atoms.emplace(name, atom);
+        m_atomNames.emplace(atom, name);
+    }
+    return atom;
+}
+
+std::vector<std::string> XcbClipboardData::atomNames(const std::vector<xcb_atom_t>& atoms)
+{
+    std::vector<std::optional<xcb_get_atom_name_cookie_t>> cookies(atoms.size());
+    for (size_t i = 0; i < atoms.size(); ++i)
+    {
+        if (m_atomNames.find(atoms[i]) == m_atomNames.end())
+        {
+            cookies[i] = xcb_get_atom_name(m_connection, atoms[i]);
+        }
+    }
+    std::vector<std::string> names(atoms.size());
+    for (size_t i = 0; i < atoms.size(); ++i)
+    {
+        if (cookies[i])
+        {
+            XcbPointer<xcb_get_atom_name_reply_t> reply(xcb_get_atom_name_reply(m_connection, *cookies[i], nullptr));
+            if (!reply)
+            {
+                continue;
+            }
+            std::string name(xcb_get_atom_name_name(reply.get()), xcb_get_atom_name_name_length(reply.get()));
+            m_atoms.emplace(name, atoms[i]);
+            m_atomNames.emplace(atoms[i], name);
+        }
+        names[i] = m_atomNames[atoms[i]];
+    }
+    return names;
+}
+
+XcbClipboardData::EventPointer XcbClipboardData::waitForEvent(const std::function<bool(const xcb_generic_event_t&)>& predicate)
+{
+    xcb_flush(m_connection);
+    const auto deadline = std::chrono::steady_clock::now() + TRANSFER_TIMEOUT;
+    while (true)
+    {
+        while (EventPointer event{xcb_poll_for_event(m_connection)})
+        {
+            if (predicate(*event))
+            {
+                return event;
+            }
+            switch (eventType(*event))
+            {
+            // Other clients and streams may be waiting for these
+            case XCB_SELECTION_REQUEST:
+            case XCB_SELECTION_CLEAR:
+            case XCB_SELECTION_NOTIFY:
+            case XCB_PROPERTY_NOTIFY:
+                handleEvent(*event);
+                break;
+            default:
+                m_deferredEvents.push_back(std::move(event));
+                break;
+            }
+        }
+        if (xcb_connection_has_error(m_connection))
+        {
+            return nullptr;
+        }
+        const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (remaining.count() <= 0)
+        {
+            return nullptr;
+        }
+        pollfd fd = {xcb_get_file_descriptor(m_connection), POLLIN, 0};
+        poll(&fd, 1, remaining.count());
+    }
+}
+
+void XcbClipboardData::handleEvent(const xcb_generic_event_t& event)
+{
+    const uint8_t type = eventType(event);
+    if (type == m_xfixesFirstEvent + XCB_XFIXES_SELECTION_NOTIFY)
+    {
+        const auto& notify = reinterpret_cast<const xcb_xfixes_selection_notify_event_t&>(event);
+        if (Selection* selection = selectionForAtom(notify.selection))
+        {
+            onOwnerChanged(*selection, notify.owner, notify.selection_timestamp);
+        }
+        return;
+    }
+    switch (type)
+    {
+    case XCB_SELECTION_REQUEST:
+        onSelectionRequest(reinterpret_cast<const xcb_selection_request_event_t&>(event));
+        break;
+    case XCB_SELECTION_CLEAR:
+        // The new owner is reported by XFixes, which publishes its contents
+        if (Selection* selection = selectionForAtom(reinterpret_cast<const xcb_selection_clear_event_t&>(event).selection))
+        {
+            selection->ownedFormats.clear();
+        }
+        break;
+    case XCB_SELECTION_NOTIFY:
+    {
+        const auto& notify = reinterpret_cast<const xcb_selection_notify_event_t&>(event);
+        if (StreamTransfer* transfer = findStreamTransfer(notify.property))
+        {
+            onStreamSelectionNotify(*transfer, notify);
+        }
+        break;
+    }
+    case XCB_PROPERTY_NOTIFY:
+    {
+        const auto& notify = reinterpret_cast<const xcb_property_notify_event_t&>(event);
+        if (notify.window == m_window)
+        {
+            onStreamPropertyNotify(notify);
+        }
+        else
+        {
+            continueIncrSend(notify);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+xcb_timestamp_t XcbClipboardData::serverTime()
+{
+    // Appending nothing to a property doesn't change it, but still reports the time of the change
+    xcb_change_property(m_connection, XCB_PROP_MODE_APPEND, m_window, m_timestampProperty, XCB_ATOM_INTEGER, 32, 0, nullptr);
+    EventPointer event = waitForEvent([this](const xcb_generic_event_t& event)
+    {
+        if (eventType(event) != XCB_PROPERTY_NOTIFY)
+        {
+            return false;
+        }
+        const auto& notify = reinterpret_cast<const xcb_property_notify_event_t&>(event);
+        return notify.window == m_window && notify.atom == m_timestampProperty;
+    });
+    return event ? reinterpret_cast<const xcb_property_notify_event_t&>(*event).time : XCB_CURRENT_TIME;
+}
+
+void XcbClipboardData::onOwnerChanged(Selection& selection, xcb_window_t owner, xcb_timestamp_t ownerTime)
+{
+    // setMimeData() already published the contents
+    if (owner == m_window && !selection.ownedFormats.empty())
+    {
+        return;
+    }
+    const Stats::ScopedTimer timer(Stats::Timer::ClipboardChange);
+    selection.ownedFormats.clear();
+    selection.prefetchedData.clear();
+    selection.ownerTime = ownerTime;
+    const uint64_t generation = ++selection.generation;
+
+    // New snapshot is built without blocking readers of the old one, then published at once
+    auto targets = std::make_shared<std::unordered_map<std::string, xcb_atom_t>>();
+    if (owner != XCB_WINDOW_NONE)
+    {
+        const std::optional<std::string> targetsData = convertSelection(selection, m_targetsAtom);
+        if (targetsData)
+        {
+            std::vector<xcb_atom_t> atoms(targetsData->size() / sizeof(xcb_atom_t));
+            std::memcpy(atoms.data(), targetsData->data(), atoms.size() * sizeof(xcb_atom_t));
+            const std::vector<std::string> names = atomNames(atoms);
+            for (size_t i = 0; i < atoms.size(); ++i)
+            {
+                // Only mime types can be files
+                if (names[i].find('/') != std::string::npos)
+                {
+                    targets->emplace(names[i], atoms[i]);
+                }
+            }
+            // Most X clients only offer text as UTF8_STRING. Qt shows it as text/plain as well
+            if (targets->find("text/plain") == targets->end() && std::find(atoms.begin(), atoms.end(), m_utf8StringAtom) != atoms.end())
+            {
+                targets->emplace("text/plain", m_utf8StringAtom);
+            }
+        }
+    }
+    // Even if formats aren't lazy, since data the memory budget dropped is fetched again
+    const Mode mode = selection.mode;
+    ClipboardSnapshot::Fetcher fetcher = [this, mode, generation, targets](const std::string& fullMimeType)
+    {
+        auto it = targets->find(fullMimeType);
+        return it != targets->end() ? fetchMimeData(mode, generation, it->second) : nullptr;
+    };
+    selection.targets = targets;
+    auto snapshot = std::make_shared<ClipboardSnapshot>(generation, std::move(fetcher), &m_memoryBudget);
+    for (const auto& [fullMimeType, target] : *targets)
+    {
+        snapshot->addMimeType(fullMimeType, m_lazy ? nullptr : m_blobStore.intern(convertToMimeData(selection, target)));
+    }
+    m_formatConverter.addConvertedFormats(*snapshot);
+    publish(selection, snapshot);
+    // Transferred while the owner is known to be the same. Only the transfers are done here, the rest on the prefetcher's workers
+    if (m_prefetcher.isEnabled())
+    {
+        m_prefetcher.prefetch(snapshot,
+                              [this, &selection, &targets](const std::string& fullMimeType) -> std::shared_ptr<const MimeDataSnapshot>
+                              {
+                                  auto it = targets->find(fullMimeType);
+                                  if (it == targets->end())
+                                  {
+                                      return nullptr;
+                                  }
+                                  std::shared_ptr<const MimeDataSnapshot> data = convertToMimeData(selection, it->second);
+                                  selection.prefetchedData[it->second] = data;
+                                  return data;
+                              },
+                              &m_blobStore);
+    }
+}
+
+std::optional<std::string> XcbClipboardData::convertSelection(const Selection& selection, xcb_atom_t target)
+{
+    xcb_delete_property(m_connection, m_window, m_transferProperty);
+    xcb_convert_selection(m_connection, m_window, selection.atom, target, m_transferProperty, selection.ownerTime);
+    EventPointer event = waitForEvent([this, &selection, target](const xcb_generic_event_t& event)
+    {
+        if (eventType(event) != XCB_SELECTION_NOTIFY)
+        {
+            return false;
+        }
+        const auto& notify = reinterpret_cast<const xcb_selection_notify_event_t&>(event);
+        // Refusals have no property, so they can't be told apart from refusals of streams of the same target
+        return notify.selection == selection.atom && notify.target == target &&
+               (notify.property == m_transferProperty || notify.property == XCB_ATOM_NONE);
+    });
+    if (!event || reinterpret_cast<const xcb_selection_notify_event_t&>(*event).property == XCB_ATOM_NONE)
+    {
+        return {};
+    }
+    auto [type, data] = readProperty(m_transferProperty);
+    // Deleting the INCR property asks the owner for the first chunk
+    if (type == m_incrAtom)
+    {
+        return receiveIncr();
+    }
+    return std::move(data);
+}
+
+std::pair<xcb_atom_t, std::string> XcbClipboardData::readProperty(xcb_atom_t property)
+{
+    xcb_atom_t type = XCB_ATOM_NONE;
+    std::string data;
+    // Offset and length are in units of 4 bytes
+    uint32_t offset = 0;
+    while (true)
+    {
+        // Property is deleted by the request that reads its end
+        XcbPointer<xcb_get_property_reply_t> reply(xcb_get_property_reply(
+            m_connection, xcb_get_property(m_connection, 1, m_window, property, XCB_GET_PROPERTY_TYPE_ANY, offset, m_maxChunkBytes / 4),
+            nullptr));
+        if (!reply)
+        {
+            return {type, std::move(data)};
+        }
+        type = reply->type;
+        const int length = xcb_get_property_value_length(reply.get());
+        data.append(static_cast<const char*>(xcb_get_property_value(reply.get())), length);
+        if (reply->bytes_after == 0)
+        {
+            return {type, std::move(data)};
+        }
+        offset += length / 4;
+    }
+}
+
+std::optional<std::string> XcbClipboardData::receiveIncr()
+{
+    std::string data;
+    while (true)
+    {
+        EventPointer event = waitForEvent([this](const xcb_generic_event_t& event)
+        {
+            if (eventType(event) != XCB_PROPERTY_NOTIFY)
+            {
+                return false;
+            }
+            const auto& notify = reinterpret_cast<const xcb_property_notify_event_t&>(event);
+            return notify.window == m_window && notify.atom == m_transferProperty && notify.state == XCB_PROPERTY_NEW_VALUE;
+        });
+        if (!event)
+        {
+            return {};
+        }
+        // Reading deletes the property, which asks the owner for the next chunk. An empty chunk ends the transfer
+        const std::string chunk = readProperty(m_transferProperty).second;
+        if (chunk.empty())
+        {
+            return data;
+        }
+        data += chunk;
+    }
+}
+
+std::shared_ptr<const MimeDataSnapshot> XcbClipboardData::fetchMimeData(Mode mode, uint64_t generation, xcb_atom_t target)
+{
+    std::shared_ptr<const MimeDataSnapshot> result;
+    const bool ran = runInXThread([this, mode, generation, target, &result]()
+    {
+        const Selection& selection = selectionForMode(mode);
+        // Owner changed since the snapshot was made, so its data is gone
+        if (generation != selection.generation)
+        {
+            return;
+        }
+        // Prefetched after the reader started waiting, but not provided to the snapshot yet
+        auto it = selection.prefetchedData.find(target);
+        if (it != selection.prefetchedData.end())
+        {
+            result = it->second.lock();
+        }
+        if (!result)
+        {
+            result = convertToMimeData(selection, target);
+        }
+    });
+    // X thread stopped, so nothing can be fetched anymore. Readers waiting for a new snapshot are woken by notifyStopped()
+    if (!ran)
+    {
+        return nullptr;
+    }
+    // Interned by the reader, so the X thread only transfers the data and isn't held up hashing it
+    return result ? m_blobStore.intern(std::move(result)) : nullptr;
+}
+
+std::shared_ptr<const MimeDataSnapshot> XcbClipboardData::convertToMimeData(const Selection& selection, xcb_atom_t target)
+{
+    // Like Qt, a format the owner refuses to convert is empty
+    std::optional<std::string> data = convertSelection(selection, target);
+    if (data)
+    {
+        Stats::add(Stats::Counter::FetchedBytes, data->size());
+    }
+    return std::make_shared<StringMimeDataSnapshot>(data ? std::move(*data) : std::string());
+}
+
+bool XcbClipboardData::canStream() const
+{
+    return m_stream;
+}
+
+std::shared_ptr<MimeDataStream> XcbClipboardData::openStream(const ClipboardSnapshot& snapshot, const std::string& fullMimeType, Mode mode)
+{
+    if (!m_stream)
+    {
+        return nullptr;
+    }
+    std::shared_ptr<MimeDataStream> stream;
+    runInXThread([this, &snapshot, &fullMimeType, mode, &stream]()
+    {
+        const Selection& selection = selectionForMode(mode);
+        // Owner changed since the snapshot was made, so its data is gone
+        if (snapshot.generation() != selection.generation || !selection.targets)
+        {
+            return;
+        }
+        auto it = selection.targets->find(fullMimeType);
+        if (it != selection.targets->end())
+        {
+            stream = startStream(selection, it->second);
+        }
+    });
+    return stream;
+}
+
+std::shared_ptr<MimeDataStream> XcbClipboardData::startStream(const Selection& selection, xcb_atom_t target)
+{
+    xcb_atom_t property;
+    if (!m_freeStreamProperties.empty())
+    {
+        property = m_freeStreamProperties.back();
+        m_freeStreamProperties.pop_back();
+    }
+    else
+    {
+        property = internAtom("FUSE_CLIPBOARD_STREAM_" + std::to_string(m_streamPropertiesCount++));
+    }
+    // Called from the reader's thread, so they are handled on the X thread without making the reader wait
+    auto stream = std::make_shared<MimeDataStream>(
+        [this, property]() { postToXThread([this, property]() { resumeStream(property); }); },
+        [this, property]() { postToXThread([this, property]() { closeStream(property, false); }); });
+    m_streamTransfers.push_back({property, stream});
+    xcb_delete_property(m_connection, m_window, property);
+    xcb_convert_selection(m_connection, m_window, selection.atom, target, property, selection.ownerTime);
+    xcb_flush(m_connection);
+    return stream;
+}
+
+XcbClipboardData::StreamTransfer* XcbClipboardData::findStreamTransfer(xcb_atom_t property)
+{
+    auto it = std::find_if(m_streamTransfers.begin(), m_streamTransfers.end(),
+                           [property](const StreamTransfer& transfer) { return transfer.property == property; });
+    return it != m_streamTransfers.end() ? &*it : nullptr;
+}
+
+void XcbClipboardData::onStreamSelectionNotify(StreamTransfer& transfer, const xcb_selection_notify_event_t& notify)
+{
+    if (notify.property == XCB_ATOM_NONE)
+    {
+        transfer.stream->fail();
+        closeStream(transfer.property, true);
+        return;
+    }
+    auto [type, data] = readProperty(transfer.property);
+    // Deleting the INCR property asks the owner for the first chunk
+    if (type == m_incrAtom)
+    {
+        transfer.incr = true;
+        return;
+    }
+    if (!data.empty())
+    {
+        transfer.stream->push(std::move(data));
+    }
+    transfer.stream->finish();
+    closeStream(transfer.property, true);
+}
+
+void XcbClipboardData::onStreamPropertyNotify(const xcb_property_notify_event_t& event)
+{
+    StreamTransfer* transfer = findStreamTransfer(event.atom);
+    // Before the owner answers with INCR, new values are the answer itself, which is read on SelectionNotify
+    if (!transfer || !transfer->incr || event.state != XCB_PROPERTY_NEW_VALUE)
+    {
+        return;
+    }
+    transfer->chunkWaiting = true;
+    resumeStream(transfer->property);
+}
+
+void XcbClipboardData::resumeStream(xcb_atom_t property)
+{
+    StreamTransfer* transfer = findStreamTransfer(property);
+    if (!transfer || !transfer->chunkWaiting || !transfer->stream->wantsChunk())
+    {
+        return;
+    }
+    transfer->chunkWaiting = false;
+    // Reading deletes the property, which asks the owner for the next chunk. An empty chunk ends the transfer
+    std::string chunk = readProperty(property).second;
+    if (chunk.empty())
+    {
+        transfer->stream->finish();
+        closeStream(property, true);
+        return;
+    }
+    transfer->stream->push(std::move(chunk));
+}
+
+void XcbClipboardData::closeStream(xcb_atom_t property, bool reuseProperty)
+{
+    auto it = std::find_if(m_streamTransfers.begin(), m_streamTransfers.end(),
+                           [property](const StreamTransfer& transfer) { return transfer.property == property; });
+    if (it == m_streamTransfers.end())
+    {
+        return;
+    }
+    m_streamTransfers.erase(it);
+    // An owner in the middle of INCR may still write to the property, which would mix into another stream
+    if (reuseProperty)
+    {
+        m_freeStreamProperties.push_back(property);
+    }
+    else
+    {
+        xcb_delete_property(m_connection, m_window, property);
+        xcb_flush(m_connection);
+    }
+}
+
+void XcbClipboardData::onSelectionRequest(const xcb_selection_request_event_t& request)
+{
+    // Obsolete clients don't give a property, and expect the target to be used
+    const xcb_atom_t property = request.property == XCB_ATOM_NONE ? request.target : request.property;
+    bool sent = false;
+    const Selection* selection = selectionForAtom(request.selection);
+    if (selection && !selection->ownedFormats.empty() && (request.time == XCB_CURRENT_TIME || request.time >= selection->ownerTime))
+    {
+        sent = sendSelection(*selection, request.requestor, property, request.target);
+    }
+
+    xcb_selection_notify_event_t notify = {};
+    notify.response_type = XCB_SELECTION_NOTIFY;
+    notify.time = request.time;
+    notify.requestor = request.requestor;
+    notify.selection = request.selection;
+    notify.target = request.target;
+    notify.property = sent ? property : static_cast<xcb_atom_t>(XCB_ATOM_NONE);
+    // Events are sent as 32 bytes, which is more than the struct
+    char eventBuffer[32] = {};
+    std::memcpy(eventBuffer, &notify, sizeof(notify));
+    xcb_send_event(m_connection, 0, request.requestor, XCB_EVENT_MASK_NO_EVENT, eventBuffer);
+    xcb_flush(m_connection);
+}
+
+bool XcbClipboardData::sendSelection(const Selection& selection, xcb_window_t requestor, xcb_atom_t property, xcb_atom_t target)
+{
+    if (target == m_targetsAtom)
+    {
+        std::vector<xcb_atom_t> targets = {m_targetsAtom, m_timestampAtom};
+        for (const auto& [formatAtom, data] : selection.ownedFormats)
+        {
+            targets.push_back(formatAtom);
+        }
+        xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, requestor, property, XCB_ATOM_ATOM, 32, targets.size(), targets.data());
+        return true;
+    }
+    if (target == m_timestampAtom)
+    {
+        xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, requestor, property, XCB_ATOM_INTEGER, 32, 1, &selection.ownerTime);
+        return true;
+    }
+    auto it = std::find_if(selection.ownedFormats.begin(), selection.ownedFormats.end(),
+                           [target](const auto& format) { return format.first == target; });
+    if (it == selection.ownedFormats.end())
+    {
+        return false;
+    }
+    const std::string_view data = it->second->data();
+    if (data.size() <= m_maxChunkBytes)
+    {
+        xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, requestor, property, target, 8, data.size(), data.data());
+        return true;
+    }
+    // Too large for one request. The requestor deletes the INCR property to ask for each chunk
+    const uint32_t eventMask = XCB_EVENT_MASK_PROPERTY_CHANGE;
+    xcb_change_window_attributes(m_connection, requestor, XCB_CW_EVENT_MASK, &eventMask);
+    const uint32_t sizeLowerBound = std::min<size_t>(data.size(), UINT32_MAX);
+    xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, requestor, property, m_incrAtom, 32, 1, &sizeLowerBound);
+    // A new request on the same property replaces an unfinished one
+    m_incrSends.erase(std::remove_if(m_incrSends.begin(), m_incrSends.end(),
+                                     [requestor, property](const IncrSend& send) { return send.requestor == requestor && send.property == property; }),
+                      m_incrSends.end());
+    m_incrSends.push_back({requestor, property, target, it->second, 0});
+    return true;
+}
+
+void XcbClipboardData::continueIncrSend(const xcb_property_notify_event_t& event)
+{
+    if (event.state != XCB_PROPERTY_DELETE)
+    {
+        return;
+    }
+    auto it = std::find_if(m_incrSends.begin(), m_incrSends.end(), [&event](const IncrSend& send)
+                           { return send.requestor == event.window && send.property == event.atom; });
+    if (it == m_incrSends.end())
+    {
+        return;
+    }
+    const std::string_view data = it->data->data();
+    const size_t chunkSize = std::min(m_maxChunkBytes, data.size() - it->offset);
+    // The last chunk is empty
+    xcb_change_property(m_connection, XCB_PROP_MODE_REPLACE, it->requestor, it->property, it->type, 8, chunkSize, data.data() + it->offset);
+    it->offset += chunkSize;
+    if (chunkSize == 0)
+    {
+        const uint32_t eventMask = XCB_EVENT_MASK_NO_EVENT;
+        xcb_change_window_attributes(m_connection, it->requestor, XCB_CW_EVENT_MASK, &eventMask);
+        m_incrSends.erase(it);
+    }
+    xcb_flush(m_connection);
+}
+
+void XcbClipboardData::setOwnedSelection(Selection& selection, const MimeDataList& formats)
+{
+    // ICCCM forbids taking a selection with CurrentTime
+    const xcb_timestamp_t time = serverTime();
+    xcb_set_selection_owner(m_connection, m_window, selection.atom, time);
+    XcbPointer<xcb_get_selection_owner_reply_t> owner(
+        xcb_get_selection_owner_reply(m_connection, xcb_get_selection_owner(m_connection, selection.atom), nullptr));
+    if (!owner || owner->owner != m_window)
+    {
+        return;
+    }
+
+    selection.ownerTime = time;
+    selection.ownedFormats.clear();
+    selection.prefetchedData.clear();
+    selection.targets = nullptr;
+    auto snapshot = std::make_shared<ClipboardSnapshot>(++selection.generation, nullptr, &m_memoryBudget);
+    for (const auto& [fullMimeType, data] : formats)
+    {
+        std::shared_ptr<const MimeDataSnapshot> internedData = m_blobStore.intern(data);
+        selection.ownedFormats.emplace_back(internAtom(fullMimeType), internedData);
+        // Most X clients only ask for UTF8_STRING
+        if ((fullMimeType == "text/plain" || fullMimeType == "text/plain;charset=utf-8") &&
+            std::none_of(selection.ownedFormats.begin(), selection.ownedFormats.end(),
+                         [this](const auto& format) { return format.first == m_utf8StringAtom; }))
+        {
+            selection.ownedFormats.emplace_back(m_utf8StringAtom, internedData);
+        }
+        snapshot->addMimeType(fullMimeType, std::move(internedData));
+    }
+    m_formatConverter.addConvertedFormats(*snapshot);
+    publish(selection, std::move(snapshot));
+}
+
+void XcbClipboardData::publish(Selection& selection, std::shared_ptr<const ClipboardSnapshot> snapshot)
+{
+    std::shared_ptr<const ClipboardSnapshot> oldSnapshot = selection.snapshot.exchange(snapshot);
+    if (oldSnapshot)
+    {
+        oldSnapshot->retire();
+        m_historyCompressor.compressLater(oldSnapshot);
+    }
+    selection.history.push(snapshot);
+    notifyPublished();
+    // Held while calling, so setChangeCallback() can't return while the old callback is running
+    std::lock_guard lock(m_changeCallbackMutex);
+    if (m_changeCallback)
+    {
+        m_changeCallback(selection.mode, oldSnapshot, snapshot);
+    }
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include "blobStore.hpp"
+#include "clipboardData.hpp"
+#include "clipboardHistory.hpp"
+#include "clipboardServices.hpp"
+#include "clipboardSnapshot.hpp"
+#include "formatConverter.hpp"
+#include "historyCompressor.hpp"
+#include "memoryBudget.hpp"
+#include "prefetcher.hpp"
+#include "publishedPtr.hpp"
+#include "mimeDataStream.hpp"
+
+#include <xcb/xcb.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib> // std::free
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Reads the X11 clipboard and primary selection directly over XCB, without Qt
+// Owner changes are reported by XFixes, so nothing is polled. Data larger than a request is transferred with INCR
+// All X traffic happens on the thread that constructed the object and calls run(). Other threads post work to it and wait
+class XcbClipboardData : public ClipboardData
+{
+  public:
+    // Connects to displayName, like ":1", or to the display in $DISPLAY if it is null. services must outlive this object
+    // Throws std::runtime_error if it can't connect, or if the server doesn't support XFixes
+    XcbClipboardData(const ClipboardDataOptions& options, ClipboardServices& services, const char* displayName = nullptr);
+    ~XcbClipboardData();
+
+    // Must be called from the thread that constructed the object
+    void run();
+    void quit();
+
+    void setChangeCallback(ChangeCallback callback);
+
+    std::shared_ptr<const ClipboardSnapshot> snapshot(Mode mode = Mode::Clipboard);
+    std::shared_ptr<const ClipboardHistory::SnapshotList> history(Mode mode = Mode::Clipboard);
+
+    void setMimeData(const MimeDataList& formats, Mode mode = Mode::Clipboard);
+
+    // Streams with INCR, so the reader gets each chunk as soon as the owner sends it
+    bool canStream() const;
+    std::shared_ptr<MimeDataStream> openStream(const ClipboardSnapshot& snapshot, const std::string& fullMimeType, Mode mode = Mode::Clipboard);
+
+  private:
+    struct FreeDeleter
+    {
+        void operator()(void* pointer) const
+        {
+            std::free(pointer);
+        }
+    };
+    // XCB events and replies are allocated with malloc
+    template <typename T>
+    using XcbPointer = std::unique_ptr<T, FreeDeleter>;
+    using EventPointer = XcbPointer<xcb_generic_event_t>;
+
+    // A selection, like CLIPBOARD or PRIMARY
+    struct Selection
+    {
+        Selection(Mode mode, size_t historyCount, size_t historyBytes);
+
+        const Mode mode;
+        xcb_atom_t atom = XCB_ATOM_NONE;
+        ClipboardHistory history;
+        // Only replaced from the X thread
+        PublishedPtr<const ClipboardSnapshot> snapshot;
+
+        // Everything below is only used from the X thread
+        uint64_t generation = 0;
+        // Time the current owner got the selection, used when converting it
+        xcb_timestamp_t ownerTime = XCB_CURRENT_TIME;
+        // Formats served to other clients since setMimeData(). Empty if another client owns the selection
+        std::vector<std::pair<xcb_atom_t, std::shared_ptr<const MimeDataSnapshot>>> ownedFormats;
+        // Full mime type to target of the current owner. Null pointer while this client owns the selection
+        std::shared_ptr<const std::unordered_map<std::string, xcb_atom_t>> targets;
+        // Data of the current owner transferred by the prefetcher, so a reader asking for it before it reaches the snapshot doesn't
+        // transfer it again. Weak, since the snapshot keeps the data once the prefetcher provided it
+        std::unordered_map<xcb_atom_t, std::weak_ptr<const MimeDataSnapshot>> prefetchedData;
+    };
+
+    // Data sent to another client in INCR chunks, one chunk every time the client deletes the property
+    struct IncrSend
+    {
+        xcb_window_t requestor;
+        xcb_atom_t property;
+        xcb_atom_t type;
+        std::shared_ptr<const MimeDataSnapshot> data;
+        size_t offset;
+    };
+
+    // Selection received into its own property of m_window, and handed to a reader chunk by chunk
+    struct StreamTransfer
+    {
+        xcb_atom_t property;
+        std::shared_ptr<MimeDataStream> stream;
+        // Set once the owner answered with INCR
+        bool incr = false;
+        // Set if the owner sent a chunk that waits until the reader wants it
+        bool chunkWaiting = false;
+    };
+
+    const bool m_lazy;
+    const bool m_stream;
+    xcb_connection_t* m_connection = nullptr;
+    // Unmapped window that receives the converted selections and owns the selections set with setMimeData()
+    xcb_window_t m_window = XCB_WINDOW_NONE;
+    uint8_t m_xfixesFirstEvent = 0;
+    // Largest property chunk read or written with one request
+    size_t m_maxChunkBytes = 0;
+    const std::thread::id m_xThreadId;
+
+    xcb_atom_t m_targetsAtom = XCB_ATOM_NONE;
+    xcb_atom_t m_timestampAtom = XCB_ATOM_NONE;
+    xcb_atom_t m_incrAtom = XCB_ATOM_NONE;
+    xcb_atom_t m_utf8StringAtom = XCB_ATOM_NONE;
+    // Property of m_window that selections are converted into
+    xcb_atom_t m_transferProperty = XCB_ATOM_NONE;
+    // Property of m_window that is touched to get the server time
+    xcb_atom_t m_timestampProperty = XCB_ATOM_NONE;
+
+    std::mutex m_changeCallbackMutex;
+    ChangeCallback m_changeCallback;
+    // Shared by the clipboard and the selection, which often hold the same data, and with the clipboards of other displays
+    BlobStore& m_blobStore;
+    FormatConverter& m_formatConverter;
+    Prefetcher& m_prefetcher;
+    MemoryBudget& m_memoryBudget;
+    HistoryCompressor& m_historyCompressor;
+    Selection m_clipboard;
+    Selection m_selection;
+
+    // Work posted by other threads, run by the X thread
+    std::mutex m_tasksMutex;
+    std::deque<std::function<void()>> m_tasks;
+    // Set once run() returned. No more tasks are run after that
+    bool m_tasksStopped = false;
+    // eventfd that wakes the X thread when a task is posted or quit() is called
+    int m_wakeFd = -1;
+    std::atomic<bool> m_quit = false;
+
+    // Everything below is only used from the X thread
+    // Events that arrived while waiting for a transfer, handled once it is done
+    std::deque<EventPointer> m_deferredEvents;
+    std::unordered_map<std::string, xcb_atom_t> m_atoms;
+    std::unordered_map<xcb_atom_t, std::string> m_atomNames;
+    std::vector<IncrSend> m_incrSends;
+    std::vector<StreamTransfer> m_streamTransfers;
+    // Properties of finished streams, reused by new streams
+    std::vector<xcb_atom_t> m_freeStreamProperties;
+    size_t m_streamPropertiesCount = 0;
+
+    Selection& selectionForMode(Mode mode);
+    // Null pointer if atom isn't a selection that is watched
+    Selection* selectionForAtom(xcb_atom_t atom);
+
+    // Runs task on the X thread and waits for it. Returns false if the X thread has stopped, so task didn't run
+    bool runInXThread(const std::function<void()>& task);
+    // Runs task on the X thread without waiting for it. Dropped if the X thread has stopped
+    void postToXThread(std::function<void()> task);
+    void runTasks();
+    void wakeXThread();
+
+    xcb_atom_t internAtom(const std::string& name);
+    // Names of atoms, in the same order. Requests for all of them are sent before waiting for any reply
+    std::vector<std::string> atomNames(const std::vector<xcb_atom_t>& atoms);
+
+    // Waits up to the transfer timeout for an event that predicate accepts. Null pointer on timeout or connection error
+    // Requests for selections this client owns are served while waiting. Other events are handled after the transfer
+    EventPointer waitForEvent(const std::function<bool(const xcb_generic_event_t&)>& predicate);
+    void handleEvent(const xcb_generic_event_t& event);
+    xcb_timestamp_t serverTime();
+
+    // Receiving selections
+    void onOwnerChanged(Selection& selection, xcb_window_t owner, xcb_timestamp_t ownerTime);
+    // Optional has no data if the owner refused or didn't answer in time
+    std::optional<std::string> convertSelection(const Selection& selection, xcb_atom_t target);
+    // Reads and deletes a property of m_window, in chunks if needed. Returns type and data
+    std::pair<xcb_atom_t, std::string> readProperty(xcb_atom_t property);
+    std::optional<std::string> receiveIncr();
+    // Fetcher of lazy snapshots. Can be called from any thread
+    std::shared_ptr<const MimeDataSnapshot> fetchMimeData(Mode mode, uint64_t generation, xcb_atom_t target);
+    // Not interned yet
+    std::shared_ptr<const MimeDataSnapshot> convertToMimeData(const Selection& selection, xcb_atom_t target);
+
+    // Streaming selections. Chunks are only read from the property when the reader wants them,
+    // and the owner only sends the next chunk after the property was read
+    std::shared_ptr<MimeDataStream> startStream(const Selection& selection, xcb_atom_t target);
+    StreamTransfer* findStreamTransfer(xcb_atom_t property);
+    void onStreamSelectionNotify(StreamTransfer& transfer, const xcb_selection_notify_event_t& notify);
+    void onStreamPropertyNotify(const xcb_property_notify_event_t& event);
+    // Reads a waiting chunk if the reader wants it. Ends the transfer on the last chunk
+    void resumeStream(xcb_atom_t property);
+    void closeStream(xcb_atom_t property, bool reuseProperty);
+
+    // Serving selections set with setMimeData()
+    void onSelectionRequest(const xcb_selection_request_event_t& request);
+    // False if target isn't offered
+    bool sendSelection(const Selection& selection, xcb_window_t requestor, xcb_atom_t property, xcb_atom_t target);
+    void continueIncrSend(const xcb_property_notify_event_t& event);
+    void setOwnedSelection(Selection& selection, const MimeDataList& formats);
+
+    void publish(Selection& selection, std::shared_ptr<const ClipboardSnapshot> snapshot);
+};